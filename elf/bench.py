@@ -0,0 +1,405 @@
+#!/usr/bin/env python3
+#
+# Benchmark the ELF files: startup latency, dynamic linker cost, child processes
+# and syscalls of each one, as a single CSV or JSON table. Meant to be run
+# against the offline stand-in server (see `make bench` and ../serve.py), so
+# that network time is the same for all of them.
+#
+# For each file:
+#
+#   - It is run -n times, measuring wall time from spawn to exit, and user/sys
+#     CPU time of it and of any child it waited for (wait4).
+#   - It is run once with LD_DEBUG=statistics, summing the dynamic loader
+#     startup time and relocations of every dynamically linked process
+#     involved (e.g. /bin/curl for the exec_* files, which are static).
+#   - It is run once with LD_DEBUG=statistics,bindings, counting the symbols
+#     bound lazily after startup, i.e. through _dl_runtime_resolve.
+#   - It is run once under a minimal ptrace-based tracer, counting syscalls
+#     (32-bit ones too) and processes across forks.
+#
+# A baseline row for /bin/true shows the overhead of spawning a process.
+#
+
+import ctypes
+import json
+import os
+import re
+import resource
+import signal
+import sys
+
+from argparse import ArgumentParser, Namespace
+from collections import Counter
+from pathlib import Path
+from statistics import mean, median
+from subprocess import Popen, DEVNULL, TimeoutExpired
+from tempfile import TemporaryDirectory
+from time import perf_counter_ns
+from typing import Dict, List, Optional, Tuple
+
+
+BGGP5_DATA = b'Another #BGGP5 download!! @binarygolf https://binary.golf\n'
+BGGP5_URL = 'https://binary.golf/5/5'
+BASELINE = '/bin/true'
+# Max time for a single run
+RUN_TIMEOUT = 30
+# Top syscalls listed in CSV output
+CSV_TOP_SYSCALLS = 5
+
+UNISTD_64 = '/usr/include/x86_64-linux-gnu/asm/unistd_64.h'
+UNISTD_32 = '/usr/include/x86_64-linux-gnu/asm/unistd_32.h'
+
+PTRACE_TRACEME    = 0
+PTRACE_PEEKUSER   = 3
+PTRACE_SYSCALL    = 24
+PTRACE_SETOPTIONS = 0x4200
+PTRACE_O_TRACESYSGOOD = 0x1
+PTRACE_O_TRACEFORK    = 0x2
+PTRACE_O_TRACEVFORK   = 0x4
+PTRACE_O_TRACECLONE   = 0x8
+PTRACE_O_TRACEEXEC    = 0x10
+PTRACE_O_EXITKILL     = 0x100000
+PTRACE_EVENT_EXEC     = 4
+# Offsets in struct user_regs_struct (x86_64)
+REG_ORIG_RAX = 15 * 8
+REG_CS       = 17 * 8
+# Code segment selector of 32-bit processes
+USER32_CS = 0x23
+WALL = 0x40000000
+
+CSV_COLUMNS = [
+	'file', 'kind', 'size', 'runs', 'ok', 'wall_ms_min', 'wall_ms_median',
+	'wall_ms_mean', 'wall_ms_max', 'user_ms_median', 'sys_ms_median',
+	'ld_startup_cycles', 'ld_relocations', 'ld_lazy_bindings', 'processes',
+	'execs', 'syscalls', 'syscalls_top'
+]
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.ptrace.restype = ctypes.c_long
+libc.ptrace.argtypes = [ctypes.c_long, ctypes.c_long, ctypes.c_void_p, ctypes.c_void_p]
+
+
+def log(*a, **kwa):
+	print(*a, **kwa, file=sys.stderr, flush=True)
+
+
+def parse_args() -> Namespace:
+	ap = ArgumentParser(description='Benchmark startup latency and syscalls '
+		'of the ELF files, best run through `make bench`')
+	ap.add_argument('files', metavar='FILE', nargs='+', type=Path)
+	ap.add_argument('-n', '--runs', type=int, default=20,
+		help='timed runs per file (default: 20)')
+	ap.add_argument('-o', '--output', type=Path,
+		help='output file, JSON if it ends in .json, CSV otherwise (default: CSV to stdout)')
+	ap.add_argument('--json', action='store_true', help='output JSON')
+	args = ap.parse_args()
+
+	if args.runs < 1:
+		ap.error('--runs must be at least 1')
+	if args.output is not None and args.output.suffix == '.json':
+		args.json = True
+
+	return args
+
+
+def syscall_names(header: str) -> Dict[int, str]:
+	try:
+		text = Path(header).read_text()
+	except OSError:
+		return {}
+
+	return {int(n): name for name, n in re.findall(r'#define __NR_(\w+)\s+(\d+)', text)}
+
+
+SYSCALLS_64 = syscall_names(UNISTD_64)
+SYSCALLS_32 = syscall_names(UNISTD_32)
+
+
+def invocation(f: Path) -> Optional[Tuple[List[str], Optional[str]]]:
+	'''argv and cwd to run a file with, according to the notes in README.md, or
+	None if it cannot be run here'''
+	argv = [str(f.resolve())]
+	cwd = None
+
+	if 'needs_arg' in f.name or f.name == 'libcurl_multi':
+		argv.append(BGGP5_URL)
+	elif f.name == 'io_uring_batch':
+		# No DNS, talks plain HTTP to the stand-in server directly
+		argv.append('127.0.0.1/5/5')
+	elif 'pwd_trick' in f.name:
+		cwd = '/' + BGGP5_URL.split('//', 1)[1]
+		if not os.path.isdir(cwd):
+			return None
+
+	return argv, cwd
+
+
+def timed_run(argv: List[str], cwd: Optional[str], out) -> Tuple[int, int, resource.struct_rusage]:
+	'''Run once, returning wall time in ns, exit status and rusage'''
+	out.seek(0)
+	out.truncate()
+
+	start = perf_counter_ns()
+	p = Popen(argv, cwd=cwd, stdin=DEVNULL, stdout=out, stderr=DEVNULL)
+
+	try:
+		signal.alarm(RUN_TIMEOUT)
+		_, status, rusage = os.wait4(p.pid, 0)
+	except TimeoutError:
+		p.kill()
+		p.wait()
+		raise
+	finally:
+		signal.alarm(0)
+
+	elapsed = perf_counter_ns() - start
+	p.returncode = os.waitstatus_to_exitcode(status)
+	return elapsed, p.returncode, rusage
+
+
+def ld_debug(argv: List[str], cwd: Optional[str], tmpdir: Path, what: str) -> List[str]:
+	'''Run once with LD_DEBUG=what, returning the log of each dynamically
+	linked process involved'''
+	prefix = tmpdir / 'ld'
+	env = dict(os.environ, LD_DEBUG=what, LD_DEBUG_OUTPUT=str(prefix))
+
+	p = Popen(argv, cwd=cwd, env=env, stdin=DEVNULL, stdout=DEVNULL, stderr=DEVNULL)
+
+	try:
+		p.wait(RUN_TIMEOUT)
+	except TimeoutExpired:
+		p.kill()
+		p.wait()
+
+	logs = []
+
+	for f in tmpdir.glob('ld.*'):
+		logs.append(f.read_text(errors='replace'))
+		f.unlink()
+
+	return logs
+
+
+def ld_stats(argv: List[str], cwd: Optional[str], tmpdir: Path) -> Tuple[int, int]:
+	'''Total dynamic loader startup cycles and final number of relocations of
+	all the processes involved in a run'''
+	cycles = relocs = 0
+
+	for text in ld_debug(argv, cwd, tmpdir, 'statistics'):
+		m = re.search(r'total startup time in dynamic loader: (\d+)', text)
+		if m:
+			cycles += int(m.group(1))
+
+		m = re.search(r'final number of relocations: (\d+)', text)
+		if m:
+			relocs += int(m.group(1))
+
+	return cycles, relocs
+
+
+def ld_lazy_bindings(argv: List[str], cwd: Optional[str], tmpdir: Path) -> int:
+	'''Number of symbols bound lazily, i.e. after startup, by _dl_runtime_resolve
+	on their first call (or on every call, for the libcurl_v* stubs). This is a
+	separate run since logging bindings makes startup a lot slower.'''
+	lazy = 0
+
+	for text in ld_debug(argv, cwd, tmpdir, 'statistics,bindings'):
+		# Startup statistics are logged right after startup relocations
+		_, sep, after = text.partition('total startup time in dynamic loader')
+		if sep:
+			lazy += after.count('binding file ')
+
+	return lazy
+
+
+def ptrace(req: int, pid: int, addr: int=0, data: int=0) -> int:
+	return libc.ptrace(req, pid, ctypes.c_void_p(addr), ctypes.c_void_p(data))
+
+
+def traced_run(argv: List[str], cwd: Optional[str]) -> Tuple[Counter, int, int]:
+	'''Run once under ptrace following forks, counting syscalls by name,
+	processes (thread groups) and successful execs'''
+	pid = os.fork()
+
+	if pid == 0:
+		try:
+			null = os.open(os.devnull, os.O_RDWR)
+			for fd in (0, 1, 2):
+				os.dup2(null, fd)
+			if cwd is not None:
+				os.chdir(cwd)
+
+			ptrace(PTRACE_TRACEME, 0)
+			os.kill(os.getpid(), signal.SIGSTOP)
+			os.execv(argv[0], argv)
+		finally:
+			os._exit(127)
+
+	os.waitpid(pid, WALL)
+	ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK
+		| PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC
+		| PTRACE_O_EXITKILL)
+	ptrace(PTRACE_SYSCALL, pid)
+
+	syscalls = Counter()
+	in_syscall = set()
+	tgids = {pid}
+	execs = 0
+
+	signal.alarm(RUN_TIMEOUT)
+
+	try:
+		while 1:
+			try:
+				tid, status = os.waitpid(-1, WALL)
+			except ChildProcessError:
+				break
+
+			if not os.WIFSTOPPED(status):
+				in_syscall.discard(tid)
+				continue
+
+			sig = os.WSTOPSIG(status)
+			inject = 0
+
+			if sig == signal.SIGTRAP | 0x80:
+				# Syscall entry and exit stops alternate, only count entries
+				if tid in in_syscall:
+					in_syscall.remove(tid)
+				else:
+					in_syscall.add(tid)
+					nr = ptrace(PTRACE_PEEKUSER, tid, REG_ORIG_RAX)
+
+					if ptrace(PTRACE_PEEKUSER, tid, REG_CS) == USER32_CS:
+						syscalls[SYSCALLS_32.get(nr, f'32:{nr}')] += 1
+					else:
+						syscalls[SYSCALLS_64.get(nr, str(nr))] += 1
+			elif sig == signal.SIGTRAP and status >> 16:
+				if status >> 16 == PTRACE_EVENT_EXEC:
+					execs += 1
+			elif sig == signal.SIGSTOP and tid not in tgids:
+				# New tracee, stopped right after being attached
+				tgids.add(tgid(tid))
+			else:
+				inject = sig
+
+			ptrace(PTRACE_SYSCALL, tid, 0, inject)
+	except TimeoutError:
+		os.kill(pid, signal.SIGKILL)
+		while 1:
+			try:
+				os.waitpid(-1, WALL)
+			except ChildProcessError:
+				break
+	finally:
+		signal.alarm(0)
+
+	return syscalls, len(tgids), execs
+
+
+def tgid(tid: int) -> int:
+	try:
+		status = Path(f'/proc/{tid}/status').read_text()
+		return int(re.search(r'^Tgid:\s+(\d+)', status, re.M).group(1))
+	except (OSError, AttributeError):
+		return tid
+
+
+def on_alarm(*_):
+	raise TimeoutError
+
+
+def bench(f: Path, runs: int, tmpdir: Path) -> Optional[dict]:
+	inv = invocation(f) if str(f) != BASELINE else ([BASELINE], None)
+	if inv is None:
+		log(f'{f}: skipped, see README.md for how to run it')
+		return None
+
+	argv, cwd = inv
+	wall = []
+	user = []
+	sys_ = []
+	ok = 0
+
+	with open(tmpdir / 'out', 'w+b') as out:
+		for _ in range(runs):
+			try:
+				elapsed, code, rusage = timed_run(argv, cwd, out)
+			except TimeoutError:
+				log(f'{f}: timed out')
+				continue
+
+			out.seek(0)
+			ok += code == 0 and BGGP5_DATA in out.read()
+			wall.append(elapsed / 1e6)
+			user.append(rusage.ru_utime * 1e3)
+			sys_.append(rusage.ru_stime * 1e3)
+
+	if not wall:
+		return None
+
+	cycles, relocs = ld_stats(argv, cwd, tmpdir)
+	lazy = ld_lazy_bindings(argv, cwd, tmpdir)
+	syscalls, processes, execs = traced_run(argv, cwd)
+
+	return {
+		'file': str(f),
+		'kind': f.parent.name if str(f) != BASELINE else 'baseline',
+		'size': f.stat().st_size,
+		'runs': len(wall),
+		'ok': ok,
+		'wall_ms_min': round(min(wall), 3),
+		'wall_ms_median': round(median(wall), 3),
+		'wall_ms_mean': round(mean(wall), 3),
+		'wall_ms_max': round(max(wall), 3),
+		'user_ms_median': round(median(user), 3),
+		'sys_ms_median': round(median(sys_), 3),
+		'ld_startup_cycles': cycles,
+		'ld_relocations': relocs,
+		'ld_lazy_bindings': lazy,
+		'processes': processes,
+		'execs': execs,
+		'syscalls': sum(syscalls.values()),
+		'syscalls_by_name': dict(syscalls.most_common()),
+	}
+
+
+def to_csv(rows: List[dict]) -> str:
+	lines = [','.join(CSV_COLUMNS)]
+
+	for r in rows:
+		top = Counter(r['syscalls_by_name']).most_common(CSV_TOP_SYSCALLS)
+		r = dict(r, syscalls_top=' '.join(f'{k}:{v}' for k, v in top))
+		lines.append(','.join(str(r[c]) for c in CSV_COLUMNS))
+
+	return '\n'.join(lines) + '\n'
+
+
+def main() -> int:
+	args = parse_args()
+	signal.signal(signal.SIGALRM, on_alarm)
+	rows = []
+
+	with TemporaryDirectory(prefix='bggp5-bench-') as tmpdir:
+		for f in [Path(BASELINE)] + args.files:
+			log(f'{f}: {args.runs} runs...')
+			row = bench(f, args.runs, Path(tmpdir))
+
+			if row is not None:
+				rows.append(row)
+				log(f'{f}: {row["wall_ms_median"]} ms median, {row["ok"]}/'
+					f'{row["runs"]} ok, {row["syscalls"]} syscalls')
+
+	out = json.dumps(rows, indent=2) + '\n' if args.json else to_csv(rows)
+
+	if args.output is None:
+		sys.stdout.write(out)
+	else:
+		args.output.write_text(out)
+		log(f'Results written to {args.output}')
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
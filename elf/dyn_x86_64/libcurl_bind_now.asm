@@ -0,0 +1,193 @@
+; 64-bit ET_DYN ELF for Linux x86_64
+;
+;     CURL *h = curl_easy_init()
+;     curl_easy_setopt(h, CURLOPT_URL, "https://binary.golf/5/5")
+;     curl_easy_perform(h)
+;     exit(0)
+;
+; Same as libcurl_v7.asm, but with symbols bound eagerly instead of lazily.
+;
+; The libcurl_v* files call everything through a hand-rolled PLT stub that
+; pushes a relocation index and jumps to _dl_runtime_resolve. Since their
+; relocations do not point to any GOT entry (and there is no DT_PLTREL nor
+; DT_PLTRELSZ, so ld.so does not even look at them at startup), nothing is ever
+; cached and *every* call does a full symbol lookup.
+;
+; Here instead the R_X86_64_JUMP_SLOT relocations point to real GOT entries,
+; and DT_FLAGS = DF_BIND_NOW makes ld.so process all of them before jumping to
+; the entry point, as if LD_BIND_NOW=1 was set. Calls are then simply indirect
+; calls through the GOT: no stub, no _dl_runtime_resolve, and no need for
+; DT_PLTGOT and its 3 reserved entries either (ld.so only fills those in for
+; lazy binding). R_X86_64_GLOB_DAT relocations through DT_RELA would also be
+; processed eagerly, but they need an extra DT_RELASZ and DT_RELAENT.
+;
+; See `make bench` in README.md to compare the two.
+
+[bits 64]
+
+VA:                  equ 0 ; We are ET_DYN, position independent
+FILE_SIZE:           equ file_end
+; phdrs[3].p_align collides with the first 8 bytes of syms[0]
+N_PROGRAM_HEADERS:   equ (symbol_table + 8 - program_headers) / 0x38
+DYNAMIC_SECTION_SZ:  equ dynamic_section_end - dynamic_section
+INTERPRETER_PATH_SZ: equ interpreter_path_end - interpreter_path
+PLT_JMPREL_SZ:       equ plt_jmprel_end - plt_jmprel
+
+CURL_EASY_INIT_STROFF:    equ sym_name_curl_easy_init - string_table
+CURL_EASY_SETOPT_STROFF:  equ sym_name_curl_easy_setopt - string_table
+CURL_EASY_PERFORM_STROFF: equ sym_name_curl_easy_perform - string_table
+DT_NEEDED_LIBCURL_STROFF: equ dt_needed_libcurl - string_table
+
+; ELF header
+db 0x7f, 'ELF'                                  ; e_ident[EI_MAG]
+
+; The kernel literally ignores the rest of e_ident[], start the string table
+; here. Symbol names are just offsets from DT_STRTAB, so it does not need to be
+; contiguous: the rest of the strings are further below.
+string_table:
+	dt_needed_libcurl: db "libcurl.so", 0
+	; 1 byte of space left
+	times 12 - ($ - string_table) db 0
+
+dw 3                                            ; e_type = ET_DYN
+dw 0x3e                                         ; e_machine = EM_X86_64
+dd 1                                            ; e_version
+dq VA + entry                                   ; e_entry
+dq program_headers                              ; e_phoff
+dq 0                                            ; e_shoff
+dd 0                                            ; e_flags
+dw 0x40                                         ; e_ehsize
+dw 0x38                                         ; e_phentsize
+
+program_headers:
+; phdrs[0]
+	dd 6                                        ; phdrs[0].p_type  = PT_PHDR  | e_phnum, e_shentsize
+	dd 4                                        ; phdrs[0].p_flags = R        | e_shnum, e_shstrndx
+; ELF header ends here
+	dq program_headers                          ; phdrs[0].p_offset
+	dq VA + program_headers                     ; phdrs[0].p_vaddr
+	dq VA + program_headers                     ; phdrs[0].p_paddr
+	dq 0x40 * N_PROGRAM_HEADERS                 ; phdrs[0].p_filesz
+	dq 0x40 * N_PROGRAM_HEADERS                 ; phdrs[0].p_memsz
+	dq 8                                        ; phdrs[0].p_align
+
+; phdrs[1]
+	dd 3                                        ; phdrs[1].p_type  = PT_INTERP
+	dd 4                                        ; phdrs[1].p_flags = R
+	dq interpreter_path                         ; phdrs[1].p_offset
+	dq VA + interpreter_path                    ; phdrs[1].p_vaddr
+	dq VA + interpreter_path                    ; phdrs[1].p_paddr
+	dq INTERPRETER_PATH_SZ                      ; phdrs[1].p_filesz
+	dq INTERPRETER_PATH_SZ                      ; phdrs[1].p_memsz
+	dq 1                                        ; phdrs[1].p_align
+
+; phdrs[2]
+	; Load whole file as RWX, the GOT below needs to be writable anyway
+	dd 1                                        ; phdrs[2].p_type  = PT_LOAD
+	dd 7                                        ; phdrs[2].p_flags = RWE
+	dq 0                                        ; phdrs[2].p_offset
+	dq VA                                       ; phdrs[2].p_vaddr
+	dq VA                                       ; phdrs[2].p_paddr
+	dq FILE_SIZE                                ; phdrs[2].p_filesz
+	dq FILE_SIZE                                ; phdrs[2].p_memsz
+	dq 0x1000                                   ; phdrs[2].p_align
+
+; phdrs[3]
+	dd 2                                        ; phdrs[3].p_type  = PT_DYNAMIC
+	dd 6                                        ; phdrs[3].p_flags = RW
+	dq dynamic_section                          ; phdrs[3].p_offset
+	dq VA + dynamic_section                     ; phdrs[3].p_vaddr
+
+; Stuff the GOT here inside last program header, same as libcurl_v7.asm. These
+; are overwritten by ld.so with the addresses of the functions on startup.
+got_curl_easy_init:
+	dq VA + dynamic_section                     ; phdrs[3].p_paddr
+got_curl_easy_setopt:
+	dq DYNAMIC_SECTION_SZ                       ; phdrs[3].p_filesz
+got_curl_easy_perform:
+	dq DYNAMIC_SECTION_SZ                       ; phdrs[3].p_memsz
+
+; Stuff entry point code and symbol table start here too
+entry:
+symbol_table:
+; syms[0]
+; First symbol is dummy. Stuff some code in it.
+	; handle = curl_easy_init()
+	call   [rel got_curl_easy_init]             ; phdrs[3].p_align | syms[0].st_name
+	; Push it twice to keep the stack 16-byte aligned for the calls below
+	push   rax
+	push   rax
+
+	; curl_easy_setopt(handle, CURLOPT_URL, "https://binary.golf/5/5")
+	mov    rdi, rax
+	mov    esi, 0x2712
+	xor    eax, eax                             ; Variadic: no vector regs
+	jmp    code1
+	; 4 bytes of space left
+	times 0x18 - ($ - symbol_table) nop
+
+; The first byte of code in syms[1] and syms[2] is st_other, and its lowest 2
+; bits are the symbol visibility: it must be STV_DEFAULT (0) or ld.so will not
+; look the symbol up. REX.W prefixes (0x48) are good for that.
+
+; syms[1]
+	dd CURL_EASY_INIT_STROFF                    ; syms[1].st_name
+	db 0x12                                     ; syms[1].st_info
+
+code1:                                          ; syms[1].{st_other,st_shndx,st_value,st_size}
+	; (cont'd) curl_easy_setopt
+	lea    rdx, qword [rel url]
+	call   [rel got_curl_easy_setopt]
+	jmp    code2
+	; 4 bytes of space left
+	times 0x13 - ($ - code1) nop
+
+; syms[2]
+	dd CURL_EASY_SETOPT_STROFF                  ; syms[2].st_name
+	db 0x12                                     ; syms[2].st_info
+
+code2:                                          ; syms[2].{st_other,st_shndx,st_value,st_size}
+	; curl_easy_perform(handle)
+	mov    rdi, qword [rsp]
+	call   [rel got_curl_easy_perform]
+
+	; exit(0)
+	mov    eax, 60
+	xor    edi, edi
+	syscall
+	; no space left
+	times 0x13 - ($ - code2) nop
+
+; syms[3]
+	dd CURL_EASY_PERFORM_STROFF                 ; syms[3].st_name
+	; Cheap out on the final bytes, we can collide with the strings below
+symbol_table_end:
+
+url:
+	db "https://binary.golf/5/5", 0             ; syms[3].{st_info,st_other,st_shndx,st_value,st_size}
+interpreter_path:
+	db "/lib64/ld-linux-x86-64.so.2", 0
+interpreter_path_end:
+
+	sym_name_curl_easy_init:    db "curl_easy_init", 0
+	sym_name_curl_easy_setopt:  db "curl_easy_setopt", 0
+	sym_name_curl_easy_perform: db "curl_easy_perform", 0
+
+; RELA relocations for the GOT, one R_X86_64_JUMP_SLOT per symbol
+plt_jmprel:
+	dq got_curl_easy_init,    0x100000007, 0    ; rels[0]
+	dq got_curl_easy_setopt,  0x200000007, 0    ; rels[1]
+	dq got_curl_easy_perform, 0x300000007, 0    ; rels[2]
+plt_jmprel_end:
+
+; Keep this last: the rest of the page is zeroed out, which gives us DT_NULL
+dynamic_section:
+	dq 0x01, DT_NEEDED_LIBCURL_STROFF           ; DT_NEEDED "libcurl.so"
+	dq 0x05, string_table                       ; DT_STRTAB
+	dq 0x06, symbol_table                       ; DT_SYMTAB
+	dq 0x17, plt_jmprel                         ; DT_JMPREL
+	dq 0x02, PLT_JMPREL_SZ                      ; DT_PLTRELSZ
+	dq 0x14, 0x07                               ; DT_PLTREL = DT_RELA
+	dq 0x1e, 0x08                               ; DT_FLAGS = DF_BIND_NOW
+dynamic_section_end:
+file_end:
@@ -0,0 +1,465 @@
+; 64-bit ET_DYN ELF for Linux x86_64
+;
+;     CURLSH *share = curl_share_init()
+;     curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS)
+;     curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION)
+;     curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT)
+;     CURLM *multi = curl_multi_init()
+;     curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX)
+;     curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS)
+;
+;     for i, url in argv[1:]:
+;         CURL *h = curl_easy_init()
+;         curl_easy_setopt(h, CURLOPT_URL, url)
+;         curl_easy_setopt(h, CURLOPT_SHARE, share)
+;         curl_easy_setopt(h, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS)
+;         curl_easy_setopt(h, CURLOPT_PIPEWAIT, 1)
+;         curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_callback)
+;         curl_easy_setopt(h, CURLOPT_WRITEDATA, &bodies[i])
+;         curl_easy_setopt(h, CURLOPT_PRIVATE, &bodies[i])
+;         curl_multi_add_handle(multi, h)
+;
+;     do {
+;         curl_multi_perform(multi, &running)
+;         while ((msg = curl_multi_info_read(multi, &left))):
+;             if (msg->msg == CURLMSG_DONE && msg->data.result == CURLE_OK)
+;                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &body)
+;                 write(1, body->data, body->len)
+;             else
+;                 failed++
+;     } while (running && curl_multi_poll(multi, NULL, 0, 1000, NULL) == CURLM_OK)
+;
+;     exit(failed)
+;
+; Same idea as libcurl_bind_now.asm (real GOT, DF_BIND_NOW), but with the multi
+; interface: all the URLs given as arguments are fetched at once, from a single
+; thread. The share handle gives all the transfers the same DNS cache, TLS
+; session cache and connection pool, and with HTTP/2 (when the server and
+; libcurl support it) transfers to the same host are multiplexed on a single
+; connection: CURLOPT_PIPEWAIT makes them wait for it instead of each opening
+; a new one.
+;
+; Bodies are collected in memory by write_callback and output whole as soon as
+; each transfer completes, so they never get mixed up with each other, but they
+; come out in order of completion, not in the order of the arguments. Each body
+; must fit in BODY_SZ bytes, or its transfer fails. At most MAX_URLS URLs are
+; fetched, the rest are ignored. The exit code is the number of failed ones.
+;
+; Needs libcurl 7.66+ (for curl_multi_poll).
+
+[bits 64]
+
+VA:                  equ 0 ; We are ET_DYN, position independent
+MAX_URLS:            equ 64
+; Over HTTP/1.1, more transfers than this to the same host queue up and reuse
+; connections as they free up. Each HTTP/2 connection takes any number of them.
+MAX_HOST_CONNECTIONS: equ 16
+; struct body { size_t len; char data[BODY_SZ - 8]; }, one per URL
+BODY_SZ:             equ 0x100000
+N_PROGRAM_HEADERS:   equ (program_headers_end - program_headers) / 0x38
+DYNAMIC_SECTION_SZ:  equ dynamic_section_end - dynamic_section
+INTERPRETER_PATH_SZ: equ interpreter_path_end - interpreter_path
+STRING_TABLE_SZ:     equ string_table_end - string_table
+PLT_JMPREL_SZ:       equ plt_jmprel_end - plt_jmprel
+
+CURLSHOPT_SHARE:            equ 1
+CURL_LOCK_DATA_DNS:         equ 3
+CURL_LOCK_DATA_SSL_SESSION: equ 4
+CURL_LOCK_DATA_CONNECT:     equ 5
+CURLMOPT_PIPELINING:        equ 3
+CURLPIPE_MULTIPLEX:         equ 2
+CURLMOPT_MAX_HOST_CONNECTIONS: equ 7
+CURLOPT_WRITEDATA:          equ 10001
+CURLOPT_URL:                equ 10002
+CURLOPT_WRITEFUNCTION:      equ 20011
+CURLOPT_HTTP_VERSION:       equ 84
+CURL_HTTP_VERSION_2TLS:     equ 4
+CURLOPT_SHARE:              equ 10100
+CURLOPT_PRIVATE:            equ 10103
+CURLOPT_PIPEWAIT:           equ 237
+CURLINFO_PRIVATE:           equ 0x100000 + 21
+CURLMSG_DONE:               equ 1
+
+; struct CURLMsg
+MSG_MSG:             equ 0
+MSG_EASY_HANDLE:     equ 8
+MSG_RESULT:          equ 16
+
+SYS_write:           equ 1
+SYS_exit_group:      equ 231
+
+; ELF header
+db 0x7f, 'ELF'                                  ; e_ident[EI_MAG]
+db 2                                            ; e_ident[EI_CLASS]   = ELFCLASS64
+db 1                                            ; e_ident[EI_DATA]    = ELFDATA2LSB
+db 1                                            ; e_ident[EI_VERSION] = EV_CURRENT
+times 16 - ($ - $$) db 0
+
+dw 3                                            ; e_type = ET_DYN
+dw 0x3e                                         ; e_machine = EM_X86_64
+dd 1                                            ; e_version
+dq VA + entry                                   ; e_entry
+dq program_headers                              ; e_phoff
+dq 0                                            ; e_shoff
+dd 0                                            ; e_flags
+dw 0x40                                         ; e_ehsize
+dw 0x38                                         ; e_phentsize
+dw N_PROGRAM_HEADERS                            ; e_phnum
+dw 0                                            ; e_shentsize
+dw 0                                            ; e_shnum
+dw 0                                            ; e_shstrndx
+
+program_headers:
+	dd 6                                        ; p_type  = PT_PHDR
+	dd 4                                        ; p_flags = R
+	dq program_headers                          ; p_offset
+	dq VA + program_headers                     ; p_vaddr
+	dq VA + program_headers                     ; p_paddr
+	dq 0x38 * N_PROGRAM_HEADERS                 ; p_filesz
+	dq 0x38 * N_PROGRAM_HEADERS                 ; p_memsz
+	dq 8                                        ; p_align
+	; ---
+	dd 3                                        ; p_type  = PT_INTERP
+	dd 4                                        ; p_flags = R
+	dq interpreter_path                         ; p_offset
+	dq VA + interpreter_path                    ; p_vaddr
+	dq VA + interpreter_path                    ; p_paddr
+	dq INTERPRETER_PATH_SZ                      ; p_filesz
+	dq INTERPRETER_PATH_SZ                      ; p_memsz
+	dq 1                                        ; p_align
+	; ---
+	; Load whole file as RWX, plus the bodies right after it
+	dd 1                                        ; p_type  = PT_LOAD
+	dd 7                                        ; p_flags = RWE
+	dq 0                                        ; p_offset
+	dq VA                                       ; p_vaddr
+	dq VA                                       ; p_paddr
+	dq file_end                                 ; p_filesz
+	dq file_end + MAX_URLS * BODY_SZ            ; p_memsz
+	dq 0x1000                                   ; p_align
+	; ---
+	dd 2                                        ; p_type  = PT_DYNAMIC
+	dd 6                                        ; p_flags = RW
+	dq dynamic_section                          ; p_offset
+	dq VA + dynamic_section                     ; p_vaddr
+	dq VA + dynamic_section                     ; p_paddr
+	dq DYNAMIC_SECTION_SZ                       ; p_filesz
+	dq DYNAMIC_SECTION_SZ                       ; p_memsz
+	dq 8                                        ; p_align
+program_headers_end:
+
+entry:
+	; Registers used throughout, all callee-saved:
+	;   rbx = multi handle, r12 = share handle, r13 = &argv[i],
+	;   r14 = URLs left to add, then failed transfers,
+	;   r15 = current easy handle, rbp = current body
+	; rsp is 16-byte aligned here: keep it that way, with 16 bytes for locals
+	; (int running, int left, struct body *body).
+	mov    r14, [rsp]                           ; argc
+	lea    r13, [rsp + 16]                      ; &argv[1]
+	dec    r14
+	mov    eax, MAX_URLS
+	cmp    r14, rax
+	cmova  r14, rax
+	sub    rsp, 16
+
+	; share = curl_share_init()
+	call   [rel got_curl_share_init]
+	mov    r12, rax
+
+	; curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_*) for the DNS
+	; cache, TLS sessions and connections
+	mov    rdi, r12
+	mov    esi, CURLSHOPT_SHARE
+	mov    edx, CURL_LOCK_DATA_DNS
+	xor    eax, eax                             ; Variadic: no vector regs
+	call   [rel got_curl_share_setopt]
+	mov    rdi, r12
+	mov    esi, CURLSHOPT_SHARE
+	mov    edx, CURL_LOCK_DATA_SSL_SESSION
+	xor    eax, eax
+	call   [rel got_curl_share_setopt]
+	mov    rdi, r12
+	mov    esi, CURLSHOPT_SHARE
+	mov    edx, CURL_LOCK_DATA_CONNECT
+	xor    eax, eax
+	call   [rel got_curl_share_setopt]
+
+	; multi = curl_multi_init()
+	call   [rel got_curl_multi_init]
+	mov    rbx, rax
+
+	; curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX)
+	; This is the default since libcurl 7.62, but not before.
+	mov    rdi, rbx
+	mov    esi, CURLMOPT_PIPELINING
+	mov    edx, CURLPIPE_MULTIPLEX
+	xor    eax, eax
+	call   [rel got_curl_multi_setopt]
+
+	; curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS)
+	; Few HTTP/1.1 connections, reused with keep-alive.
+	mov    rdi, rbx
+	mov    esi, CURLMOPT_MAX_HOST_CONNECTIONS
+	mov    edx, MAX_HOST_CONNECTIONS
+	xor    eax, eax
+	call   [rel got_curl_multi_setopt]
+
+	lea    rbp, [rel bodies]
+
+add_next:
+	test   r14, r14
+	jz     perform
+
+	; h = curl_easy_init()
+	call   [rel got_curl_easy_init]
+	mov    r15, rax
+
+	mov    esi, CURLOPT_URL
+	mov    rdx, [r13]
+	call   easy_setopt
+	mov    esi, CURLOPT_SHARE
+	mov    rdx, r12
+	call   easy_setopt
+	; Also the default since 7.62, for HTTPS only. Plain HTTP stays HTTP/1.1.
+	mov    esi, CURLOPT_HTTP_VERSION
+	mov    edx, CURL_HTTP_VERSION_2TLS
+	call   easy_setopt
+	; Wait for a connection to multiplex on instead of opening a new one. If the
+	; server turns out not to support it, the transfer opens its own.
+	mov    esi, CURLOPT_PIPEWAIT
+	mov    edx, 1
+	call   easy_setopt
+	mov    esi, CURLOPT_WRITEFUNCTION
+	lea    rdx, [rel write_callback]
+	call   easy_setopt
+	mov    esi, CURLOPT_WRITEDATA
+	mov    rdx, rbp
+	call   easy_setopt
+	mov    esi, CURLOPT_PRIVATE
+	mov    rdx, rbp
+	call   easy_setopt
+
+	; curl_multi_add_handle(multi, h)
+	mov    rdi, rbx
+	mov    rsi, r15
+	call   [rel got_curl_multi_add_handle]
+
+	add    r13, 8
+	add    rbp, BODY_SZ
+	dec    r14
+	jmp    add_next
+
+perform:
+	; r14 is zero now, count failures with it from here on
+
+	; curl_multi_perform(multi, &running)
+	mov    rdi, rbx
+	mov    rsi, rsp
+	call   [rel got_curl_multi_perform]
+
+info_read:
+	; msg = curl_multi_info_read(multi, &left)
+	mov    rdi, rbx
+	lea    rsi, [rsp + 4]
+	call   [rel got_curl_multi_info_read]
+	test   rax, rax
+	jz     poll
+	cmp    dword [rax + MSG_MSG], CURLMSG_DONE
+	jne    info_read
+	cmp    dword [rax + MSG_RESULT], 0          ; CURLE_OK
+	jne    failed
+
+	; curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &body)
+	mov    rdi, [rax + MSG_EASY_HANDLE]
+	mov    esi, CURLINFO_PRIVATE
+	lea    rdx, [rsp + 8]
+	xor    eax, eax
+	call   [rel got_curl_easy_getinfo]
+
+	; write(1, body->data, body->len) until it is all out
+	mov    rsi, [rsp + 8]
+	mov    rdx, [rsi]
+	add    rsi, 8
+write_body:
+	test   rdx, rdx
+	jz     info_read
+	mov    edi, 1
+	mov    eax, SYS_write
+	syscall
+	test   rax, rax
+	jle    failed
+	add    rsi, rax
+	sub    rdx, rax
+	jmp    write_body
+
+failed:
+	inc    r14
+	jmp    info_read
+
+poll:
+	; All done?
+	cmp    dword [rsp], 0
+	je     exit
+
+	; curl_multi_poll(multi, NULL, 0, 1000, NULL)
+	mov    rdi, rbx
+	xor    esi, esi
+	xor    edx, edx
+	mov    ecx, 1000
+	xor    r8d, r8d
+	call   [rel got_curl_multi_poll]
+	test   eax, eax
+	jz     perform
+
+	; Give up: count whatever is still running as failed
+	add    r14d, [rsp]
+
+exit:
+	; exit_group(min(failed, 255)): libcurl may have resolver threads around
+	mov    edi, 255
+	cmp    r14, rdi
+	cmovb  edi, r14d
+	mov    eax, SYS_exit_group
+	syscall
+
+easy_setopt:
+	; curl_easy_setopt(h, esi, rdx), tail call: same stack alignment as a
+	; direct call from the code above
+	mov    rdi, r15
+	xor    eax, eax
+	jmp    [rel got_curl_easy_setopt]
+
+write_callback:
+	; size_t write_callback(char *ptr, size_t size, size_t nmemb, struct body *b)
+	; size is always 1. Append to b->data, or fail the transfer (by returning
+	; less than nmemb) if it does not fit.
+	mov    rax, rdx
+	mov    r8, [rcx]
+	lea    r9, [r8 + rax]
+	cmp    r9, BODY_SZ - 8
+	ja     write_callback_fail
+	mov    [rcx], r9
+	mov    rsi, rdi
+	lea    rdi, [rcx + r8 + 8]
+	mov    rcx, rax
+	rep    movsb
+	ret
+
+write_callback_fail:
+	xor    eax, eax
+	ret
+
+; GOT, filled in by ld.so at startup (DF_BIND_NOW)
+align 8, db 0
+got:
+got_curl_share_init:        dq 0
+got_curl_share_setopt:      dq 0
+got_curl_multi_init:        dq 0
+got_curl_multi_setopt:      dq 0
+got_curl_easy_init:         dq 0
+got_curl_easy_setopt:       dq 0
+got_curl_multi_add_handle:  dq 0
+got_curl_multi_perform:     dq 0
+got_curl_multi_info_read:   dq 0
+got_curl_multi_poll:        dq 0
+got_curl_easy_getinfo:      dq 0
+
+interpreter_path:
+	db "/lib64/ld-linux-x86-64.so.2", 0
+interpreter_path_end:
+
+string_table:
+	db 0
+	dt_needed_libcurl:              db "libcurl.so", 0
+	sym_name_curl_share_init:       db "curl_share_init", 0
+	sym_name_curl_share_setopt:     db "curl_share_setopt", 0
+	sym_name_curl_multi_init:       db "curl_multi_init", 0
+	sym_name_curl_multi_setopt:     db "curl_multi_setopt", 0
+	sym_name_curl_easy_init:        db "curl_easy_init", 0
+	sym_name_curl_easy_setopt:      db "curl_easy_setopt", 0
+	sym_name_curl_multi_add_handle: db "curl_multi_add_handle", 0
+	sym_name_curl_multi_perform:    db "curl_multi_perform", 0
+	sym_name_curl_multi_info_read:  db "curl_multi_info_read", 0
+	sym_name_curl_multi_poll:       db "curl_multi_poll", 0
+	sym_name_curl_easy_getinfo:     db "curl_easy_getinfo", 0
+string_table_end:
+
+symbol_table:
+	times 0x18 db 0 ; needed NULL symbol
+	; ---
+	dd sym_name_curl_share_init - string_table        ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_share_setopt - string_table      ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_multi_init - string_table        ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_multi_setopt - string_table      ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_easy_init - string_table         ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_easy_setopt - string_table       ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_multi_add_handle - string_table  ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_multi_perform - string_table     ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_multi_info_read - string_table   ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_multi_poll - string_table        ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+	; ---
+	dd sym_name_curl_easy_getinfo - string_table      ; st_name
+	db 0x12                                           ; st_info
+	times 0x13 db 0                                   ; st_other, st_shndx, st_value, st_size
+symbol_table_end:
+
+; RELA relocations for the GOT, one R_X86_64_JUMP_SLOT per symbol
+plt_jmprel:
+	dq got_curl_share_init,       0x0100000007, 0  ; rels[0]
+	dq got_curl_share_setopt,     0x0200000007, 0  ; rels[1]
+	dq got_curl_multi_init,       0x0300000007, 0  ; rels[2]
+	dq got_curl_multi_setopt,     0x0400000007, 0  ; rels[3]
+	dq got_curl_easy_init,        0x0500000007, 0  ; rels[4]
+	dq got_curl_easy_setopt,      0x0600000007, 0  ; rels[5]
+	dq got_curl_multi_add_handle, 0x0700000007, 0  ; rels[6]
+	dq got_curl_multi_perform,    0x0800000007, 0  ; rels[7]
+	dq got_curl_multi_info_read,  0x0900000007, 0  ; rels[8]
+	dq got_curl_multi_poll,       0x0a00000007, 0  ; rels[9]
+	dq got_curl_easy_getinfo,     0x0b00000007, 0  ; rels[10]
+plt_jmprel_end:
+
+dynamic_section:
+	dq 0x01, dt_needed_libcurl - string_table   ; DT_NEEDED "libcurl.so"
+	dq 0x05, string_table                       ; DT_STRTAB
+	dq 0x06, symbol_table                       ; DT_SYMTAB
+	dq 0x0a, STRING_TABLE_SZ                    ; DT_STRSZ
+	dq 0x17, plt_jmprel                         ; DT_JMPREL
+	dq 0x02, PLT_JMPREL_SZ                      ; DT_PLTRELSZ
+	dq 0x14, 0x07                               ; DT_PLTREL = DT_RELA
+	dq 0x1e, 0x08                               ; DT_FLAGS = DF_BIND_NOW
+	dq 0x00, 0                                  ; DT_NULL
+dynamic_section_end:
+
+align 8, db 0
+file_end:
+bodies:
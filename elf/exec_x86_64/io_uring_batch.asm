@@ -0,0 +1,534 @@
+; 64-bit ET_EXEC ELF for Linux x86_64 (5.19+)
+;
+;     targets = argv[1:] or whitespace separated words from stdin
+;     ring = io_uring_setup(4 * MAX_TARGETS, &params)
+;     mmap() SQ/CQ rings and SQEs
+;     io_uring_register(ring, IORING_REGISTER_FILES, [-1] * n, n)
+;     for i, "a.b.c.d[:port][/path]" in targets:
+;         socket(AF_INET, SOCK_STREAM, 0) -> direct descriptor i  \
+;         connect(i, {AF_INET, port, a.b.c.d}, 16)                 | linked
+;         sendmsg(i, "GET /path HTTP/1.0\r\nHost: a.b.c.d:port\r\n\r\n")  |
+;         recv(i, resp[i], RESP_SZ, MSG_WAITALL)                   /
+;     io_uring_enter(ring, 4 * n, 4 * n, IORING_ENTER_GETEVENTS)
+;     for i in targets:
+;         write(1, body of resp[i]) -> linked to the previous one
+;     io_uring_enter(ring, n_writes, n_writes, IORING_ENTER_GETEVENTS)
+;     exit(number of targets without a response body)
+;
+; Fetch many small objects over plain HTTP at once, from a single process and
+; with a handful of syscalls in total, instead of one /bin/curl process (and
+; ~900 syscalls) per object. Every socket(), connect(), sendmsg() and recv() is
+; an io_uring SQE: the 4 for each target are linked, so they run in order, while
+; all the targets go in parallel. Sockets are direct descriptors (straight into
+; the io_uring registered files table, never in the process fd table), which is
+; what lets connect() be linked to the socket() it needs.
+;
+; Bodies are output in the same order as the targets, again through io_uring:
+; linked writes to stdout, all submitted at once. Each response must fit in
+; RESP_SZ bytes, and is cut there otherwise. There is no DNS and no TLS, so
+; targets are IPv4 addresses with an optional port (80 by default) and path
+; ("/" by default), e.g. 127.0.0.1:8080/5/5. The exit code is the number of
+; targets that got no response body.
+
+[bits 64]
+
+VA:                 equ 0x10000
+MAX_TARGETS:        equ 256
+RESP_SHIFT:         equ 14
+RESP_SZ:            equ 1 << RESP_SHIFT
+STDIN_SZ:           equ 0x10000
+SQ_ENTRIES:         equ 4 * MAX_TARGETS
+
+; struct target, one per target, TARGET_SZ is a power of 2
+TARGET_SHIFT:       equ 8
+TARGET_SZ:          equ 1 << TARGET_SHIFT
+T_ADDR:             equ 0              ; struct sockaddr_in
+T_MSGHDR:           equ 16             ; struct msghdr
+T_IOV:              equ 72             ; struct iovec[5], for sendmsg()
+T_RESULT:           equ 152            ; recv() result
+
+; struct io_uring_params
+P_SQ_ENTRIES:       equ 0
+P_CQ_ENTRIES:       equ 4
+P_SQ_TAIL:          equ 40 + 4         ; sq_off.tail
+P_SQ_ARRAY:         equ 40 + 24        ; sq_off.array
+P_CQ_HEAD:          equ 80 + 0         ; cq_off.head
+P_CQ_TAIL:          equ 80 + 4         ; cq_off.tail
+P_CQ_CQES:          equ 80 + 20        ; cq_off.cqes
+PARAMS_SZ:          equ 120
+
+; struct io_uring_sqe
+SQE_SHIFT:          equ 6
+SQE_OPCODE:         equ 0
+SQE_FLAGS:          equ 1
+SQE_FD:             equ 4
+SQE_OFF:            equ 8
+SQE_ADDR:           equ 16
+SQE_LEN:            equ 24
+SQE_MSG_FLAGS:      equ 28
+SQE_USER_DATA:      equ 32
+SQE_FILE_INDEX:     equ 44
+
+; struct io_uring_cqe
+CQE_SHIFT:          equ 4
+CQE_USER_DATA:      equ 0
+CQE_RES:            equ 8
+
+IORING_OP_SENDMSG:  equ 9
+IORING_OP_CONNECT:  equ 16
+IORING_OP_WRITE:    equ 23
+IORING_OP_RECV:     equ 27
+IORING_OP_SOCKET:   equ 45
+IOSQE_FIXED_FILE:   equ 1
+IOSQE_IO_LINK:      equ 4
+IORING_ENTER_GETEVENTS: equ 1
+IORING_REGISTER_FILES:  equ 2
+IORING_OFF_SQES:    equ 0x10000000
+MSG_WAITALL:        equ 0x100
+MSG_NOSIGNAL:       equ 0x4000
+
+SYS_read:           equ 0
+SYS_mmap:           equ 9
+SYS_exit_group:     equ 231
+SYS_io_uring_setup: equ 425
+SYS_io_uring_enter: equ 426
+SYS_io_uring_register: equ 427
+
+db 0x7f, 'ELF'                         ; e_ident[EI_MAG]
+db 2                                   ; e_ident[EI_CLASS]   = ELFCLASS64
+db 1                                   ; e_ident[EI_DATA]    = ELFDATA2LSB
+db 1                                   ; e_ident[EI_VERSION] = EV_CURRENT
+times 16 - ($ - $$) db 0
+
+	dw 2                               ; e_type = ET_EXEC
+	dw 0x3e                            ; e_machine = EM_X86_64
+	dd 1                               ; e_version
+	dq VA + entry                      ; e_entry
+	dq program_headers                 ; e_phoff
+	dq 0                               ; e_shoff
+	dd 0                               ; e_flags
+	dw 0x40                            ; e_ehsize
+	dw 0x38                            ; e_phentsize
+	dw 1                               ; e_phnum
+	dw 0                               ; e_shentsize
+	dw 0                               ; e_shnum
+	dw 0                               ; e_shstrndx
+
+program_headers:
+	; Load whole file as RWX, plus all the buffers after it
+	dd 1                               ; p_type  = PT_LOAD
+	dd 7                               ; p_flags = RWE
+	dq 0                               ; p_offset
+	dq VA                              ; p_vaddr
+	dq VA                              ; p_paddr
+	dq END                             ; p_filesz
+	dq BSS_END                         ; p_memsz
+	dq 0x1000                          ; p_align
+
+entry:
+	; Targets from argv, at most MAX_TARGETS
+	pop    rcx                         ; argc
+	pop    rax                         ; argv[0]
+	dec    ecx
+	jz     read_stdin
+	mov    eax, MAX_TARGETS
+	cmp    ecx, eax
+	cmova  ecx, eax
+	mov    r14d, ecx
+	mov    rsi, rsp
+	mov    edi, VA + target_ptrs
+	rep    movsq
+	jmp    setup
+
+read_stdin:
+	; No arguments, read all of stdin (at most STDIN_SZ bytes)
+	mov    esi, VA + stdin_buf
+read_more:
+	xor    edi, edi
+	mov    edx, VA + stdin_buf + STDIN_SZ
+	sub    edx, esi
+	jz     tokenize
+	xor    eax, eax                    ; SYS_read
+	syscall
+	test   eax, eax
+	jle    tokenize
+	add    esi, eax
+	jmp    read_more
+
+tokenize:
+	; Targets are the words in it. The byte after the data is always zero.
+	mov    esi, VA + stdin_buf
+	mov    edi, VA + target_ptrs
+	xor    r14d, r14d
+skip_space:
+	cmp    r14d, MAX_TARGETS
+	je     setup
+	mov    al, [rsi]
+	test   al, al
+	jz     setup
+	inc    rsi
+	cmp    al, ' '
+	jbe    skip_space
+	lea    rax, [rsi - 1]
+	stosq
+	inc    r14d
+skip_word:
+	mov    al, [rsi]
+	cmp    al, ' '
+	jbe    skip_space
+	inc    rsi
+	jmp    skip_word
+
+setup:
+	; Nothing to do?
+	xor    edi, edi
+	test   r14d, r14d
+	jz     exit
+
+	; ring = io_uring_setup(SQ_ENTRIES, &params)
+	mov    edi, SQ_ENTRIES
+	mov    esi, VA + params
+	mov    eax, SYS_io_uring_setup
+	syscall
+	mov    edi, eax
+	neg    edi
+	test   eax, eax
+	js     exit
+	mov    r15d, eax
+
+	; rings = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	;              ring, IORING_OFF_SQ_RING)
+	; SQ and CQ rings share the same mapping (IORING_FEAT_SINGLE_MMAP, 5.4+), so
+	; size is the largest of the two.
+	mov    esi, [VA + params + P_SQ_ARRAY]
+	mov    eax, [VA + params + P_SQ_ENTRIES]
+	lea    esi, [rsi + rax * 4]
+	mov    eax, [VA + params + P_CQ_ENTRIES]
+	shl    eax, CQE_SHIFT
+	add    eax, [VA + params + P_CQ_CQES]
+	cmp    esi, eax
+	cmovb  esi, eax
+	xor    edi, edi
+	mov    edx, 3
+	mov    r10d, 0x8001
+	mov    r8d, r15d
+	xor    r9d, r9d
+	mov    eax, SYS_mmap
+	syscall
+	mov    rbp, rax
+	mov    edi, eax
+	neg    edi
+	cmp    rax, -4095                  ; -errno?
+	jae    exit
+
+	; sqes = mmap(NULL, SQ_ENTRIES * 64, ..., ring, IORING_OFF_SQES)
+	xor    edi, edi
+	mov    esi, SQ_ENTRIES << SQE_SHIFT
+	mov    r9d, IORING_OFF_SQES
+	mov    eax, SYS_mmap
+	syscall
+	mov    rbx, rax
+	mov    edi, eax
+	neg    edi
+	cmp    rax, -4095
+	jae    exit
+
+	; io_uring_register(ring, IORING_REGISTER_FILES, files, n) with all slots
+	; empty (-1): socket() fills them as direct descriptors
+	mov    edi, VA + files
+	mov    ecx, r14d
+	or     eax, -1
+	rep    stosd
+	mov    edi, r15d
+	mov    esi, IORING_REGISTER_FILES
+	mov    edx, VA + files
+	mov    r10d, r14d
+	mov    eax, SYS_io_uring_register
+	syscall
+	mov    edi, eax
+	neg    edi
+	test   eax, eax
+	jnz    exit
+
+	; SQ array is the identity: SQE i goes in SQ ring entry i
+	mov    edi, [VA + params + P_SQ_ARRAY]
+	add    rdi, rbp
+	xor    eax, eax
+fill_sq_array:
+	stosd
+	inc    eax
+	cmp    eax, SQ_ENTRIES
+	jb     fill_sq_array
+
+	xor    r12d, r12d                  ; i
+	mov    r13d, VA + targets          ; &targets[i]
+parse_target:
+	; Parse "a.b.c.d[:port][/path]" into targets[i]
+	mov    rsi, [VA + target_ptrs + r12 * 8]
+	mov    r8, rsi                     ; Host starts here
+	mov    word [r13 + T_ADDR], 2      ; sin_family = AF_INET
+	lea    rdi, [r13 + T_ADDR + 4]     ; sin_addr
+	mov    ecx, 4
+parse_addr:
+	call   parse_num
+	stosb
+	inc    rsi                         ; Skip the '.'
+	loop   parse_addr
+	dec    rsi
+
+	mov    eax, 80
+	cmp    byte [rsi], ':'
+	jne    no_port
+	inc    rsi
+	call   parse_num
+no_port:
+	xchg   al, ah
+	mov    [r13 + T_ADDR + 2], ax      ; sin_port = htons(port)
+
+	; Host header value: everything up to here (port included)
+	mov    [r13 + T_IOV + 0x30], r8    ; iov[3]
+	mov    rax, rsi
+	sub    rax, r8
+	mov    [r13 + T_IOV + 0x38], rax
+
+	; Path: the rest, up to the end of the word
+	mov    rdi, rsi
+find_path_end:
+	cmp    byte [rdi], ' '
+	jbe    path_end
+	inc    rdi
+	jmp    find_path_end
+path_end:
+	sub    rdi, rsi
+	jnz    has_path
+	mov    esi, VA + slash
+	inc    edi
+has_path:
+	mov    [r13 + T_IOV + 0x10], rsi   ; iov[1]
+	mov    [r13 + T_IOV + 0x18], rdi
+
+	; The rest of the request around them
+	mov    qword [r13 + T_IOV + 0x00], VA + req_get
+	mov    qword [r13 + T_IOV + 0x08], REQ_GET_SZ
+	mov    qword [r13 + T_IOV + 0x20], VA + req_http
+	mov    qword [r13 + T_IOV + 0x28], REQ_HTTP_SZ
+	mov    qword [r13 + T_IOV + 0x40], VA + req_end
+	mov    qword [r13 + T_IOV + 0x48], REQ_END_SZ
+	lea    rax, [r13 + T_IOV]
+	mov    [r13 + T_MSGHDR + 16], rax  ; msg_iov
+	mov    qword [r13 + T_MSGHDR + 24], 5 ; msg_iovlen
+
+	; SQEs 4*i ... 4*i+3 for this target, linked
+	mov    edi, r12d
+	shl    edi, SQE_SHIFT + 2
+	add    rdi, rbx
+
+	; socket(AF_INET, SOCK_STREAM, 0) into registered file i
+	mov    byte [rdi + SQE_OPCODE], IORING_OP_SOCKET
+	mov    byte [rdi + SQE_FLAGS], IOSQE_IO_LINK
+	mov    dword [rdi + SQE_FD], 2
+	mov    qword [rdi + SQE_OFF], 1
+	lea    eax, [r12 + 1]
+	mov    [rdi + SQE_FILE_INDEX], eax
+	add    rdi, 1 << SQE_SHIFT
+
+	; connect(i, &targets[i].addr, sizeof(struct sockaddr_in))
+	mov    byte [rdi + SQE_OPCODE], IORING_OP_CONNECT
+	mov    byte [rdi + SQE_FLAGS], IOSQE_FIXED_FILE | IOSQE_IO_LINK
+	mov    [rdi + SQE_FD], r12d
+	mov    qword [rdi + SQE_OFF], 16
+	mov    [rdi + SQE_ADDR], r13
+	add    rdi, 1 << SQE_SHIFT
+
+	; sendmsg(i, &targets[i].msghdr, MSG_NOSIGNAL)
+	mov    byte [rdi + SQE_OPCODE], IORING_OP_SENDMSG
+	mov    byte [rdi + SQE_FLAGS], IOSQE_FIXED_FILE | IOSQE_IO_LINK
+	mov    [rdi + SQE_FD], r12d
+	lea    rax, [r13 + T_MSGHDR]
+	mov    [rdi + SQE_ADDR], rax
+	mov    dword [rdi + SQE_MSG_FLAGS], MSG_NOSIGNAL
+	add    rdi, 1 << SQE_SHIFT
+
+	; recv(i, resp[i], RESP_SZ, MSG_WAITALL): the whole response, since the
+	; server closes the connection after it (HTTP/1.0). Its user_data is i + 1,
+	; the others are 0.
+	mov    byte [rdi + SQE_OPCODE], IORING_OP_RECV
+	mov    byte [rdi + SQE_FLAGS], IOSQE_FIXED_FILE
+	mov    [rdi + SQE_FD], r12d
+	mov    eax, r12d
+	shl    eax, RESP_SHIFT
+	add    eax, VA + responses
+	mov    [rdi + SQE_ADDR], rax
+	mov    dword [rdi + SQE_LEN], RESP_SZ
+	mov    dword [rdi + SQE_MSG_FLAGS], MSG_WAITALL
+	lea    eax, [r12 + 1]
+	mov    [rdi + SQE_USER_DATA], rax
+
+	add    r13d, TARGET_SZ
+	inc    r12d
+	cmp    r12d, r14d
+	jb     parse_target
+
+	; Submit them all and wait for all of them
+	lea    esi, [r14 * 4]
+	call   submit_and_wait
+
+	; Save recv() results, then consume all CQEs
+	mov    esi, [VA + params + P_CQ_CQES]
+	add    rsi, rbp
+	lea    ecx, [r14 * 4]
+save_result:
+	mov    rax, [rsi + CQE_USER_DATA]
+	test   rax, rax
+	jz     next_cqe
+	mov    edx, [rsi + CQE_RES]
+	shl    eax, TARGET_SHIFT
+	mov    [VA + targets - TARGET_SZ + rax + T_RESULT], edx
+next_cqe:
+	add    rsi, 1 << CQE_SHIFT
+	loop   save_result
+	mov    eax, [VA + params + P_CQ_HEAD]
+	lea    edx, [r14 * 4]
+	mov    [rbp + rax], edx
+
+	; Now write the bodies to stdout in order, through linked writes (unlinked
+	; ones could complete in any order)
+	xor    r12d, r12d                  ; i
+	mov    r13d, VA + targets          ; &targets[i]
+	xor    r9d, r9d                    ; targets without a body
+	xor    r10d, r10d                  ; writes
+	pxor   xmm0, xmm0
+	xor    edi, edi                    ; Last SQE
+find_body:
+	; Look for "\r\n\r\n" in the response
+	mov    ecx, [r13 + T_RESULT]
+	sub    ecx, 3
+	mov    esi, r12d
+	shl    esi, RESP_SHIFT
+	add    esi, VA + responses
+	xor    edx, edx
+find_headers_end:
+	cmp    edx, ecx
+	jge    no_body
+	cmp    dword [rsi + rdx], `\r\n\r\n`
+	lea    edx, [rdx + 1]
+	jne    find_headers_end
+
+	; write(1, body, body_len) at the current file offset
+	lea    rax, [rsi + rdx + 3]        ; body
+	sub    ecx, edx                    ; body_len
+	jz     next_body
+
+	; SQE 4*n + writes, cleared since it was used before
+	lea    edi, [r14 * 4 + r10]
+	and    edi, SQ_ENTRIES - 1
+	shl    edi, SQE_SHIFT
+	add    rdi, rbx
+	movdqu [rdi + 0x00], xmm0
+	movdqu [rdi + 0x10], xmm0
+	movdqu [rdi + 0x20], xmm0
+	movdqu [rdi + 0x30], xmm0
+	mov    byte [rdi + SQE_OPCODE], IORING_OP_WRITE
+	mov    byte [rdi + SQE_FLAGS], IOSQE_IO_LINK
+	mov    dword [rdi + SQE_FD], 1
+	mov    qword [rdi + SQE_OFF], -1
+	mov    [rdi + SQE_ADDR], rax
+	mov    [rdi + SQE_LEN], ecx
+	inc    r10d
+	jmp    next_body
+
+no_body:
+	inc    r9d
+next_body:
+	add    r13d, TARGET_SZ
+	inc    r12d
+	cmp    r12d, r14d
+	jb     find_body
+
+	; The last write ends the chain
+	test   r10d, r10d
+	jz     done
+	mov    byte [rdi + SQE_FLAGS], 0
+	push   r9
+	mov    esi, r10d
+	call   submit_and_wait
+	pop    r9
+
+done:
+	; exit(targets without a body), at most 255
+	mov    eax, 255
+	cmp    r9d, eax
+	cmova  r9d, eax
+	mov    edi, r9d
+exit:
+	; Not just exit(): io_uring worker threads (e.g. for writes to files) are in
+	; our thread group, and the exit code would be lost
+	mov    eax, SYS_exit_group
+	syscall
+
+submit_and_wait:
+	; Submit esi more SQEs and wait for as many CQEs (io_uring_enter() may
+	; return early when interrupted)
+	mov    eax, [VA + params + P_SQ_TAIL]
+	add    [rbp + rax], esi
+	mov    edi, r15d
+	mov    edx, esi
+	mov    r10d, IORING_ENTER_GETEVENTS
+	xor    r8d, r8d
+	xor    r9d, r9d
+	mov    eax, [VA + params + P_CQ_HEAD]
+	mov    ecx, [rbp + rax]
+	add    ecx, esi                    ; Wait until CQ tail gets here
+	push   rcx
+enter:
+	mov    eax, SYS_io_uring_enter
+	syscall
+	xor    esi, esi
+	mov    eax, [VA + params + P_CQ_TAIL]
+	mov    eax, [rbp + rax]
+	cmp    eax, [rsp]
+	jb     enter
+	pop    rcx
+	ret
+
+parse_num:
+	; eax = decimal number at rsi, rsi = first non-digit after it
+	xor    eax, eax
+parse_digit:
+	movzx  edx, byte [rsi]
+	sub    edx, '0'
+	cmp    edx, 9
+	ja     parse_num_done
+	imul   eax, eax, 10
+	add    eax, edx
+	inc    rsi
+	jmp    parse_digit
+parse_num_done:
+	ret
+
+req_get:
+	db 'GET '
+req_http:
+	db ` HTTP/1.0\r\nHost: `
+req_end:
+	db `\r\n\r\n`
+slash:
+	db '/'
+
+REQ_GET_SZ:         equ req_http - req_get
+REQ_HTTP_SZ:        equ req_end - req_http
+REQ_END_SZ:         equ slash - req_end
+
+END:
+
+absolute END
+	alignb 8
+params:       resb PARAMS_SZ
+target_ptrs:  resq MAX_TARGETS
+files:        resd MAX_TARGETS
+	alignb 16
+targets:      resb MAX_TARGETS * TARGET_SZ
+stdin_buf:    resb STDIN_SZ + 1
+	alignb 0x1000
+responses:    resb MAX_TARGETS * RESP_SZ
+BSS_END:
@@ -0,0 +1,271 @@
+// Fetch a list of URLs and stream their bodies to stdout, in order, with up to
+// -p requests in flight at once over a single shared, keep-alive, HTTP/2
+// capable transport. URLs are the command line arguments, or the words read
+// from stdin if there are none. The exit code is the number of failed URLs.
+//
+//	go run fetch.go https://binary.golf/5/5 https://binary.golf/5/5 ...
+//	go run fetch.go -p 32 < urls.txt
+//
+// With -bench, benchmark it instead, against a local httptest server over both
+// HTTP/1.1 and HTTP/2, next to what plain.go does (default transport and
+// io.ReadAll). Each benchmark op is one request: allocations are reported per
+// request, throughput as MB/s of body and requests/s. The benchmark time can be
+// set with e.g. -test.benchtime=2000x, -latency simulates a remote server and
+// -size sets the size of the bodies.
+// Note that the allocations of the server, running in the same process, are
+// counted too.
+package main
+
+import (
+	"bufio"
+	"crypto/tls"
+	"crypto/x509"
+	"flag"
+	"fmt"
+	"io"
+	"net"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"strings"
+	"testing"
+	"time"
+)
+
+// Body served by the benchmark server, same as https://binary.golf/5/5,
+// repeated up to the -size given
+const benchBody = "Another #BGGP5 download!! @binarygolf https://binary.golf\n"
+
+// Hides the ReadFrom method of *os.File, which would make io.CopyBuffer ignore
+// the buffer it is given and allocate a new one for every body.
+type writerOnly struct {
+	io.Writer
+}
+
+func newTransport(parallel int) *http.Transport {
+	return &http.Transport{
+		Proxy: http.ProxyFromEnvironment,
+		DialContext: (&net.Dialer{
+			Timeout:   30 * time.Second,
+			KeepAlive: 30 * time.Second,
+		}).DialContext,
+		// Needed as soon as DialContext or TLSClientConfig are customized
+		ForceAttemptHTTP2: true,
+		// The default of 2 would close most connections after each request
+		// and open new ones for the next, with a TLS handshake every time.
+		MaxIdleConns:          parallel,
+		MaxIdleConnsPerHost:   parallel,
+		IdleConnTimeout:       90 * time.Second,
+		TLSHandshakeTimeout:   10 * time.Second,
+		ExpectContinueTimeout: 1 * time.Second,
+	}
+}
+
+type result struct {
+	resp *http.Response
+	err  error
+}
+
+// Fetch urls with at most parallel requests in flight and copy each body to w,
+// in the same order as urls. Responses are only read when it is their turn:
+// until then, the ones already received wait with their body unread, which
+// also caps the memory used to the socket buffers. Responses with a non-2xx
+// status are failures, their body is discarded. Errors go to errw, and the
+// number of failed URLs is returned.
+func fetchAll(client *http.Client, urls []string, parallel int, w, errw io.Writer) int {
+	results := make([]chan result, len(urls))
+	for i := range results {
+		results[i] = make(chan result, 1)
+	}
+
+	// Slots are taken in order, so the URL that is next to be output is always
+	// already in flight, and freed only once its body is out.
+	slots := make(chan struct{}, parallel)
+
+	go func() {
+		for i, url := range urls {
+			slots <- struct{}{}
+			go func(i int, url string) {
+				resp, err := client.Get(url)
+				results[i] <- result{resp, err}
+			}(i, url)
+		}
+	}()
+
+	buf := make([]byte, 32<<10)
+	out := writerOnly{w}
+	failed := 0
+
+	for i, url := range urls {
+		r := <-results[i]
+		err := r.err
+
+		if err == nil {
+			if ok2xx(r.resp) {
+				_, err = io.CopyBuffer(out, r.resp.Body, buf)
+			} else {
+				// Drained so that the connection can be reused
+				io.Copy(io.Discard, r.resp.Body)
+				err = fmt.Errorf("%s", r.resp.Status)
+			}
+
+			r.resp.Body.Close()
+		}
+
+		if err != nil {
+			fmt.Fprintf(errw, "%s: %v\n", url, err)
+			failed++
+		}
+
+		<-slots
+	}
+
+	return failed
+}
+
+func ok2xx(resp *http.Response) bool {
+	return resp.StatusCode >= 200 && resp.StatusCode <= 299
+}
+
+func readURLs(r io.Reader) ([]string, error) {
+	var urls []string
+
+	s := bufio.NewScanner(r)
+	s.Split(bufio.ScanWords)
+	for s.Scan() {
+		urls = append(urls, s.Text())
+	}
+
+	return urls, s.Err()
+}
+
+// Benchmark one request per iteration through fetchAll, against srv
+func benchFetch(srv *httptest.Server, size, parallel int) func(*testing.B) {
+	return func(b *testing.B) {
+		transport := newTransport(parallel)
+		defer transport.CloseIdleConnections()
+
+		if srv.TLS != nil {
+			roots := x509.NewCertPool()
+			roots.AddCert(srv.Certificate())
+			transport.TLSClientConfig = &tls.Config{RootCAs: roots}
+		}
+
+		client := &http.Client{Transport: transport}
+		urls := make([]string, b.N)
+		for i := range urls {
+			urls[i] = srv.URL
+		}
+
+		b.SetBytes(int64(size))
+		b.ReportAllocs()
+		b.ResetTimer()
+
+		if fetchAll(client, urls, parallel, io.Discard, os.Stderr) != 0 {
+			b.Fatal("some requests failed")
+		}
+	}
+}
+
+// Same as plain.go: one request at a time, default transport, io.ReadAll
+func benchPlain(srv *httptest.Server, size int) func(*testing.B) {
+	return func(b *testing.B) {
+		b.SetBytes(int64(size))
+		b.ReportAllocs()
+
+		for i := 0; i < b.N; i++ {
+			resp, err := http.Get(srv.URL)
+			if err != nil {
+				b.Fatal(err)
+			}
+
+			body, err := io.ReadAll(resp.Body)
+			resp.Body.Close()
+			if err != nil {
+				b.Fatal(err)
+			}
+			if !ok2xx(resp) {
+				b.Fatal(resp.Status)
+			}
+
+			io.Discard.Write(body)
+		}
+	}
+}
+
+func bench(parallel int, latency time.Duration, size int) {
+	body := strings.Repeat(benchBody, max(1, size/len(benchBody)))
+	size = len(body)
+
+	handler := http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		time.Sleep(latency)
+		io.WriteString(w, body)
+	})
+
+	h1 := httptest.NewServer(handler)
+	defer h1.Close()
+
+	h2 := httptest.NewUnstartedServer(handler)
+	h2.EnableHTTP2 = true
+	h2.StartTLS()
+	defer h2.Close()
+
+	benchmarks := []struct {
+		name string
+		fn   func(*testing.B)
+	}{
+		{"plain/http1", benchPlain(h1, size)},
+		{"fetch/http1/p1", benchFetch(h1, size, 1)},
+		{fmt.Sprintf("fetch/http1/p%d", parallel), benchFetch(h1, size, parallel)},
+		{fmt.Sprintf("fetch/http2/p%d", parallel), benchFetch(h2, size, parallel)},
+	}
+
+	for _, bm := range benchmarks {
+		r := testing.Benchmark(bm.fn)
+		if r.N == 0 {
+			fmt.Printf("%-20s failed\n", bm.name)
+			continue
+		}
+
+		reqs := float64(r.N) / r.T.Seconds()
+		fmt.Printf("%-20s %s %s %12.0f req/s\n", bm.name, r.String(), r.MemString(), reqs)
+	}
+}
+
+func main() {
+	// Registers -test.benchtime and friends, used by testing.Benchmark
+	testing.Init()
+
+	parallel := flag.Int("p", 16, "max requests in flight")
+	benchmark := flag.Bool("bench", false, "benchmark against a local server instead")
+	latency := flag.Duration("latency", 0, "with -bench, delay of each server response")
+	size := flag.Int("size", 0, "with -bench, approximate size of the server responses")
+	flag.Parse()
+
+	if *parallel < 1 {
+		fmt.Fprintln(os.Stderr, "-p must be at least 1")
+		os.Exit(255)
+	}
+
+	if *benchmark {
+		bench(*parallel, *latency, *size)
+		return
+	}
+
+	urls := flag.Args()
+	if len(urls) == 0 {
+		var err error
+		if urls, err = readURLs(os.Stdin); err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(255)
+		}
+	}
+
+	client := &http.Client{Transport: newTransport(*parallel)}
+	failed := fetchAll(client, urls, *parallel, os.Stdout, os.Stderr)
+	if failed > 255 {
+		failed = 255
+	}
+
+	os.Exit(failed)
+}
@@ -0,0 +1,455 @@
+#!/usr/bin/env python3
+#
+# Offline stand-in for binary.golf and 7f.uk, so that the entries in this repo
+# can be tested without Internet access, and benchmarked against a server that
+# always behaves the same. See ./serve.py --help for all the options.
+#
+# Paths served (on any Host, except 7f.uk which redirects like the real one):
+#
+#   /5/5         The BGGP5 file
+#   /bytes/SIZE  SIZE bytes (K/M/G suffixes allowed) of the BGGP5 file repeated
+#
+# Traffic can be shaped adding latency before each response, capping the
+# bandwidth of each connection and using chunked transfer encoding.
+#
+# Ways to run it:
+#
+#   ./serve.py [OPTIONS]
+#       Serve HTTP and HTTPS on 127.0.0.1 (ports 8080 and 8443 by default).
+#
+#   ./serve.py [OPTIONS] -- COMMAND [ARGS...]
+#       Same, but only while COMMAND runs, then exit with its exit code.
+#
+#   ./serve.py --sandbox [OPTIONS] -- COMMAND [ARGS...]
+#       Run everything in new user, mount and network namespaces (unshare -rmn)
+#       with only a loopback interface, where ports 80 and 443 are served,
+#       /etc/hosts points binary.golf and 7f.uk to 127.0.0.1 and the system CA
+#       bundle is replaced with the self-signed CA used for HTTPS. Programs with
+#       hardcoded URLs then talk to this server without noticing.
+#
+#   ./serve.py --inetd {http,https} [OPTIONS]
+#       Serve a single connection over stdin/stdout, which is what QEMU user
+#       networking guestfwd=...-cmd:... expects.
+#
+# HTTPS certificates are created with the openssl CLI.
+#
+
+import os
+import re
+import ssl
+import sys
+import shlex
+import socket
+
+from argparse import ArgumentParser, Namespace, RawDescriptionHelpFormatter, REMAINDER
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from pathlib import Path
+from subprocess import run, DEVNULL
+from tempfile import TemporaryDirectory
+from textwrap import dedent
+from threading import Thread
+from time import monotonic, sleep
+from typing import Iterator, List, Optional, Tuple
+
+
+BGGP5_DATA = b'Another #BGGP5 download!! @binarygolf https://binary.golf\n'
+BGGP5_URL = 'https://binary.golf/5/5'
+HOSTNAMES = ['binary.golf', '7f.uk']
+SHORT_URL_HOST = '7f.uk'
+# Address the UEFI apps reach the server at through guestfwd (see run.py)
+GUEST_ADDR = '10.0.2.100'
+# Largest /bytes/SIZE payload
+MAX_SIZE = 1 << 32
+# Block size used to generate /bytes/SIZE payloads and to pace writes
+BLOCK_SIZE = 0x4000
+# Set when re-executed inside the namespaces created for --sandbox
+SANDBOX_ENV = 'BGGP5_SERVE_SANDBOX'
+# Files that may hold the system CA bundle, replaced under --sandbox
+CA_BUNDLES = [
+	'/etc/ssl/certs/ca-certificates.crt',
+	'/etc/pki/tls/certs/ca-bundle.crt',
+	'/etc/ssl/cert.pem',
+]
+
+
+def log(*a, **kwa):
+	print(*a, **kwa, file=sys.stderr, flush=True)
+
+
+def parse_size(s: str) -> int:
+	m = re.fullmatch(r'(\d+)([KMG]?)', s.upper())
+	if m is None:
+		raise ValueError(f'bad size: {s!r}')
+
+	return int(m.group(1)) << {'': 0, 'K': 10, 'M': 20, 'G': 30}[m.group(2)]
+
+
+def wrap_help(body: str) -> str:
+	'''Wrap a string to 65 columns without breaking words for a nice --help
+	output of the tool'''
+	words = body.split()
+	lines = []
+	line = ''
+
+	for w in words:
+		if len(line) + len(w) >= 65:
+			lines.append(line.rstrip())
+			line = ''
+		line += w + ' '
+
+	if line:
+		lines.append(line.rstrip())
+
+	return '\n'.join(lines)
+
+
+def parse_args() -> Namespace:
+	ap = ArgumentParser(
+		description='Offline stand-in HTTP/HTTPS server for binary.golf and 7f.uk',
+		formatter_class=RawDescriptionHelpFormatter,
+		epilog=dedent('''\
+			examples:
+			  ./serve.py --latency 50 --bandwidth 1M
+			  ./serve.py -- curl -k https://127.0.0.1:8443/bytes/10M -o /dev/null
+			  ./serve.py --sandbox --chunked -- elf/exec_x86_64/exec_curl
+			''')
+	)
+
+	ap.add_argument('--sandbox', action='store_true',
+		help=wrap_help('run in new user/mount/network namespaces, '
+			'serving ports 80 and 443 for binary.golf and 7f.uk'))
+	ap.add_argument('--inetd', choices=('http', 'https'),
+		help=wrap_help('serve a single connection on stdin/stdout'))
+	ap.add_argument('--bind', default='127.0.0.1', metavar='ADDR',
+		help='address to listen on (default: 127.0.0.1)')
+	ap.add_argument('--http-port', type=int, metavar='PORT',
+		help='HTTP port (default: 8080, or 80 with --sandbox)')
+	ap.add_argument('--https-port', type=int, metavar='PORT',
+		help='HTTPS port (default: 8443, or 443 with --sandbox)')
+	ap.add_argument('--certs', type=Path, metavar='DIR',
+		help=wrap_help('directory with ca.pem, cert.pem and key.pem for HTTPS, '
+			'created if missing (default: new temporary directory)'))
+	ap.add_argument('--make-certs', action='store_true',
+		help=wrap_help('only create the certificates in --certs DIR and exit'))
+	ap.add_argument('--latency', type=float, default=0, metavar='MS',
+		help='delay before sending each response')
+	ap.add_argument('--bandwidth', type=parse_size, default=0, metavar='RATE',
+		help=wrap_help('max bytes per second per connection (K/M/G '
+			'suffixes allowed, default: unlimited)'))
+	ap.add_argument('--chunked', action='store_true',
+		help='use chunked transfer encoding instead of Content-Length')
+	ap.add_argument('--chunk-size', type=parse_size, default=BLOCK_SIZE, metavar='SIZE',
+		help=f'size of each chunk with --chunked (default: {BLOCK_SIZE})')
+	ap.add_argument('-v', '--verbose', action='store_true',
+		help='log each request')
+	ap.add_argument('command', nargs=REMAINDER,
+		help=wrap_help('command to run while serving, after "--"'))
+
+	args = ap.parse_args()
+
+	if args.command and args.command[0] == '--':
+		args.command = args.command[1:]
+	if args.sandbox and not args.command:
+		ap.error('--sandbox needs a command to run')
+	if args.make_certs and args.certs is None:
+		ap.error('--make-certs needs --certs DIR')
+	if args.chunk_size == 0:
+		ap.error('--chunk-size must be positive')
+
+	if args.http_port is None:
+		args.http_port = 80 if args.sandbox else 8080
+	if args.https_port is None:
+		args.https_port = 443 if args.sandbox else 8443
+
+	return args
+
+
+def make_certs(certs: Path):
+	'''Create a CA and a certificate signed by it for all the names (and
+	addresses) the server can be reached at, unless already there'''
+	if all((certs / f).is_file() for f in ('ca.pem', 'cert.pem', 'key.pem')):
+		return
+
+	certs.mkdir(parents=True, exist_ok=True)
+	sans = ','.join([f'DNS:{h}' for h in HOSTNAMES + ['localhost']]
+		+ [f'IP:127.0.0.1', f'IP:{GUEST_ADDR}'])
+
+	(certs / 'ext.cnf').write_text(dedent(f'''\
+		subjectAltName = {sans}
+		basicConstraints = CA:FALSE
+		keyUsage = digitalSignature, keyEncipherment
+		extendedKeyUsage = serverAuth
+	'''))
+
+	openssl = lambda *a: run(['openssl', *a], cwd=certs, check=True,
+		stdout=DEVNULL, stderr=DEVNULL)
+
+	# RSA rather than EC keys, which not every TLS stack in here supports
+	openssl('req', '-x509', '-newkey', 'rsa:2048', '-nodes', '-days', '3650',
+		'-keyout', 'ca.key', '-out', 'ca.pem', '-subj', '/CN=BGGP5 stand-in CA',
+		'-addext', 'basicConstraints=critical,CA:TRUE',
+		'-addext', 'keyUsage=critical,keyCertSign,cRLSign')
+	openssl('req', '-newkey', 'rsa:2048', '-nodes', '-keyout', 'key.pem',
+		'-out', 'cert.csr', '-subj', f'/CN={HOSTNAMES[0]}')
+	openssl('x509', '-req', '-days', '3650', '-in', 'cert.csr', '-CA', 'ca.pem',
+		'-CAkey', 'ca.key', '-CAcreateserial', '-extfile', 'ext.cnf',
+		'-out', 'cert.pem')
+
+
+def tls_context(certs: Path) -> ssl.SSLContext:
+	ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+	ctx.load_cert_chain(certs / 'cert.pem', certs / 'key.pem')
+	return ctx
+
+
+def payload(path: str) -> Optional[Tuple[int, Iterator[bytes]]]:
+	'''Size and blocks of the body for the given request path, or None if there
+	is nothing there'''
+	path = path.split('?', 1)[0]
+
+	if path == '/5/5':
+		return len(BGGP5_DATA), iter((BGGP5_DATA,))
+
+	m = re.fullmatch(r'/bytes/(\w+)', path)
+	if m is None:
+		return None
+
+	try:
+		size = parse_size(m.group(1))
+	except ValueError:
+		return None
+
+	if size > MAX_SIZE:
+		return None
+
+	# Whole copies only, so that blocks join seamlessly
+	block = BGGP5_DATA * (BLOCK_SIZE // len(BGGP5_DATA))
+
+	def blocks():
+		left = size
+		while left:
+			n = min(left, len(block))
+			yield block[:n]
+			left -= n
+
+	return size, blocks()
+
+
+class Handler(BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1'
+	server_version = 'bggp5-serve'
+
+	def log_message(self, fmt, *a):
+		if self.server.args.verbose:
+			log(f'{self.address_string()} - {fmt % a}')
+
+	def do_HEAD(self):
+		self.respond(False)
+
+	def do_GET(self):
+		self.respond(True)
+
+	def respond(self, send_body: bool):
+		args = self.server.args
+
+		if args.latency:
+			sleep(args.latency / 1000)
+
+		host = self.headers.get('Host', '').split(':', 1)[0].lower()
+
+		if host == SHORT_URL_HOST:
+			self.send_response(301)
+			self.send_header('Location', BGGP5_URL)
+			self.send_header('Content-Length', '0')
+			self.end_headers()
+			return
+
+		body = payload(self.path)
+		if body is None:
+			self.send_error(404)
+			return
+
+		size, blocks = body
+		self.send_response(200)
+		self.send_header('Content-Type', 'application/octet-stream')
+
+		if args.chunked:
+			self.send_header('Transfer-Encoding', 'chunked')
+		else:
+			self.send_header('Content-Length', str(size))
+
+		self.end_headers()
+
+		if send_body:
+			self.send_body(blocks)
+
+	def send_body(self, blocks: Iterator[bytes]):
+		'''Write body blocks, as chunks if needed, not exceeding the bandwidth
+		limit (if any) from the start of the body'''
+		args = self.server.args
+		start = monotonic()
+		sent = 0
+
+		if args.chunked:
+			blocks = rechunk(blocks, args.chunk_size)
+
+		for data in blocks:
+			if args.chunked:
+				data = b'%x\r\n%s\r\n' % (len(data), data)
+
+			# Small writes, so that the cap holds within each block too
+			step = max(args.bandwidth // 50, 1) if args.bandwidth else len(data)
+
+			for i in range(0, len(data), step):
+				piece = data[i:i + step]
+				self.wfile.write(piece)
+				sent += len(piece)
+
+				if args.bandwidth:
+					delay = start + sent / args.bandwidth - monotonic()
+					if delay > 0:
+						sleep(delay)
+
+		if args.chunked:
+			self.wfile.write(b'0\r\n\r\n')
+
+		self.wfile.flush()
+
+
+def rechunk(blocks: Iterator[bytes], size: int) -> Iterator[bytes]:
+	buf = b''
+
+	for block in blocks:
+		buf += block
+		while len(buf) >= size:
+			yield buf[:size]
+			buf = buf[size:]
+
+	if buf:
+		yield buf
+
+
+class Server(ThreadingHTTPServer):
+	daemon_threads = True
+	# Clients may open hundreds of connections at once (e.g. io_uring_batch),
+	# the default backlog of 5 would drop their SYNs and stall them for seconds
+	request_queue_size = 1024
+
+	def __init__(self, addr, args: Namespace, ctx: Optional[ssl.SSLContext]):
+		self.args = args
+		self.ctx = ctx
+		super().__init__(addr, Handler)
+
+	def get_request(self):
+		sock, addr = super().get_request()
+
+		if self.ctx is not None:
+			# Handshake in the handler thread, not in the accept loop
+			sock = self.ctx.wrap_socket(sock, server_side=True,
+				do_handshake_on_connect=False)
+
+		return sock, addr
+
+	def handle_error(self, request, client_address):
+		# Clients going away mid-response are expected, especially with tests
+		# that stop reading as soon as they have seen enough
+		if self.args.verbose:
+			super().handle_error(request, client_address)
+
+
+def serve_inetd(args: Namespace, ctx: Optional[ssl.SSLContext]):
+	'''Serve the connection on stdin/stdout (a socket when spawned by QEMU)'''
+	sock = socket.socket(fileno=0)
+
+	if ctx is not None:
+		sock = ctx.wrap_socket(sock, server_side=True)
+
+	server = Namespace(args=args)
+
+	try:
+		Handler(sock, ('guest', 0), server)
+	except (OSError, ssl.SSLError):
+		pass
+	finally:
+		sock.close()
+
+
+def enter_sandbox(certs: Path, tmpdir: Path):
+	'''Finish setting up the namespaces created by unshare -rmn: bring up the
+	loopback interface and make binary.golf and 7f.uk resolve to it, trusting
+	our CA only'''
+	run(['ip', 'link', 'set', 'lo', 'up'], check=True)
+
+	hosts = tmpdir / 'hosts'
+	hosts.write_text(f'127.0.0.1 localhost {" ".join(HOSTNAMES)}\n::1 localhost\n')
+	run(['mount', '--bind', str(hosts), '/etc/hosts'], check=True)
+
+	for bundle in CA_BUNDLES:
+		if Path(bundle).exists():
+			run(['mount', '--bind', str(certs / 'ca.pem'), bundle], check=True)
+
+	# For tools and libraries that look here before the default bundle
+	os.environ['CURL_CA_BUNDLE'] = os.environ['SSL_CERT_FILE'] = str(certs / 'ca.pem')
+
+
+def main() -> int:
+	args = parse_args()
+
+	if args.sandbox and os.environ.get(SANDBOX_ENV) is None:
+		# Start over inside the new namespaces
+		os.environ[SANDBOX_ENV] = '1'
+		os.execvp('unshare', ['unshare', '-rmn', '--', sys.executable,
+			os.path.abspath(__file__), *sys.argv[1:]])
+
+	with TemporaryDirectory(prefix='bggp5-serve-') as tmpdir:
+		tmpdir = Path(tmpdir)
+		certs = args.certs or tmpdir / 'certs'
+
+		if args.make_certs or not args.inetd or args.inetd == 'https':
+			make_certs(certs)
+		if args.make_certs:
+			return 0
+
+		if args.inetd:
+			serve_inetd(args, tls_context(certs) if args.inetd == 'https' else None)
+			return 0
+
+		if args.sandbox:
+			enter_sandbox(certs, tmpdir)
+
+		servers: List[Server] = [
+			Server((args.bind, args.http_port), args, None),
+			Server((args.bind, args.https_port), args, tls_context(certs))
+		]
+
+		for s in servers:
+			Thread(target=s.serve_forever, daemon=True).start()
+
+		if not args.command:
+			log(f'Serving HTTP on {args.bind}:{args.http_port} and HTTPS on '
+				f'{args.bind}:{args.https_port} (CA: {certs / "ca.pem"})')
+
+			try:
+				while 1:
+					sleep(3600)
+			except KeyboardInterrupt:
+				return 0
+
+		if args.verbose:
+			log(f'Running {shlex.join(args.command)}')
+
+		try:
+			return run(args.command).returncode
+		except FileNotFoundError as e:
+			log(f'ERROR: {e}')
+			return 127
+		except KeyboardInterrupt:
+			return 130
+		finally:
+			for s in servers:
+				s.shutdown()
+				s.server_close()
+
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,486 @@
+/** @file
+  BGGP5 UEFI Application - https://binary.golf/5/
+
+  Benchmark of the raw EFI_HTTP_PROTOCOL sequence used by the Raw apps. The
+  whole sequence is run ITERATIONS times, each stage timed with the TSC:
+
+    locate     gBS->LocateProtocol() for the HTTP Service Binding protocol
+    create     EFI_SERVICE_BINDING_PROTOCOL.CreateChild() + HandleProtocol()
+    configure  EFI_HTTP_PROTOCOL.Configure()
+    request    EFI_HTTP_PROTOCOL.Request() until the token is signaled
+    response   EFI_HTTP_PROTOCOL.Response() calls until the body is complete
+    output     printing the body to console
+    destroy    Configure(NULL) + DestroyChild()
+    total      all of the above
+
+  Min/median/p99/max per stage are then printed as CSV, between marker lines
+  so that run.py can pick them out of the serial log.
+
+  Usage: BGGP5_Bench.efi [-n ITERATIONS] [-q] [URL]
+
+    -n ITERATIONS  Number of times to run the sequence (default 20)
+    -q             Do not print the body (the output stage then measures
+                   nothing)
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/HttpLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiApplicationEntryPoint.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+#include <Protocol/Http.h>
+#include <Protocol/ServiceBinding.h>
+#include <Protocol/ShellParameters.h>
+
+#include "ConWriter.h"
+#include "HttpBody.h"
+#include "HttpUtil.h"
+#include "HttpWait.h"
+
+#define DEFAULT_URL        L"https://binary.golf/5/5"
+#define DEFAULT_ITERATIONS 20
+#define MAX_ITERATIONS     10000
+
+#define REQUEST_TIMEOUT_MS  5000
+#define RESPONSE_TIMEOUT_MS 5000
+
+// Size of the buffer used to receive the response body
+#define RECV_BUFFER_SIZE 0x10000
+
+// Max size of the Host header value
+#define HOST_MAX 256
+
+// Lines surrounding the CSV results, looked for by run.py
+#define CSV_BEGIN "BGGP5-BENCH-CSV-BEGIN"
+#define CSV_END   "BGGP5-BENCH-CSV-END"
+
+typedef enum {
+  StageLocate,
+  StageCreate,
+  StageConfigure,
+  StageRequest,
+  StageResponse,
+  StageOutput,
+  StageDestroy,
+  StageTotal,
+  StageMax
+} STAGE;
+
+STATIC CONST CHAR8 *mStageNames[StageMax] = {
+  "locate", "create", "configure", "request", "response", "output", "destroy", "total"
+};
+
+typedef struct {
+  EFI_HTTP_PROTOCOL       *Http;
+  EFI_HTTP_CONFIG_DATA    ConfigData;
+  EFI_HTTPv4_ACCESS_POINT AccessPoint;
+  EFI_HTTP_REQUEST_DATA   RequestData;
+  EFI_HTTP_HEADER         RequestHeader;
+  EFI_HTTP_MESSAGE        RequestMessage;
+  EFI_HTTP_TOKEN          RequestToken;
+  EFI_HTTP_RESPONSE_DATA  ResponseData;
+  EFI_HTTP_MESSAGE        ResponseMessage;
+  EFI_HTTP_TOKEN          ResponseToken;
+  HTTP_BODY               Body;
+  CHAR8                   *Buffer;
+  CHAR8                   Host[HOST_MAX];
+
+  // Whole body of the last response, printed in the output stage
+  CHAR8                   *Data;
+  UINTN                   DataSize;
+  UINTN                   DataCapacity;
+} BENCH;
+
+
+// Wait for a token, canceling it on timeout
+STATIC
+EFI_STATUS
+WaitToken (
+  IN BENCH          *Bench,
+  IN HTTP_WAIT      *Wait,
+  IN EFI_HTTP_TOKEN *Token,
+  IN UINTN          TimeoutMs
+  )
+{
+  EFI_STATUS Status;
+
+  Status = HttpWaitToken (Wait, Bench->Http, Token->Event, TimeoutMs);
+  if (Status == EFI_TIMEOUT) {
+    Bench->Http->Cancel (Bench->Http, Token);
+    return EFI_TIMEOUT;
+  }
+
+  return EFI_ERROR (Status) ? Status : Token->Status;
+}
+
+
+// Append body data to be printed in the output stage
+STATIC
+EFI_STATUS
+KeepData (
+  IN BENCH       *Bench,
+  IN CONST CHAR8 *Data,
+  IN UINTN       Length
+  )
+{
+  UINTN Capacity;
+  CHAR8 *New;
+
+  if (Bench->DataSize + Length > Bench->DataCapacity) {
+    Capacity = MAX (Bench->DataCapacity * 2, Bench->DataSize + Length);
+    New      = ReallocatePool (Bench->DataCapacity, Capacity, Bench->Data);
+    if (New == NULL)
+      return EFI_OUT_OF_RESOURCES;
+
+    Bench->Data         = New;
+    Bench->DataCapacity = Capacity;
+  }
+
+  CopyMem (Bench->Data + Bench->DataSize, Data, Length);
+  Bench->DataSize += Length;
+  return EFI_SUCCESS;
+}
+
+
+// Receive the whole response: status and headers first, then body pieces
+// through the receive buffer until the body is complete
+STATIC
+EFI_STATUS
+ReceiveResponse (
+  IN BENCH     *Bench,
+  IN HTTP_WAIT *Wait
+  )
+{
+  EFI_STATUS Status;
+  UINTN      Length;
+  BOOLEAN    First = TRUE;
+
+  Bench->DataSize = 0;
+
+  do {
+    Bench->ResponseData.StatusCode       = HTTP_STATUS_UNSUPPORTED_STATUS;
+    Bench->ResponseMessage.Data.Response = First ? &Bench->ResponseData : NULL;
+    Bench->ResponseMessage.HeaderCount   = 0;
+    Bench->ResponseMessage.Headers       = NULL;
+    Bench->ResponseMessage.BodyLength    = RECV_BUFFER_SIZE;
+    Bench->ResponseMessage.Body          = Bench->Buffer;
+    Bench->ResponseToken.Status          = EFI_SUCCESS;
+    Bench->ResponseToken.Message         = &Bench->ResponseMessage;
+
+    Status = Bench->Http->Response (Bench->Http, &Bench->ResponseToken);
+    if (!EFI_ERROR (Status))
+      Status = WaitToken (Bench, Wait, &Bench->ResponseToken, RESPONSE_TIMEOUT_MS);
+
+    if (EFI_ERROR (Status)) {
+      // Server closing the connection is the only way to end a body that has
+      // neither Content-Length nor chunked encoding
+      if (Status == EFI_CONNECTION_FIN && !First && HttpBodyEndsAtClose (&Bench->Body))
+        return EFI_SUCCESS;
+
+      return Status;
+    }
+
+    if (First) {
+      HttpBodyInit (&Bench->Body, Bench->ResponseMessage.HeaderCount, Bench->ResponseMessage.Headers, FALSE);
+
+      HttpFreeHeaderFields (Bench->ResponseMessage.Headers, Bench->ResponseMessage.HeaderCount);
+
+      // Again, this is an enum value, not a real HTTP status code
+      if (Bench->ResponseData.StatusCode != HTTP_STATUS_200_OK)
+        return EFI_HTTP_ERROR;
+
+      First = FALSE;
+    }
+
+    Length = HttpBodyFeed (&Bench->Body, Bench->Buffer, Bench->ResponseMessage.BodyLength);
+
+    Status = KeepData (Bench, Bench->Buffer, Length);
+    if (EFI_ERROR (Status))
+      return Status;
+  } while (!HttpBodyDone (&Bench->Body));
+
+  return EFI_SUCCESS;
+}
+
+
+// Run the whole sequence once, storing the TSC ticks taken by each stage
+STATIC
+EFI_STATUS
+RunOnce (
+  IN  BENCH      *Bench,
+  IN  HTTP_WAIT  *Wait,
+  IN  CON_WRITER *Writer,
+  IN  BOOLEAN    Quiet,
+  OUT UINT64     *Ticks
+  )
+{
+  EFI_STATUS                   Status;
+  EFI_STATUS                   DestroyStatus;
+  EFI_SERVICE_BINDING_PROTOCOL *ServiceBinding;
+  EFI_HANDLE                   Handle = NULL;
+  UINT64                       Tsc[StageMax];
+  UINTN                        i;
+
+  ZeroMem (Tsc, sizeof (Tsc));
+  Bench->Http = NULL;
+  Tsc[StageLocate] = AsmReadTsc ();
+
+  Status = gBS->LocateProtocol (&gEfiHttpServiceBindingProtocolGuid, NULL, (VOID **)&ServiceBinding);
+  if (EFI_ERROR (Status)) {
+    Print (L"LocateProtocol for HttpServiceBinding failed: %r\n", Status);
+    return Status;
+  }
+
+  Tsc[StageCreate] = AsmReadTsc ();
+
+  Status = ServiceBinding->CreateChild (ServiceBinding, &Handle);
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpServiceBinding::CreateChild failed: %r\n", Status);
+    return Status;
+  }
+
+  Status = gBS->HandleProtocol (Handle, &gEfiHttpProtocolGuid, (VOID **)&Bench->Http);
+  if (EFI_ERROR (Status)) {
+    Print (L"HandleProtocol for HttpProtocol failed: %r\n", Status);
+    goto out_destroy_child;
+  }
+
+  Tsc[StageConfigure] = AsmReadTsc ();
+
+  Status = Bench->Http->Configure (Bench->Http, &Bench->ConfigData);
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpProtocol::Configure failed: %r\n", Status);
+    goto out_destroy_child;
+  }
+
+  Tsc[StageRequest] = AsmReadTsc ();
+
+  Bench->RequestToken.Status = EFI_SUCCESS;
+  Status = Bench->Http->Request (Bench->Http, &Bench->RequestToken);
+  if (!EFI_ERROR (Status))
+    Status = WaitToken (Bench, Wait, &Bench->RequestToken, REQUEST_TIMEOUT_MS);
+
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpProtocol::Request failed: %r\n", Status);
+    goto out_destroy_child;
+  }
+
+  Tsc[StageResponse] = AsmReadTsc ();
+
+  Status = ReceiveResponse (Bench, Wait);
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpProtocol::Response failed: %r\n", Status);
+    goto out_destroy_child;
+  }
+
+  Tsc[StageOutput] = AsmReadTsc ();
+
+  if (!Quiet) {
+    ConWriterWrite (Writer, Bench->Data, Bench->DataSize);
+    ConWriterFlush (Writer);
+  }
+
+  Tsc[StageDestroy] = AsmReadTsc ();
+
+out_destroy_child:
+  if (Bench->Http != NULL)
+    Bench->Http->Configure (Bench->Http, NULL);
+
+  DestroyStatus = ServiceBinding->DestroyChild (ServiceBinding, Handle);
+  if (EFI_ERROR (DestroyStatus))
+    Print (L"HttpServiceBinding::DestroyChild failed: %r\n", DestroyStatus);
+
+  if (EFI_ERROR (Status))
+    return Status;
+
+  Tsc[StageTotal] = AsmReadTsc ();
+
+  for (i = 0; i < StageTotal; i++)
+    Ticks[i] = Tsc[i + 1] - Tsc[i];
+
+  Ticks[StageTotal] = Tsc[StageTotal] - Tsc[StageLocate];
+  return DestroyStatus;
+}
+
+
+STATIC
+VOID
+SortTicks (
+  IN OUT UINT64 *Ticks,
+  IN     UINTN  N
+  )
+{
+  UINT64 Tmp;
+  UINTN  i;
+  UINTN  j;
+
+  for (i = 1; i < N; i++) {
+    Tmp = Ticks[i];
+    for (j = i; j > 0 && Ticks[j - 1] > Tmp; j--)
+      Ticks[j] = Ticks[j - 1];
+    Ticks[j] = Tmp;
+  }
+}
+
+
+// Print a TSC delta in microseconds with 3 decimals. Going through ns would
+// overflow MultU64x32() after a few seconds' worth of ticks.
+STATIC
+VOID
+PrintUs (
+  IN UINT64 Ticks,
+  IN UINT64 TscHz
+  )
+{
+  UINT64 Ns = DivU64x64Remainder (MultU64x32 (Ticks, 1000), MAX (DivU64x32 (TscHz, 1000000), 1), NULL);
+
+  Print (L",%lu.%03lu", DivU64x32 (Ns, 1000), Ns % 1000);
+}
+
+
+EFI_STATUS
+EFIAPI
+UefiMain (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_SHELL_PARAMETERS_PROTOCOL *ShellParameters;
+  CHAR16                        *Url = DEFAULT_URL;
+  UINTN                         Iterations = DEFAULT_ITERATIONS;
+  BOOLEAN                       Quiet = FALSE;
+  BENCH                         Bench;
+  HTTP_WAIT                     Wait;
+  CON_WRITER                    Writer;
+  UINT64                        *Samples;
+  UINT64                        Ticks[StageMax];
+  UINT64                        *Stage;
+  UINTN                         N = 0;
+  UINTN                         i;
+  UINTN                         s;
+
+  Status = gBS->HandleProtocol (ImageHandle, &gEfiShellParametersProtocolGuid, (VOID **)&ShellParameters);
+  if (!EFI_ERROR (Status)) {
+    for (i = 1; i < ShellParameters->Argc; i++) {
+      if (StrCmp (ShellParameters->Argv[i], L"-n") == 0 && i + 1 < ShellParameters->Argc)
+        Iterations = StrDecimalToUintn (ShellParameters->Argv[++i]);
+      else if (StrCmp (ShellParameters->Argv[i], L"-q") == 0)
+        Quiet = TRUE;
+      else
+        Url = ShellParameters->Argv[i];
+    }
+  }
+
+  if (Iterations == 0 || Iterations > MAX_ITERATIONS) {
+    Print (L"Iterations must be between 1 and %d\n", MAX_ITERATIONS);
+    return EFI_INVALID_PARAMETER;
+  }
+
+  ZeroMem (&Bench, sizeof (Bench));
+  ConWriterInit (&Writer, gST->ConOut);
+
+  Status = HttpUtilUrlHost (Url, Bench.Host, sizeof (Bench.Host));
+  if (EFI_ERROR (Status)) {
+    Print (L"Bad URL: %s\n", Url);
+    return Status;
+  }
+
+  Bench.AccessPoint.UseDefaultAddress   = TRUE;
+  Bench.ConfigData.HttpVersion          = HttpVersion11;
+  Bench.ConfigData.LocalAddressIsIPv6   = FALSE;
+  Bench.ConfigData.AccessPoint.IPv4Node = &Bench.AccessPoint;
+
+  Bench.RequestData.Method          = HttpMethodGet;
+  Bench.RequestData.Url             = Url;
+  Bench.RequestHeader.FieldName     = "Host";
+  Bench.RequestHeader.FieldValue    = Bench.Host;
+  Bench.RequestMessage.Data.Request = &Bench.RequestData;
+  Bench.RequestMessage.HeaderCount  = 1;
+  Bench.RequestMessage.Headers      = &Bench.RequestHeader;
+  Bench.RequestToken.Message        = &Bench.RequestMessage;
+
+  // Samples for stage s of iteration i are at [s * Iterations + i]
+  Samples = AllocatePool (StageMax * Iterations * sizeof (*Samples));
+  if (Samples == NULL)
+    return EFI_OUT_OF_RESOURCES;
+
+  Bench.Buffer = AllocatePool (RECV_BUFFER_SIZE);
+  if (Bench.Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_free_samples;
+  }
+
+  Status = HttpWaitInit (&Wait, HTTP_WAIT_POLL_INTERVAL_MS);
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpWaitInit failed: %r\n", Status);
+    goto out_free_buffer;
+  }
+
+  // No notify functions: token events are only ever checked or waited on
+  Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &Bench.RequestToken.Event);
+  if (EFI_ERROR (Status)) {
+    Print (L"CreateEvent for request failed: %r\n", Status);
+    goto out_free_wait;
+  }
+
+  Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &Bench.ResponseToken.Event);
+  if (EFI_ERROR (Status)) {
+    Print (L"CreateEvent for response failed: %r\n", Status);
+    goto out_close_request_event;
+  }
+
+  // Stop at the first failure, but still report what was measured so far
+  for (N = 0; N < Iterations; N++) {
+    Status = RunOnce (&Bench, &Wait, &Writer, Quiet, Ticks);
+    if (EFI_ERROR (Status)) {
+      Print (L"Iteration %lu failed: %r\n", (UINT64)N, Status);
+      break;
+    }
+
+    for (s = 0; s < StageMax; s++)
+      Samples[s * Iterations + N] = Ticks[s];
+  }
+
+  if (N == 0)
+    goto out_close_response_event;
+
+  // Nearest-rank percentiles over the sorted samples
+  Print (L"\n%a\n", CSV_BEGIN);
+  Print (L"stage,iterations,min_us,median_us,p99_us,max_us\n");
+
+  for (s = 0; s < StageMax; s++) {
+    Stage = &Samples[s * Iterations];
+    SortTicks (Stage, N);
+
+    Print (L"%a,%lu", mStageNames[s], (UINT64)N);
+    PrintUs (Stage[0], Wait.TscHz);
+    PrintUs (Stage[(N - 1) / 2], Wait.TscHz);
+    PrintUs (Stage[(N * 99 + 99) / 100 - 1], Wait.TscHz);
+    PrintUs (Stage[N - 1], Wait.TscHz);
+    Print (L"\n");
+  }
+
+  Print (L"%a\n", CSV_END);
+
+out_close_response_event:
+  gBS->CloseEvent (Bench.ResponseToken.Event);
+out_close_request_event:
+  gBS->CloseEvent (Bench.RequestToken.Event);
+out_free_wait:
+  HttpWaitFree (&Wait);
+out_free_buffer:
+  if (Bench.Data != NULL)
+    FreePool (Bench.Data);
+  FreePool (Bench.Buffer);
+out_free_samples:
+  FreePool (Samples);
+  return Status;
+}
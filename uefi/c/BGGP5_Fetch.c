@@ -0,0 +1,1057 @@
+/** @file
+  BGGP5 UEFI Application - https://binary.golf/5/
+
+  Downloads a list of URLs concurrently using raw EFI_HTTP_PROTOCOL, one HTTP
+  child instance per connection, with all Request/Response tokens in flight at
+  the same time and driven from a single event-driven loop (see Fetch.h).
+
+  Usage: BGGP5_Fetch.efi [-j CHILDREN] [-n first|race|split] [-r COUNT]
+                         [-p DEPTH] [-k SEGMENTS] [-z SEGMENT_SIZE]
+                         [-c batch|char|print|bench] [-o OUTPUT]
+                        [-f LISTFILE] [URL ...]
+
+    -j CHILDREN  Number of HTTP children (i.e. connections) to use per NIC
+                 (default 4)
+    -n first     Only use the first NIC found (default)
+    -n race      Send every request over every NIC and keep whichever answers
+                 first, aborting the others
+    -n split     Spread requests over all NICs to add up their bandwidth
+    -r COUNT     Download each URL COUNT times in a row over a single child per
+                 NIC, reusing the connection (HTTP/1.1 keep-alive), and report
+                 the latency of the first request against the later ones
+    -p DEPTH     Pipeline up to DEPTH requests on each child, i.e. send them
+                 before reading the responses (default 1, no pipelining)
+    -k SEGMENTS  Download the (first) URL in SEGMENTS parts at once with HTTP
+                 Range requests, each on its own child, into a single buffer
+    -z SIZE      Same as -k, but with segments of SIZE bytes each, downloaded
+                 over -j children per NIC
+    -c MODE      How to print the body: batch (widen to UTF-16 in a buffer and
+                 flush it with few OutputString() calls, the default), char
+                 (one OutputString() per character), print (Print()), or bench
+                 (output it in all the three modes and compare their times)
+    -o OUTPUT    Save the body to the file OUTPUT instead of printing it, on the
+                 same volume as the app, writing to disk while still receiving.
+                 With multiple URLs, OUTPUT is a directory (created if needed)
+                 and each body is saved there under the last component of its
+                 URL path.
+    -f LISTFILE  Read URLs from LISTFILE (one per line, '#' starts a comment),
+                 located on the same volume as the app (e.g. FS0:\urls.txt)
+
+  With a single URL (https://binary.golf/5/5 by default) the body is printed to
+  console like the other apps do (same for a segmented download). With multiple
+  URLs (or repetitions) bodies are discarded (unless saved with -o) and a
+  summary is printed instead.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UefiApplicationEntryPoint.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+#include <Protocol/ShellParameters.h>
+#include <Protocol/SimpleNetwork.h>
+
+#include "ConWriter.h"
+#include "Fetch.h"
+
+#define DEFAULT_URL      L"https://binary.golf/5/5"
+#define DEFAULT_CHILDREN 4
+#define DEFAULT_REPEAT   1
+#define DEFAULT_DEPTH    1
+
+// Print() formats into a buffer of PcdUefiLibMaxPrintBufferSize characters (320
+// by default) and silently truncates anything longer.
+#define PRINT_CHUNK_SIZE 256
+
+typedef struct {
+  CHAR16 **Items;
+  UINTN  Count;
+} URL_LIST;
+
+typedef enum {
+  ConsoleBatch,  // Widen into a buffer, flush with few large OutputString()
+  ConsoleChar,   // One OutputString() per character (like Raw_v4)
+  ConsolePrint,  // Print (L"%.*a") (like the other apps)
+  ConsoleBench   // Keep the body, output it in all the above modes and compare
+} CONSOLE_MODE;
+
+STATIC CONST CHAR16 *mConsoleModeNames[] = { L"batch", L"char", L"print", L"bench" };
+
+typedef struct {
+  CONSOLE_MODE Mode;
+  BOOLEAN      Report;        // Report time spent in output
+  CON_WRITER   Writer;
+  UINT64       Bytes;
+  UINT64       Tsc;           // Time spent in output
+  CHAR8        *Body;         // Whole body (ConsoleBench only)
+  UINTN        BodySize;
+  UINTN        BodyCapacity;
+} CONSOLE;
+
+typedef enum {
+  NicFirst,
+  NicRace,
+  NicSplit
+} NIC_STRATEGY;
+
+typedef struct {
+  EFI_HANDLE Controller;
+  UINTN      Index;      // Index in the LocateHandleBuffer() results
+  UINTN      FirstChild;
+  UINTN      NChildren;
+  UINT32     ChildMask;
+} NIC;
+
+
+// Take ownership of the pool-allocated Url and append it to List
+STATIC
+EFI_STATUS
+UrlListAppend (
+  IN OUT URL_LIST *List,
+  IN     CHAR16   *Url
+  )
+{
+  CHAR16 **Items;
+
+  Items = ReallocatePool (
+            List->Count * sizeof (*Items),
+            (List->Count + 1) * sizeof (*Items),
+            List->Items
+            );
+  if (Items == NULL) {
+    FreePool (Url);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Items[List->Count++] = Url;
+  List->Items = Items;
+  return EFI_SUCCESS;
+}
+
+
+STATIC
+VOID
+UrlListFree (
+  IN URL_LIST *List
+  )
+{
+  for (UINTN i = 0; i < List->Count; i++)
+    FreePool (List->Items[i]);
+
+  if (List->Items != NULL)
+    FreePool (List->Items);
+
+  List->Items = NULL;
+  List->Count = 0;
+}
+
+
+// Append all the URLs listed in a file, one per line. Blank lines and lines
+// starting with '#' are skipped.
+STATIC
+EFI_STATUS
+UrlListLoad (
+  IN OUT URL_LIST     *List,
+  IN     CONST CHAR16 *Path
+  )
+{
+  EFI_STATUS Status;
+  CHAR8      *Data;
+  UINTN      Size;
+  UINTN      Start;
+  UINTN      End;
+  UINTN      Next;
+  CHAR16     *Url;
+
+  Status = FetchReadFile (Path, &Data, &Size);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  for (Start = 0; Start < Size; Start = Next) {
+    for (End = Start; End < Size && Data[End] != '\n'; End++)
+      ;
+
+    Next = End + 1;
+
+    // Trim whitespace (and CR of CRLF line endings)
+    while (Start < End && (Data[Start] == ' ' || Data[Start] == '\t'))
+      Start++;
+    while (End > Start && (Data[End - 1] == ' ' || Data[End - 1] == '\t' || Data[End - 1] == '\r'))
+      End--;
+
+    if (Start == End || Data[Start] == '#')
+      continue;
+
+    Url = AllocatePool ((End - Start + 1) * sizeof (CHAR16));
+    if (Url == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      break;
+    }
+
+    for (UINTN i = 0; i < End - Start; i++)
+      Url[i] = (UINT8)Data[Start + i];
+    Url[End - Start] = L'\0';
+
+    Status = UrlListAppend (List, Url);
+    if (EFI_ERROR (Status))
+      break;
+  }
+
+  FreePool (Data);
+  return Status;
+}
+
+
+// Output ASCII data to console in the given mode
+STATIC
+EFI_STATUS
+ConsoleOutput (
+  IN CONSOLE      *Console,
+  IN CONSOLE_MODE Mode,
+  IN CONST CHAR8  *Data,
+  IN UINTN        Length
+  )
+{
+  CHAR16 Wide[2];
+  UINTN  N;
+
+  switch (Mode) {
+  case ConsoleChar:
+    Wide[1] = L'\0';
+
+    for (N = 0; N < Length; N++) {
+      Wide[0] = (UINT8)Data[N];
+      gST->ConOut->OutputString (gST->ConOut, Wide);
+    }
+    break;
+
+  case ConsolePrint:
+    while (Length > 0) {
+      N = MIN (Length, PRINT_CHUNK_SIZE);
+      Print (L"%.*a", N, Data);
+      Data   += N;
+      Length -= N;
+    }
+    break;
+
+  default:
+    return ConWriterWrite (&Console->Writer, Data, Length);
+  }
+
+  return EFI_SUCCESS;
+}
+
+
+// Sink printing the body to console as it arrives
+STATIC
+EFI_STATUS
+ConsoleWrite (
+  IN VOID       *Context,
+  IN FETCH_JOB  *Job,
+  IN UINT64     Offset,
+  IN CONST VOID *Data,
+  IN UINTN      Length
+  )
+{
+  CONSOLE    *Console = Context;
+  EFI_STATUS Status;
+  UINT64     Start;
+  UINTN      Capacity;
+  CHAR8      *Body;
+
+  Console->Bytes += Length;
+
+  // Keep the whole body to output it in all modes at the end
+  if (Console->Mode == ConsoleBench) {
+    if (Console->BodySize + Length > Console->BodyCapacity) {
+      Capacity = MAX (Console->BodyCapacity * 2, Console->BodySize + Length);
+      Body     = ReallocatePool (Console->BodyCapacity, Capacity, Console->Body);
+      if (Body == NULL)
+        return EFI_OUT_OF_RESOURCES;
+
+      Console->Body         = Body;
+      Console->BodyCapacity = Capacity;
+    }
+
+    CopyMem (Console->Body + Console->BodySize, Data, Length);
+    Console->BodySize += Length;
+    return EFI_SUCCESS;
+  }
+
+  Start  = AsmReadTsc ();
+  Status = ConsoleOutput (Console, Console->Mode, Data, Length);
+  Console->Tsc += AsmReadTsc () - Start;
+  return Status;
+}
+
+
+// Flush console output and report the time it took. In ConsoleBench mode,
+// output the body with each mode in turn and compare them.
+STATIC
+VOID
+ConsoleFinish (
+  IN CONSOLE   *Console,
+  IN HTTP_WAIT *Wait
+  )
+{
+  UINT64       Us[ConsoleBench];
+  UINT64       Start;
+  CONSOLE_MODE Mode;
+
+  if (Console->Mode != ConsoleBench) {
+    Start = AsmReadTsc ();
+    ConWriterFlush (&Console->Writer);
+    Console->Tsc += AsmReadTsc () - Start;
+
+    if (Console->Report) {
+      Print (
+        L"\nConsole output (%s): %lu bytes in %lu us\n",
+        mConsoleModeNames[Console->Mode],
+        Console->Bytes,
+        HttpWaitTscToUs (Wait, Console->Tsc)
+        );
+    }
+
+    return;
+  }
+
+  for (Mode = 0; Mode < ConsoleBench; Mode++) {
+    Print (L"\n--- %s ---\n", mConsoleModeNames[Mode]);
+
+    Console->Writer.Calls = 0;
+    Start = AsmReadTsc ();
+    ConsoleOutput (Console, Mode, Console->Body, Console->BodySize);
+    ConWriterFlush (&Console->Writer);
+    Us[Mode] = HttpWaitTscToUs (Wait, AsmReadTsc () - Start);
+  }
+
+  Print (L"\nConsole output of %lu bytes:\n", (UINT64)Console->BodySize);
+
+  for (Mode = 0; Mode < ConsoleBench; Mode++) {
+    // Speedup against one OutputString() per character, with 2 decimals
+    UINT64 Speedup = Us[Mode] ? DivU64x64Remainder (MultU64x32 (Us[ConsoleChar], 100), Us[Mode], NULL) : 0;
+
+    Print (
+      L"  %-5s %8lu us  %lu.%02lux\n",
+      mConsoleModeNames[Mode],
+      Us[Mode],
+      DivU64x32 (Speedup, 100),
+      Speedup % 100
+      );
+  }
+
+  Print (L"  (batch used %lu OutputString() calls)\n", Console->Writer.Calls);
+
+  if (Console->Body != NULL)
+    FreePool (Console->Body);
+}
+
+
+// Build the path a download is saved to in the output directory Dir: the last
+// component of the URL path, without query or fragment, or "index" if empty
+STATIC
+VOID
+OutputPath (
+  IN  CONST CHAR16 *Dir,
+  IN  CONST CHAR16 *Url,
+  OUT CHAR16       *Path
+  )
+{
+  CONST CHAR16 *Name = Url;
+  UINTN        Length;
+
+  for (CONST CHAR16 *p = Url; *p != L'\0' && *p != L'?' && *p != L'#'; p++) {
+    if (*p == L'/')
+      Name = p + 1;
+  }
+
+  for (Length = 0; Name[Length] != L'\0' && Name[Length] != L'?' && Name[Length] != L'#'; Length++)
+    ;
+
+  if (Length == 0) {
+    Name   = L"index";
+    Length = 5;
+  }
+
+  UnicodeSPrint (Path, FETCH_PATH_MAX * sizeof (CHAR16), L"%s\\%.*s", Dir, Length, Name);
+}
+
+
+STATIC
+VOID
+PrintFileSink (
+  IN HTTP_WAIT       *Wait,
+  IN FETCH_FILE_SINK *FileSink
+  )
+{
+  Print (
+    L"Saved %lu bytes to %s with %lu %a writes: %lu us writing, %lu us waiting for disk\n",
+    FileSink->Bytes,
+    FileSink->Path,
+    FileSink->Writes,
+    FileSink->Async ? "async" : "blocking",
+    HttpWaitTscToUs (Wait, FileSink->WriteTsc),
+    HttpWaitTscToUs (Wait, FileSink->WaitTsc)
+    );
+}
+
+
+// Print a NIC's MAC address to tell which one is which
+STATIC
+VOID
+PrintNic (
+  IN NIC *Nic
+  )
+{
+  EFI_STATUS                  Status;
+  EFI_SIMPLE_NETWORK_PROTOCOL *Snp;
+
+  Print (L"NIC %lu", (UINT64)Nic->Index);
+
+  Status = gBS->HandleProtocol (Nic->Controller, &gEfiSimpleNetworkProtocolGuid, (VOID **)&Snp);
+  if (!EFI_ERROR (Status)) {
+    for (UINTN i = 0; i < Snp->Mode->HwAddressSize; i++)
+      Print (i == 0 ? L" (%02x" : L":%02x", Snp->Mode->CurrentAddress.Addr[i]);
+    Print (L")");
+  }
+}
+
+
+STATIC
+NIC *
+NicOfChild (
+  IN NIC   *Nics,
+  IN UINTN NNics,
+  IN UINTN Child
+  )
+{
+  for (UINTN i = 0; i < NNics; i++) {
+    if (Nics[i].ChildMask & (1U << Child))
+      return &Nics[i];
+  }
+
+  return NULL;
+}
+
+
+// The job that counts for a download out of the JobsPerDownload racing for it:
+// the one that succeeded, or else the first one that was not aborted
+STATIC
+FETCH_JOB *
+DownloadResult (
+  IN FETCH_JOB *Jobs,
+  IN UINTN     JobsPerDownload
+  )
+{
+  FETCH_JOB *Result = NULL;
+
+  for (UINTN i = 0; i < JobsPerDownload; i++) {
+    if (!EFI_ERROR (Jobs[i].Status))
+      return &Jobs[i];
+
+    if (Result == NULL && Jobs[i].Status != EFI_ABORTED)
+      Result = &Jobs[i];
+  }
+
+  return Result != NULL ? Result : &Jobs[0];
+}
+
+
+STATIC
+VOID
+PrintReport (
+  IN HTTP_WAIT *Wait,
+  IN NIC       *Nics,
+  IN UINTN     NNics,
+  IN FETCH_JOB *Jobs,
+  IN UINTN     NDownloads,
+  IN UINTN     JobsPerDownload,
+  IN UINT64    WallUs
+  )
+{
+  FETCH_JOB *Job;
+  NIC       *Nic;
+  UINT64    SumUs = 0;
+  UINT64    TotalBytes = 0;
+  UINTN     NOk = 0;
+  UINTN     i;
+
+  for (i = 0; i < NDownloads * JobsPerDownload; i++) {
+    Job = &Jobs[i];
+
+    if (Job->StartTsc == 0) {
+      Print (L"[%2lu] not started: %r: %s\n", (UINT64)(i / JobsPerDownload), Job->Status, Job->Url);
+      continue;
+    }
+
+    Print (L"[%2lu] ", (UINT64)(i / JobsPerDownload));
+    PrintNic (NicOfChild (Nics, NNics, Job->Child));
+    Print (
+      L" child %lu: %r, %lu bytes in %lu ms",
+      (UINT64)Job->Child,
+      Job->Status,
+      Job->Bytes,
+      DivU64x32 (HttpWaitTscToUs (Wait, Job->EndTsc - Job->StartTsc), 1000)
+      );
+
+    if (Job->HeadersTsc != 0)
+      Print (L" (first byte %lu ms)", DivU64x32 (HttpWaitTscToUs (Wait, Job->HeadersTsc - Job->StartTsc), 1000));
+
+    Print (L": %s\n", Job->Url);
+    TotalBytes += Job->Bytes;
+  }
+
+  // Per-NIC totals: the time span goes from the first request started to the
+  // last one finished on the NIC
+  for (Nic = Nics; NNics > 1 && Nic < Nics + NNics; Nic++) {
+    UINT64 FirstTsc = MAX_UINT64;
+    UINT64 LastTsc = 0;
+    UINT64 HeadersUs = 0;
+    UINT64 Bytes = 0;
+    UINT64 SpanUs;
+    UINTN  NJobs = 0;
+    UINTN  NHeaders = 0;
+    UINTN  NJobsOk = 0;
+
+    for (i = 0; i < NDownloads * JobsPerDownload; i++) {
+      Job = &Jobs[i];
+      if (Job->StartTsc == 0 || NicOfChild (Nics, NNics, Job->Child) != Nic)
+        continue;
+
+      FirstTsc = MIN (FirstTsc, Job->StartTsc);
+      LastTsc  = MAX (LastTsc, Job->EndTsc);
+      Bytes   += Job->Bytes;
+      NJobs++;
+
+      if (!EFI_ERROR (Job->Status))
+        NJobsOk++;
+
+      if (Job->HeadersTsc != 0) {
+        HeadersUs += HttpWaitTscToUs (Wait, Job->HeadersTsc - Job->StartTsc);
+        NHeaders++;
+      }
+    }
+
+    PrintNic (Nic);
+
+    if (NJobs == 0) {
+      Print (L": no requests\n");
+      continue;
+    }
+
+    SpanUs = HttpWaitTscToUs (Wait, LastTsc - FirstTsc);
+    Print (
+      L": %lu/%lu requests ok, %lu bytes in %lu ms (%lu bytes/s), avg first byte %lu ms\n",
+      (UINT64)NJobsOk,
+      (UINT64)NJobs,
+      Bytes,
+      DivU64x32 (SpanUs, 1000),
+      SpanUs ? DivU64x64Remainder (MultU64x32 (Bytes, 1000000), SpanUs, NULL) : 0,
+      NHeaders ? DivU64x32 (DivU64x32 (HeadersUs, (UINT32)NHeaders), 1000) : 0
+      );
+  }
+
+  for (i = 0; i < NDownloads; i++) {
+    Job = DownloadResult (&Jobs[i * JobsPerDownload], JobsPerDownload);
+    if (Job->StartTsc != 0)
+      SumUs += HttpWaitTscToUs (Wait, Job->EndTsc - Job->StartTsc);
+    if (!EFI_ERROR (Job->Status))
+      NOk++;
+  }
+
+  // The sum of the per-download times is roughly how long downloading them one
+  // after another would have taken
+  Print (
+    L"Completed %lu/%lu downloads (%lu bytes) over %lu NICs in %lu ms (sequential sum %lu ms)\n",
+    (UINT64)NOk,
+    (UINT64)NDownloads,
+    TotalBytes,
+    (UINT64)NNics,
+    DivU64x32 (WallUs, 1000),
+    DivU64x32 (SumUs, 1000)
+    );
+}
+
+
+// Latency of the first download of each URL (which pays for connection setup,
+// including the TLS handshake for HTTPS) against the later ones reusing the
+// connection. With pipelining, latency also includes waiting for the responses
+// to the requests sent before.
+STATIC
+VOID
+PrintRepeatReport (
+  IN HTTP_WAIT *Wait,
+  IN FETCH_JOB *Jobs,
+  IN UINTN     NUrls,
+  IN UINTN     Repeat,
+  IN UINTN     JobsPerDownload
+  )
+{
+  FETCH_JOB *Job;
+  UINT64    FirstTsc;
+  UINT64    LastTsc;
+  UINT64    Us;
+  UINT64    SumUs;
+  UINT64    MinUs;
+  UINT64    MaxUs;
+  UINT64    HeadersUs;
+  UINTN     NOk;
+  UINTN     u;
+  UINTN     r;
+
+  for (u = 0; u < NUrls; u++) {
+    FirstTsc  = MAX_UINT64;
+    LastTsc   = 0;
+    SumUs     = 0;
+    MinUs     = MAX_UINT64;
+    MaxUs     = 0;
+    HeadersUs = 0;
+    NOk       = 0;
+
+    Print (L"%s\n", Jobs[u * Repeat * JobsPerDownload].Url);
+
+    for (r = 0; r < Repeat; r++) {
+      Job = DownloadResult (&Jobs[(u * Repeat + r) * JobsPerDownload], JobsPerDownload);
+      if (Job->StartTsc == 0)
+        continue;
+
+      FirstTsc = MIN (FirstTsc, Job->StartTsc);
+      LastTsc  = MAX (LastTsc, Job->EndTsc);
+
+      if (EFI_ERROR (Job->Status) || Job->HeadersTsc == 0)
+        continue;
+
+      Us = HttpWaitTscToUs (Wait, Job->EndTsc - Job->StartTsc);
+
+      if (r == 0) {
+        Print (
+          L"  first: %lu us (first byte %lu us)\n",
+          Us,
+          HttpWaitTscToUs (Wait, Job->HeadersTsc - Job->StartTsc)
+          );
+        continue;
+      }
+
+      SumUs     += Us;
+      MinUs      = MIN (MinUs, Us);
+      MaxUs      = MAX (MaxUs, Us);
+      HeadersUs += HttpWaitTscToUs (Wait, Job->HeadersTsc - Job->StartTsc);
+      NOk++;
+    }
+
+    if (NOk > 0) {
+      Print (
+        L"  later: %lu ok, avg %lu us (first byte %lu us), min %lu us, max %lu us\n",
+        (UINT64)NOk,
+        DivU64x32 (SumUs, (UINT32)NOk),
+        DivU64x32 (HeadersUs, (UINT32)NOk),
+        MinUs,
+        MaxUs
+        );
+    }
+
+    if (LastTsc > FirstTsc) {
+      Us = HttpWaitTscToUs (Wait, LastTsc - FirstTsc);
+      Print (
+        L"  total: %lu requests in %lu ms, %lu requests/s\n",
+        (UINT64)Repeat,
+        DivU64x32 (Us, 1000),
+        Us ? DivU64x64Remainder (MultU64x32 (Repeat, 1000000), Us, NULL) : 0
+        );
+    }
+  }
+}
+
+
+EFI_STATUS
+EFIAPI
+UefiMain (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  EFI_STATUS                    Status;
+  EFI_SHELL_PARAMETERS_PROTOCOL *ShellParameters;
+  URL_LIST                      Urls = { NULL, 0 };
+  NIC_STRATEGY                  Strategy = NicFirst;
+  EFI_HANDLE                    *Controllers = NULL;
+  UINTN                         NControllers;
+  NIC                           *Nics;
+  NIC                           *Nic;
+  UINTN                         NNics = 0;
+  UINTN                         MaxChildren = DEFAULT_CHILDREN;
+  UINTN                         Repeat = DEFAULT_REPEAT;
+  UINTN                         Depth = DEFAULT_DEPTH;
+  UINTN                         NDownloads;
+  UINTN                         NSegments = 0;
+  UINT64                        SegmentSize = 0;
+  FETCH_SEGMENTED               Segmented;
+  UINTN                         PerNic;
+  UINTN                         NChildren = 0;
+  FETCH_CHILD                   *Children;
+  FETCH_JOB                     *Jobs;
+  FETCH_JOB                     *Job;
+  UINTN                         JobsPerDownload;
+  CONSOLE                       Console;
+  FETCH_SINK                    ConsoleSink = { ConsoleWrite, &Console };
+  CHAR16                        *Output = NULL;
+  FETCH_FILE_SINK               *FileSinks = NULL;
+  CHAR16                        Path[FETCH_PATH_MAX];
+  HTTP_WAIT                     Wait;
+  CHAR16                        *Url;
+  UINT64                        StartTsc;
+  UINT64                        WallUs;
+  UINTN                         i;
+  UINTN                         n;
+
+  ZeroMem (&Console, sizeof (Console));
+  ConWriterInit (&Console.Writer, gST->ConOut);
+
+  // Shell arguments, if run from the shell at all
+  Status = gBS->HandleProtocol (ImageHandle, &gEfiShellParametersProtocolGuid, (VOID **)&ShellParameters);
+  if (!EFI_ERROR (Status)) {
+    for (i = 1; i < ShellParameters->Argc; i++) {
+      CHAR16 *Arg = ShellParameters->Argv[i];
+
+      if (StrCmp (Arg, L"-j") == 0 && i + 1 < ShellParameters->Argc) {
+        MaxChildren = StrDecimalToUintn (ShellParameters->Argv[++i]);
+      } else if (StrCmp (Arg, L"-r") == 0 && i + 1 < ShellParameters->Argc) {
+        Repeat = MAX (StrDecimalToUintn (ShellParameters->Argv[++i]), 1);
+      } else if (StrCmp (Arg, L"-p") == 0 && i + 1 < ShellParameters->Argc) {
+        Depth = StrDecimalToUintn (ShellParameters->Argv[++i]);
+        if (Depth == 0 || Depth > FETCH_MAX_PIPELINE) {
+          Print (L"Pipeline depth must be between 1 and %d\n", FETCH_MAX_PIPELINE);
+          Status = EFI_INVALID_PARAMETER;
+          goto out_free_urls;
+        }
+      } else if (StrCmp (Arg, L"-k") == 0 && i + 1 < ShellParameters->Argc) {
+        NSegments = StrDecimalToUintn (ShellParameters->Argv[++i]);
+      } else if (StrCmp (Arg, L"-z") == 0 && i + 1 < ShellParameters->Argc) {
+        SegmentSize = StrDecimalToUint64 (ShellParameters->Argv[++i]);
+      } else if (StrCmp (Arg, L"-c") == 0 && i + 1 < ShellParameters->Argc) {
+        Arg = ShellParameters->Argv[++i];
+
+        for (Console.Mode = 0; Console.Mode <= ConsoleBench; Console.Mode++) {
+          if (StrCmp (Arg, mConsoleModeNames[Console.Mode]) == 0)
+            break;
+        }
+
+        if (Console.Mode > ConsoleBench) {
+          Print (L"Unknown console mode: %s\n", Arg);
+          Status = EFI_INVALID_PARAMETER;
+          goto out_free_urls;
+        }
+
+        Console.Report = TRUE;
+      } else if (StrCmp (Arg, L"-n") == 0 && i + 1 < ShellParameters->Argc) {
+        Arg = ShellParameters->Argv[++i];
+
+        if (StrCmp (Arg, L"first") == 0) {
+          Strategy = NicFirst;
+        } else if (StrCmp (Arg, L"race") == 0) {
+          Strategy = NicRace;
+        } else if (StrCmp (Arg, L"split") == 0) {
+          Strategy = NicSplit;
+        } else {
+          Print (L"Unknown NIC strategy: %s\n", Arg);
+          Status = EFI_INVALID_PARAMETER;
+          goto out_free_urls;
+        }
+      } else if (StrCmp (Arg, L"-o") == 0 && i + 1 < ShellParameters->Argc) {
+        Output = ShellParameters->Argv[++i];
+      } else if (StrCmp (Arg, L"-f") == 0 && i + 1 < ShellParameters->Argc) {
+        Status = UrlListLoad (&Urls, ShellParameters->Argv[++i]);
+        if (EFI_ERROR (Status)) {
+          Print (L"Reading URL list %s failed: %r\n", ShellParameters->Argv[i], Status);
+          goto out_free_urls;
+        }
+      } else {
+        Url = AllocateCopyPool (StrSize (Arg), Arg);
+        Status = Url == NULL ? EFI_OUT_OF_RESOURCES : UrlListAppend (&Urls, Url);
+        if (EFI_ERROR (Status))
+          goto out_free_urls;
+      }
+    }
+  }
+
+  if (Urls.Count == 0) {
+    Url = AllocateCopyPool (sizeof (DEFAULT_URL), DEFAULT_URL);
+    Status = Url == NULL ? EFI_OUT_OF_RESOURCES : UrlListAppend (&Urls, Url);
+    if (EFI_ERROR (Status))
+      goto out_free_urls;
+  }
+
+  // Racing jobs can only be aborted when nothing is pipelined behind them
+  if (Strategy == NicRace && Depth > 1) {
+    Print (L"Pipelining cannot be used along with -n race\n");
+    Status = EFI_INVALID_PARAMETER;
+    goto out_free_urls;
+  }
+
+  if ((NSegments != 0 || SegmentSize != 0) && (Strategy == NicRace || Repeat > 1 || Depth > 1)) {
+    Print (L"Segmented download cannot be used along with -n race, -r or -p\n");
+    Status = EFI_INVALID_PARAMETER;
+    goto out_free_urls;
+  }
+
+  if (Output != NULL && Repeat > 1) {
+    Print (L"Saving to a file cannot be used along with -r\n");
+    Status = EFI_INVALID_PARAMETER;
+    goto out_free_urls;
+  }
+
+  NDownloads = Urls.Count * Repeat;
+
+  // Locate all NICs (i.e. handles with the MNP Service Binding protocol)
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiManagedNetworkServiceBindingProtocolGuid,
+                  NULL,
+                  &NControllers,
+                  &Controllers
+                  );
+  if (EFI_ERROR (Status)) {
+    Print (L"LocateHandleBuffer for ManagedNetworkServiceBinding failed: %r\n", Status);
+    goto out_free_urls;
+  }
+
+  if (Strategy == NicFirst)
+    NControllers = 1;
+
+  // Need at least one child per NIC
+  NControllers = MIN (NControllers, FETCH_MAX_CHILDREN);
+
+  // No point in having more children than URLs on each NIC. Repeated downloads
+  // all go through the same child to measure connection reuse.
+  PerNic = Strategy == NicSplit ? (Urls.Count + NControllers - 1) / NControllers : Urls.Count;
+  PerNic = MIN (PerNic, MaxChildren);
+  if (Repeat > 1)
+    PerNic = 1;
+  if (NSegments != 0)
+    PerNic = NSegments;
+  else if (SegmentSize != 0)
+    PerNic = MaxChildren;
+
+  PerNic = MIN (PerNic, FETCH_MAX_CHILDREN / NControllers);
+  PerNic = MAX (PerNic, 1);
+
+  Nics = AllocateZeroPool (NControllers * sizeof (*Nics));
+  if (Nics == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_free_controllers;
+  }
+
+  Children = AllocateZeroPool (NControllers * PerNic * sizeof (*Children));
+  if (Children == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_free_nics;
+  }
+
+  Status = HttpWaitInit (&Wait, HTTP_WAIT_POLL_INTERVAL_MS);
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpWaitInit failed: %r\n", Status);
+    goto out_free_children;
+  }
+
+  // Create the children of each NIC. A NIC that cannot do HTTP (e.g. no link
+  // or no IP address) is skipped.
+  for (n = 0; n < NControllers; n++) {
+    Nic = &Nics[NNics];
+    Nic->Controller = Controllers[n];
+    Nic->Index      = n;
+    Nic->FirstChild = NChildren;
+    Nic->NChildren  = 0;
+    Nic->ChildMask  = 0;
+
+    for (i = 0; i < PerNic; i++) {
+      Status = FetchChildCreate (Controllers[n], NChildren, Depth, &Children[NChildren]);
+      if (EFI_ERROR (Status))
+        break;
+
+      Nic->ChildMask |= 1U << NChildren;
+      Nic->NChildren++;
+      NChildren++;
+    }
+
+    if (EFI_ERROR (Status)) {
+      Print (L"NIC %lu: FetchChildCreate failed: %r, skipping it\n", (UINT64)n, Status);
+      while (NChildren > Nic->FirstChild)
+        FetchChildDestroy (&Children[--NChildren]);
+      continue;
+    }
+
+    NNics++;
+  }
+
+  if (NNics == 0) {
+    Print (L"No usable NICs found\n");
+    goto out_destroy_children;
+  }
+
+  if (NSegments != 0 || SegmentSize != 0) {
+    if (Urls.Count > 1)
+      Print (L"Segmented download only uses the first URL\n");
+
+    Status = FetchSegmented (&Wait, Children, NChildren, Urls.Items[0], NSegments, SegmentSize, &Segmented);
+    if (EFI_ERROR (Status)) {
+      Print (L"FetchSegmented failed: %r\n", Status);
+      goto out_destroy_children;
+    }
+
+    if (Output != NULL) {
+      FETCH_FILE_SINK FileSink;
+
+      // The body is already all in memory, so this only overlaps disk writes
+      // with copying into the other buffer
+      FetchFileSinkInit (&FileSink, Output);
+      Status = FileSink.Sink.Write (&FileSink, NULL, 0, Segmented.Buffer, (UINTN)Segmented.Size);
+      Status = FetchFileSinkClose (&FileSink, !EFI_ERROR (Status));
+      if (EFI_ERROR (Status))
+        Print (L"Saving to %s failed: %r\n", Output, Status);
+      else
+        PrintFileSink (&Wait, &FileSink);
+    } else {
+      ConsoleWrite (&Console, NULL, 0, Segmented.Buffer, (UINTN)Segmented.Size);
+      ConsoleFinish (&Console, &Wait);
+    }
+
+    WallUs = HttpWaitTscToUs (&Wait, Segmented.EndTsc - Segmented.StartTsc);
+    Print (
+      L"\nDownloaded %lu bytes in %lu %a over %lu children in %lu ms (HEAD %lu ms): %lu bytes/s\n",
+      Segmented.Size,
+      (UINT64)Segmented.NSegments,
+      Segmented.Ranged ? "segments" : "stream (no Range support)",
+      (UINT64)NChildren,
+      DivU64x32 (WallUs, 1000),
+      DivU64x32 (HttpWaitTscToUs (&Wait, Segmented.HeadTsc - Segmented.StartTsc), 1000),
+      WallUs ? DivU64x64Remainder (MultU64x32 (Segmented.Size, 1000000), WallUs, NULL) : 0
+      );
+
+    if (Segmented.Buffer != NULL)
+      FreePages (Segmented.Buffer, Segmented.Pages);
+
+    goto out_destroy_children;
+  }
+
+  // When racing, each download gets one job per NIC, restricted to the
+  // children of that NIC. Otherwise jobs go to whichever child is idle, on any
+  // NIC.
+  JobsPerDownload = Strategy == NicRace ? NNics : 1;
+
+  Jobs = AllocateZeroPool (NDownloads * JobsPerDownload * sizeof (*Jobs));
+  if (Jobs == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_destroy_children;
+  }
+
+  // One file sink per download, shared by the jobs racing for it
+  if (Output != NULL) {
+    FileSinks = AllocateZeroPool (NDownloads * sizeof (*FileSinks));
+    if (FileSinks == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+      goto out_free_jobs;
+    }
+
+    if (NDownloads > 1) {
+      Status = FetchCreateDirectory (Output);
+      if (EFI_ERROR (Status)) {
+        Print (L"Creating directory %s failed: %r\n", Output, Status);
+        goto out_free_jobs;
+      }
+    }
+
+    for (i = 0; i < NDownloads; i++) {
+      if (NDownloads == 1)
+        StrCpyS (Path, FETCH_PATH_MAX, Output);
+      else
+        OutputPath (Output, Urls.Items[i], Path);
+
+      FetchFileSinkInit (&FileSinks[i], Path);
+    }
+  }
+
+  for (i = 0; i < NDownloads; i++) {
+    for (n = 0; n < JobsPerDownload; n++) {
+      Job = &Jobs[i * JobsPerDownload + n];
+      Job->Url    = Urls.Items[i / Repeat];
+      Job->Method = HttpMethodGet;
+
+      if (FileSinks != NULL)
+        Job->Sink = &FileSinks[i].Sink;
+      else if (NDownloads == 1)
+        Job->Sink = &ConsoleSink;
+
+      if (Strategy == NicRace) {
+        Job->ChildMask = Nics[n].ChildMask;
+        Job->Group     = i + 1;
+      }
+    }
+  }
+
+  StartTsc = AsmReadTsc ();
+
+  Status = FetchRun (&Wait, Children, NChildren, Jobs, NDownloads * JobsPerDownload);
+  if (EFI_ERROR (Status)) {
+    Print (L"FetchRun failed: %r\n", Status);
+    goto out_free_jobs;
+  }
+
+  WallUs = HttpWaitTscToUs (&Wait, AsmReadTsc () - StartTsc);
+
+  if (NDownloads == 1 && FileSinks == NULL)
+    ConsoleFinish (&Console, &Wait);
+
+  if (Repeat > 1)
+    PrintRepeatReport (&Wait, Jobs, Urls.Count, Repeat, JobsPerDownload);
+  else if (NDownloads > 1 || NNics > 1)
+    PrintReport (&Wait, Nics, NNics, Jobs, NDownloads, JobsPerDownload, WallUs);
+
+  for (i = 0; FileSinks != NULL && i < NDownloads; i++) {
+    Job = DownloadResult (&Jobs[i * JobsPerDownload], JobsPerDownload);
+    if (!EFI_ERROR (Job->Status))
+      PrintFileSink (&Wait, &FileSinks[i]);
+  }
+
+  // Report the first failure, if any
+  for (i = 0; i < NDownloads; i++) {
+    Job = DownloadResult (&Jobs[i * JobsPerDownload], JobsPerDownload);
+
+    if (EFI_ERROR (Job->Status)) {
+      if (NDownloads == 1 && NNics == 1)
+        Print (L"Download failed: %r\n", Job->Status);
+
+      Status = Job->Status;
+      break;
+    }
+  }
+
+out_free_jobs:
+  if (FileSinks != NULL) {
+    // Discard whatever was left half-written if FetchRun() bailed out
+    for (i = 0; i < NDownloads; i++)
+      FetchFileSinkClose (&FileSinks[i], FALSE);
+    FreePool (FileSinks);
+  }
+  FreePool (Jobs);
+out_destroy_children:
+  while (NChildren > 0)
+    FetchChildDestroy (&Children[--NChildren]);
+
+  HttpWaitFree (&Wait);
+out_free_children:
+  FreePool (Children);
+out_free_nics:
+  FreePool (Nics);
+out_free_controllers:
+  FreePool (Controllers);
+out_free_urls:
+  UrlListFree (&Urls);
+  return Status;
+}
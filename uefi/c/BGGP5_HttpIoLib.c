@@ -4,18 +4,32 @@
   Downloads and displays the contents of the file at https://binary.golf/5/5
   using the EDK II HttpIoLib library.
 
+  The body is streamed through a single fixed-size buffer, so files of any size
+  can be downloaded with constant memory usage. Both Content-Length and chunked
+  transfer encoding are supported. Throughput is reported at the end.
+
   Copyright (c) 2024, Marco Bonelli. All rights reserved.
   SPDX-License-Identifier: MIT
 
 **/
 
 #include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
 #include <Library/HttpIoLib.h>
+#include <Library/HttpLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiApplicationEntryPoint.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
 
+#include "ConWriter.h"
+#include "HttpBody.h"
+#include "HttpUtil.h"
+
+// Size of the only buffer used to receive the response body
+#define RECV_BUFFER_SIZE 0x10000
+
 // HttpIoCreateIo callback for debugging purposes
 //
 // EFI_STATUS
@@ -60,6 +74,15 @@ UefiMain (
   UINTN                 NControllers;
   HTTP_IO               HttpIo;
   HTTP_IO_RESPONSE_DATA ResponseData;
+  EFI_HTTP_HEADER       *Headers = NULL;
+  UINTN                 HeaderCount = 0;
+  HTTP_BODY             Body;
+  CON_WRITER            Console;
+  UINTN                 BodyLength;
+  UINTN                 Written = 0;
+  UINT64                TscHz;
+  UINT64                StartTsc;
+  UINT64                ElapsedTsc;
 
   HTTP_IO_CONFIG_DATA ConfigData = {
     .Config4.HttpVersion       = HttpVersion11,
@@ -116,6 +139,9 @@ UefiMain (
     goto out_free_controllers;
   }
 
+  TscHz    = HttpUtilTscFrequency ();
+  StartTsc = AsmReadTsc ();
+
   Status = HttpIoSendRequest (
               &HttpIo,
               &RequestData,
@@ -129,33 +155,81 @@ UefiMain (
     goto out_free_httpio;
   }
 
-  ResponseData.BodyLength = 0x1000;
-  ResponseData.Body = AllocatePool (ResponseData.BodyLength);
+  ResponseData.Body = AllocatePool (RECV_BUFFER_SIZE);
   if (ResponseData.Body == NULL) {
     Print (L"AllocatePool failed: %r\n", Status);
     Status = EFI_OUT_OF_RESOURCES;
     goto out_free_httpio;
   }
 
+  // Receive headers (and possibly the first part of the body)
+  ResponseData.BodyLength = RECV_BUFFER_SIZE;
   Status = HttpIoRecvResponse (&HttpIo, TRUE, &ResponseData);
   if (EFI_ERROR (Status)) {
     Print (L"HttpIoRecvResponse failed: %r\n", Status);
     goto out_free_response;
   }
 
+  // Subsequent HttpIoRecvResponse() calls overwrite these with NULL/0
+  Headers     = ResponseData.Headers;
+  HeaderCount = ResponseData.HeaderCount;
+
   // Pretty dumb but HTTP_STATUS_200_OK == 3... it's an enum, not the real HTTP
   // status code. LOL.
   if (ResponseData.Response.StatusCode != HTTP_STATUS_200_OK) {
     Print (L"Bad response status: %d\n", ResponseData.Response.StatusCode);
     Status = EFI_ABORTED;
-    goto out_free_response;
+    goto out_free_headers;
+  }
+
+  // The body is either chunked, has a Content-Length, or ends when the server
+  // closes the connection. HttpIoGetChunkedTransferContent() would collect the
+  // whole chunked body in a list of pool allocations, so de-chunk it on the fly
+  // instead to keep memory usage flat.
+  HttpBodyInit (&Body, HeaderCount, Headers, FALSE);
+  ConWriterInit (&Console, gST->ConOut);
+
+  // Keep receiving into the same buffer until the whole body is consumed
+  for (;;) {
+    BodyLength = HttpBodyFeed (&Body, ResponseData.Body, ResponseData.BodyLength);
+    ConWriterWrite (&Console, ResponseData.Body, BodyLength);
+    Written += BodyLength;
+
+    if (HttpBodyDone (&Body))
+      break;
+
+    ResponseData.BodyLength = RECV_BUFFER_SIZE;
+    Status = HttpIoRecvResponse (&HttpIo, FALSE, &ResponseData);
+    if (EFI_ERROR (Status)) {
+      // Server closing the connection is the only way to end a body that has
+      // neither Content-Length nor chunked encoding
+      if (Status == EFI_CONNECTION_FIN && HttpBodyEndsAtClose (&Body)) {
+        Status = EFI_SUCCESS;
+        break;
+      }
+
+      ConWriterFlush (&Console);
+      Print (L"HttpIoRecvResponse failed: %r\n", Status);
+      goto out_free_headers;
+    }
   }
 
-  // Print (L"Response length: %ld\n", ResponseData.BodyLength);
-  Print (L"%.*a", ResponseData.BodyLength, ResponseData.Body);
+  ConWriterFlush (&Console);
+  ElapsedTsc = AsmReadTsc () - StartTsc;
+
+  Print (
+    L"\nDownloaded %lu bytes (%lu on the wire) in %lu ms: %lu bytes/s\n",
+    (UINT64)Written,
+    Body.Received,
+    DivU64x64Remainder (MultU64x32 (ElapsedTsc, 1000), TscHz, NULL),
+    DivU64x64Remainder (MultU64x64 (Written, TscHz), ElapsedTsc, NULL)
+    );
 
   // Print (L"BGGP5 UefiMain: goodbye!\n");
 
+out_free_headers:
+  // The names and values of the fields were allocated too
+  HttpFreeHeaderFields (Headers, HeaderCount);
 out_free_response:
   FreePool (ResponseData.Body);
 out_free_httpio:
@@ -13,39 +13,13 @@
 #include <Library/UefiLib.h>
 #include <Library/UefiApplicationEntryPoint.h>
 #include <Library/UefiBootServicesTableLib.h>
-#include <Library/UefiRuntimeServicesTableLib.h>
 #include <Protocol/Http.h>
 #include <Protocol/ServiceBinding.h>
 
-#define REQUEST_WAIT_MAX  5
-#define RESPONSE_WAIT_MAX 5
-
-static BOOLEAN gRequestCallbackComplete = FALSE;
-static BOOLEAN gResponseCallbackComplete = FALSE;
-
-// Request callback to get notified when request has been sent
-VOID
-EFIAPI
-RequestCallback(
-  IN EFI_EVENT Event,
-  IN VOID *Context
-  )
-{
-  gRequestCallbackComplete = TRUE;
-}
-
-
-// Response callback to get notified when response has been received
-VOID
-EFIAPI
-ResponseCallback(
-  IN EFI_EVENT Event,
-  IN VOID *Context
-  )
-{
-  gResponseCallbackComplete = TRUE;
-}
+#include "HttpWait.h"
 
+#define REQUEST_TIMEOUT_MS  5000
+#define RESPONSE_TIMEOUT_MS 5000
 
 EFI_STATUS
 EFIAPI
@@ -60,7 +34,8 @@ UefiMain (
   UINTN                        NControllers;
   EFI_HTTP_PROTOCOL            *HttpProtocol;
   EFI_SERVICE_BINDING_PROTOCOL *HttpServiceBinding;
-  EFI_TIME                     Base, Cur;
+  HTTP_WAIT                    Wait;
+  HTTP_WAIT_STATS              RequestStats;
 
   EFI_HTTPv4_ACCESS_POINT Http4AccessPoint = {
     .UseDefaultAddress = TRUE
@@ -174,46 +149,37 @@ UefiMain (
     goto out_free_controllers;
   }
 
-  // Create request callback event to get notified when request is sent
+  // Timer events used to wait for the request/response tokens
+  Status = HttpWaitInit (&Wait, HTTP_WAIT_POLL_INTERVAL_MS);
+  if (EFI_ERROR (Status)) {
+    Print (L"HttpWaitInit failed: %r\n", Status);
+    goto out_free_controllers;
+  }
+
+  // Create request event to get notified when request is sent. No notify
+  // function: the event is only ever checked or waited on.
   Status = gBS->CreateEvent(
-                  EVT_NOTIFY_SIGNAL,
+                  0,
                   TPL_CALLBACK,
-                  RequestCallback,
+                  NULL,
                   NULL,
                   &RequestToken.Event
                   );
   if (EFI_ERROR (Status)) {
-    Print (L"CreateEvent for RequestCallback failed: %r\n", Status);
-    goto out_free_controllers;
+    Print (L"CreateEvent for request failed: %r\n", Status);
+    goto out_free_wait;
   }
 
   // Start the request
   Status = HttpProtocol->Request (HttpProtocol, &RequestToken);
   if (EFI_ERROR (Status)) {
     Print (L"HttpProtocol::Request failed: %r\n", Status);
-    goto out_free_controllers;
-  }
-
-  Status = gRT->GetTime(&Base, NULL);
-  if (EFI_ERROR (Status)) {
-    Print(L"GetTime 1 failed: %r\n", Status);
-    goto out_free_controllers;
+    goto out_free_wait;
   }
 
-  // Wait up to REQUEST_WAIT_MAX seconds for request to be sent...
-  for (UINTN Timer = 0; Timer < REQUEST_WAIT_MAX; ) {
-    HttpProtocol->Poll(HttpProtocol);
-
-    if (gRequestCallbackComplete)
-      break;
-
-    if (!EFI_ERROR (gRT->GetTime(&Cur, NULL)) && (Cur.Second != Base.Second)) {
-      Base = Cur;
-      ++Timer;
-    }
-  }
-
-  if (!gRequestCallbackComplete) {
+  // Wait up to REQUEST_TIMEOUT_MS milliseconds for request to be sent...
+  Status = HttpWaitToken (&Wait, HttpProtocol, RequestToken.Event, REQUEST_TIMEOUT_MS);
+  if (Status == EFI_TIMEOUT) {
     Print (L"Request not sent in time, canceling...\n");
 
     Status = HttpProtocol->Cancel (HttpProtocol, &RequestToken);
@@ -223,27 +189,32 @@ UefiMain (
       Print (L"Request canceled\n");
 
     Status = EFI_TIMEOUT;
-    goto out_free_controllers;
+    goto out_free_wait;
+  } else if (EFI_ERROR (Status)) {
+    Print (L"Waiting for request failed: %r\n", Status);
+    goto out_free_wait;
   }
 
+  RequestStats = Wait.Stats;
+
   // Allocate response buffer
   Status = gBS->AllocatePool (EfiBootServicesData, 0x1000, (VOID **)&ResponseMessage.Body);
   if (EFI_ERROR(Status)) {
     Print(L"AllocatePool for response body failed: %r\n", Status);
-    goto out_free_controllers;
+    goto out_free_wait;
   }
 
-  // Create response callback event to get notified when response is received
+  // Create response event to get notified when response is received
   Status = gBS->CreateEvent(
-                  EVT_NOTIFY_SIGNAL,
+                  0,
                   TPL_CALLBACK,
-                  ResponseCallback,
+                  NULL,
                   NULL,
                   &ResponseToken.Event
                   );
   if (EFI_ERROR (Status)) {
-    Print (L"CreateEvent for ResponseCallback failed: %r\n", Status);
-    goto out_free_controllers;
+    Print (L"CreateEvent for response failed: %r\n", Status);
+    goto out_free_response;
   }
 
   // Ask for response
@@ -253,26 +224,9 @@ UefiMain (
     goto out_free_response;
   }
 
-  Status = gRT->GetTime(&Base, NULL);
-  if (EFI_ERROR (Status)) {
-    Print(L"GetTime 2 failed: %r\n", Status);
-    goto out_free_response;
-  }
-
-  // Wait up to RESPONSE_WAIT_MAX seconds for response...
-  for (UINTN Timer = 0; Timer < RESPONSE_WAIT_MAX; ) {
-    HttpProtocol->Poll(HttpProtocol);
-
-    if (gResponseCallbackComplete)
-      break;
-
-    if (!EFI_ERROR (gRT->GetTime(&Cur, NULL)) && (Cur.Second != Base.Second)) {
-      Base = Cur;
-      ++Timer;
-    }
-  }
-
-  if (!gResponseCallbackComplete) {
+  // Wait up to RESPONSE_TIMEOUT_MS milliseconds for response...
+  Status = HttpWaitToken (&Wait, HttpProtocol, ResponseToken.Event, RESPONSE_TIMEOUT_MS);
+  if (Status == EFI_TIMEOUT) {
     Print (L"Response not received in time, canceling...\n");
 
     Status = HttpProtocol->Cancel (HttpProtocol, &ResponseToken);
@@ -283,12 +237,32 @@ UefiMain (
 
     Status = EFI_TIMEOUT;
     goto out_free_response;
+  } else if (EFI_ERROR (Status)) {
+    Print (L"Waiting for response failed: %r\n", Status);
+    goto out_free_response;
   }
 
   Print (L"%.*a", ResponseMessage.BodyLength, ResponseMessage.Body);
 
+  // Show what waiting cost: with a poll interval of 0 (busy-spinning) the
+  // number of polls is huge, otherwise it is roughly one per timer tick.
+  Print (
+    L"Request: %lu us, %lu polls, %lu wakeups\n",
+    RequestStats.ElapsedUs,
+    RequestStats.Polls,
+    RequestStats.Wakeups
+    );
+  Print (
+    L"Response: %lu us, %lu polls, %lu wakeups\n",
+    Wait.Stats.ElapsedUs,
+    Wait.Stats.Polls,
+    Wait.Stats.Wakeups
+    );
+
 out_free_response:
   gBS->FreePool (ResponseMessage.Body);
+out_free_wait:
+  HttpWaitFree (&Wait);
 out_free_controllers:
   if (Controllers != NULL)
     gBS->FreePool (Controllers);
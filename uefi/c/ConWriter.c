@@ -0,0 +1,125 @@
+/** @file
+  Batched ASCII output to EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+#include "ConWriter.h"
+
+// Use GCC/Clang generic vectors if available: widening 16 bytes at once with
+// __builtin_convertvector() compiles down to PUNPCKLBW/PUNPCKHBW with SSE2 (or
+// VPMOVZXBW with AVX2), and to plain scalar code if SIMD is disabled.
+#if defined (__has_builtin)
+#if __has_builtin (__builtin_convertvector)
+#define CON_WRITER_VECTORIZED
+#endif
+#endif
+
+#ifdef CON_WRITER_VECTORIZED
+typedef UINT8  ASCII_X16 __attribute__ ((vector_size (16), aligned (1), may_alias));
+typedef UINT16 WIDE_X16 __attribute__ ((vector_size (32), aligned (1), may_alias));
+#endif
+
+
+VOID
+AsciiWiden (
+  OUT CHAR16      *Dst,
+  IN  CONST CHAR8 *Src,
+  IN  UINTN       Length
+  )
+{
+  UINTN i = 0;
+
+ #ifdef CON_WRITER_VECTORIZED
+  for (; i + 16 <= Length; i += 16)
+    *(WIDE_X16 *)(Dst + i) = __builtin_convertvector (*(CONST ASCII_X16 *)(Src + i), WIDE_X16);
+ #else
+  UINT32 Word;
+
+  // Still 4 characters at a time: spread the bytes of a 32-bit word over the
+  // 16-bit lanes of a 64-bit word
+  for (; i + 4 <= Length; i += 4) {
+    Word = ReadUnaligned32 ((CONST UINT32 *)(Src + i));
+    WriteUnaligned64 (
+      (UINT64 *)(Dst + i),
+      (Word & 0xff) | ((UINT64)(Word & 0xff00) << 8) | ((UINT64)(Word & 0xff0000) << 16) | ((UINT64)(Word & 0xff000000) << 24)
+      );
+  }
+ #endif
+
+  for (; i < Length; i++)
+    Dst[i] = (UINT8)Src[i];
+}
+
+
+VOID
+ConWriterInit (
+  OUT CON_WRITER                      *Writer,
+  IN  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *ConOut
+  )
+{
+  Writer->ConOut = ConOut;
+  Writer->Used   = 0;
+  Writer->Calls  = 0;
+}
+
+
+EFI_STATUS
+ConWriterFlush (
+  IN OUT CON_WRITER *Writer
+  )
+{
+  EFI_STATUS Status = EFI_SUCCESS;
+  UINTN      Pos = 0;
+
+  Writer->Buffer[Writer->Used] = L'\0';
+
+  // OutputString() stops at the first NUL: skip over any NUL in the data like
+  // printing one character at a time would
+  while (Pos < Writer->Used) {
+    if (Writer->Buffer[Pos] != L'\0') {
+      Status = Writer->ConOut->OutputString (Writer->ConOut, Writer->Buffer + Pos);
+      Writer->Calls++;
+      if (EFI_ERROR (Status))
+        break;
+    }
+
+    Pos += StrLen (Writer->Buffer + Pos) + 1;
+  }
+
+  Writer->Used = 0;
+  return Status;
+}
+
+
+EFI_STATUS
+ConWriterWrite (
+  IN OUT CON_WRITER  *Writer,
+  IN     CONST CHAR8 *Data,
+  IN     UINTN       Length
+  )
+{
+  EFI_STATUS Status;
+  UINTN      N;
+
+  while (Length > 0) {
+    N = MIN (Length, CON_WRITER_BUFFER_CHARS - Writer->Used);
+    AsciiWiden (Writer->Buffer + Writer->Used, Data, N);
+    Writer->Used += N;
+    Data         += N;
+    Length       -= N;
+
+    if (Writer->Used == CON_WRITER_BUFFER_CHARS) {
+      Status = ConWriterFlush (Writer);
+      if (EFI_ERROR (Status))
+        return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
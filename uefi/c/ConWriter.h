@@ -0,0 +1,62 @@
+/** @file
+  Batched ASCII output to EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL.
+
+  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL.OutputString() takes UTF-16 strings, and the
+  cost of each call (going through the console splitter down to every console
+  device, e.g. the serial port) dominates when printing large bodies one
+  character at a time. Print() is not much better: it parses the format string
+  and converts the text again every time. Instead, widen ASCII data into a
+  reusable UTF-16 buffer in large blocks and flush it with a few large
+  OutputString() calls.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef CON_WRITER_H_
+#define CON_WRITER_H_
+
+#include <Uefi.h>
+
+// Size of the UTF-16 buffer in characters, i.e. max characters per
+// OutputString() call
+#define CON_WRITER_BUFFER_CHARS 2048
+
+typedef struct {
+  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *ConOut;
+  UINTN                           Used;
+  UINT64                          Calls;  // Number of OutputString() calls
+  CHAR16                          Buffer[CON_WRITER_BUFFER_CHARS + 1];
+} CON_WRITER;
+
+// Widen Length ASCII characters into UTF-16 (vectorized where the compiler
+// allows it)
+VOID
+AsciiWiden (
+  OUT CHAR16      *Dst,
+  IN  CONST CHAR8 *Src,
+  IN  UINTN       Length
+  );
+
+VOID
+ConWriterInit (
+  OUT CON_WRITER                      *Writer,
+  IN  EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *ConOut
+  );
+
+// Buffer ASCII data, flushing as needed
+EFI_STATUS
+ConWriterWrite (
+  IN OUT CON_WRITER  *Writer,
+  IN     CONST CHAR8 *Data,
+  IN     UINTN       Length
+  );
+
+// Output everything buffered so far
+EFI_STATUS
+ConWriterFlush (
+  IN OUT CON_WRITER *Writer
+  );
+
+#endif // CON_WRITER_H_
@@ -0,0 +1,264 @@
+/** @file
+  Concurrent download engine on top of raw EFI_HTTP_PROTOCOL children.
+
+  A FETCH_CHILD is one HTTP child instance (i.e. one connection) created
+  through EFI_HTTP_SERVICE_BINDING_PROTOCOL.CreateChild(). A FETCH_JOB is one
+  request to perform. FetchRun() hands jobs out to idle children and drives all
+  their Request/Response tokens from a single event-driven loop (see
+  HttpWait.h), so all the requests are in flight at the same time.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef FETCH_H_
+#define FETCH_H_
+
+#include <Uefi.h>
+#include <Protocol/Http.h>
+#include <Protocol/ServiceBinding.h>
+#include <Protocol/SimpleFileSystem.h>
+
+#include "HttpBody.h"
+#include "HttpWait.h"
+
+// Max number of HTTP children driven at once (each has one token in flight).
+// Must fit in FETCH_JOB.ChildMask.
+#define FETCH_MAX_CHILDREN 16
+
+// Max number of extra request headers per job (Host is always sent)
+#define FETCH_MAX_HEADERS 4
+
+// Max number of requests pipelined on a single child
+#define FETCH_MAX_PIPELINE 8
+
+// Size of the receive buffer of each child
+#define FETCH_BUFFER_SIZE 0x10000
+
+// Max size of the Host header value
+#define FETCH_HOST_MAX 256
+
+// Max size of the Content-Range header value kept, longer ones are cut
+#define FETCH_CONTENT_RANGE_MAX 80
+
+// Give up on all in-flight requests if none of them makes progress for this
+// long
+#define FETCH_IDLE_TIMEOUT_MS 10000
+
+typedef struct FETCH_JOB FETCH_JOB;
+
+// Where body data goes. Write() is called for every piece of body data as soon
+// as it is received, in order. Offset is relative to the start of the body.
+// Done(), if not NULL, is called once the job is over (successfully or not)
+// with Job->Status already set, and can turn a success into a failure.
+typedef struct {
+  EFI_STATUS (*Write)(
+    IN VOID       *Context,
+    IN FETCH_JOB  *Job,
+    IN UINT64     Offset,
+    IN CONST VOID *Data,
+    IN UINTN      Length
+    );
+  VOID *Context;
+  EFI_STATUS (*Done)(
+    IN VOID      *Context,
+    IN FETCH_JOB *Job
+    );
+} FETCH_SINK;
+
+// Jobs with the same nonzero Group race each other: the first one to get a
+// successful response status wins, and all the others are aborted (with
+// EFI_ABORTED) as soon as that happens, before any of them writes to its sink.
+// Groups cannot be used along with pipelining.
+struct FETCH_JOB {
+  // Filled by the caller
+  CHAR16               *Url;
+  EFI_HTTP_METHOD      Method;
+  EFI_HTTP_HEADER      Headers[FETCH_MAX_HEADERS - 1];
+  UINTN                HeaderCount;
+  FETCH_SINK           *Sink;       // NULL to discard the body
+  UINT32               ChildMask;   // Children (by index) allowed to run it, 0 for any
+  UINTN                Group;       // See above, 0 for none
+
+  // Filled by FetchRun()
+  EFI_STATUS           Status;
+  EFI_HTTP_STATUS_CODE StatusCode;
+  UINT64               ContentLength;  // MAX_UINT64 if unknown
+  CHAR8                ContentRange[FETCH_CONTENT_RANGE_MAX];  // "" if none
+  UINT64               Bytes;          // Body bytes received
+  UINTN                Child;          // Id of the child that performed the job
+  UINT64               StartTsc;
+  UINT64               HeadersTsc;
+  UINT64               EndTsc;
+};
+
+typedef enum {
+  FetchChildIdle,
+  FetchChildRequesting,  // Waiting for the Request token of the oldest request
+  FetchChildReceiving    // Response token in flight
+} FETCH_CHILD_STATE;
+
+// A request sent on a child, waiting for its response
+typedef struct {
+  FETCH_JOB             *Job;
+  CHAR8                 Host[FETCH_HOST_MAX];
+  EFI_HTTP_REQUEST_DATA RequestData;
+  EFI_HTTP_HEADER       Headers[FETCH_MAX_HEADERS];
+  EFI_HTTP_MESSAGE      Message;
+  EFI_HTTP_TOKEN        Token;
+} FETCH_REQUEST;
+
+typedef struct {
+  UINTN                        Id;
+  EFI_SERVICE_BINDING_PROTOCOL *ServiceBinding;
+  EFI_HANDLE                   Handle;
+  EFI_HTTP_PROTOCOL            *Http;
+  EFI_HTTPv4_ACCESS_POINT      AccessPoint;
+  EFI_HTTP_CONFIG_DATA         ConfigData;
+  UINTN                        Depth;  // Max requests in flight
+
+  // Requests in flight (a ring, oldest first). Only the oldest one is being
+  // responded to, the others are pipelined behind it.
+  FETCH_REQUEST                Requests[FETCH_MAX_PIPELINE];
+  UINTN                        Head;
+  UINTN                        NRequests;
+
+  // State of the oldest request
+  FETCH_CHILD_STATE            State;
+  EFI_HTTP_RESPONSE_DATA       ResponseData;
+  EFI_HTTP_MESSAGE             ResponseMessage;
+  EFI_HTTP_TOKEN               ResponseToken;
+  HTTP_BODY                    Body;
+  CHAR8                        *Buffer;
+} FETCH_CHILD;
+
+// Create and configure an HTTP child on the NIC identified by Controller (a
+// handle with the MNP service binding protocol), or on the first one found if
+// Controller is NULL. Depth is the max number of requests in flight on the
+// child: 1 means plain keep-alive (send the next request only after the
+// previous response is over), more means HTTP/1.1 pipelining.
+EFI_STATUS
+FetchChildCreate (
+  IN  EFI_HANDLE  Controller OPTIONAL,
+  IN  UINTN       Id,
+  IN  UINTN       Depth,
+  OUT FETCH_CHILD *Child
+  );
+
+// Abort anything in flight and destroy the child
+VOID
+FetchChildDestroy (
+  IN FETCH_CHILD *Child
+  );
+
+// Perform all the jobs using all the children concurrently. Per-job results are
+// stored in the jobs themselves. Jobs that no child is allowed to run are left
+// with Status == EFI_NOT_STARTED. Jobs run in order on each child, so running
+// jobs with the same host on a single child reuses the same connection.
+EFI_STATUS
+FetchRun (
+  IN     HTTP_WAIT   *Wait,
+  IN     FETCH_CHILD *Children,
+  IN     UINTN       NChildren,
+  IN OUT FETCH_JOB   *Jobs,
+  IN     UINTN       NJobs
+  );
+
+// Result of FetchSegmented()
+typedef struct {
+  VOID    *Buffer;    // AllocatePages() buffer holding the body, or NULL
+  UINTN   Pages;      // Size of Buffer in pages
+  UINT64  Size;       // Size of the body
+  UINTN   NSegments;  // Number of Range requests performed
+  BOOLEAN Ranged;     // FALSE if the body was downloaded as a single stream
+  UINT64  StartTsc;   // HEAD request start
+  UINT64  HeadTsc;    // HEAD request end
+  UINT64  EndTsc;
+} FETCH_SEGMENTED;
+
+// Download Url in segments: learn its size with a HEAD request, then fetch
+// the segments concurrently with Range requests over all the children, placing
+// each one directly in its final position in a single buffer. Segments are
+// SegmentSize bytes, or NSegments equal parts if SegmentSize is 0, and each must
+// come back as 206 with the Content-Range that was asked for. Falls back to a
+// single stream if the size is unknown or the server ignores Range (200). The
+// caller must free Result->Buffer with FreePages().
+EFI_STATUS
+FetchSegmented (
+  IN  HTTP_WAIT       *Wait,
+  IN  FETCH_CHILD     *Children,
+  IN  UINTN           NChildren,
+  IN  CHAR16          *Url,
+  IN  UINTN           NSegments,
+  IN  UINT64          SegmentSize,
+  OUT FETCH_SEGMENTED *Result
+  );
+
+// Read a whole file from the volume the app was loaded from. Any "FSn:" prefix
+// in Path is ignored. The returned data is NUL-terminated and must be freed
+// with FreePool().
+EFI_STATUS
+FetchReadFile (
+  IN  CONST CHAR16 *Path,
+  OUT CHAR8        **Data,
+  OUT UINTN        *Size
+  );
+
+// Size of each of the two buffers of a file sink
+#define FETCH_FILE_BUFFER_SIZE 0x40000
+
+// Max length of the path of a file sink
+#define FETCH_PATH_MAX 256
+
+// A sink that saves the body to a file on the volume the app was loaded from,
+// double-buffered: body data is copied into one buffer while the other one is
+// being written with EFI_FILE_PROTOCOL.WriteEx(), so that writing to disk
+// overlaps with receiving from the network. Falls back to blocking Write()
+// calls on file systems without asynchronous I/O. The file is created (or
+// truncated) on the first write, and deleted if the job fails. With racing
+// jobs, only the first one to write owns the file.
+typedef struct {
+  FETCH_SINK        Sink;
+  CHAR16            Path[FETCH_PATH_MAX];
+  FETCH_JOB         *Owner;
+  EFI_FILE_PROTOCOL *Root;
+  EFI_FILE_PROTOCOL *File;
+  CHAR8             *Buffers[2];
+  UINTN             Current;    // Buffer being filled
+  UINTN             Used;       // Bytes in the buffer being filled
+  EFI_FILE_IO_TOKEN Token;      // Write of the other buffer
+  BOOLEAN           Pending;    // Token in flight
+  BOOLEAN           Async;      // WriteEx() available
+
+  // Stats
+  UINT64            Bytes;      // Body bytes accepted
+  UINT64            Writes;     // Number of Write()/WriteEx() calls
+  UINT64            WriteTsc;   // Time spent inside Write()/WriteEx()
+  UINT64            WaitTsc;    // Time spent waiting for WriteEx() to complete
+} FETCH_FILE_SINK;
+
+// Initialize a file sink writing to Path. Nothing is opened until the first
+// write, so a sink can be prepared for each job up front.
+VOID
+FetchFileSinkInit (
+  OUT FETCH_FILE_SINK *FileSink,
+  IN  CONST CHAR16    *Path
+  );
+
+// Write out any buffered data and close the file, or delete it if Keep is
+// FALSE. Done() does this automatically for the owner job, this is for when
+// Sink.Write() is called directly rather than through FetchRun().
+EFI_STATUS
+FetchFileSinkClose (
+  IN FETCH_FILE_SINK *FileSink,
+  IN BOOLEAN         Keep
+  );
+
+// Create a directory (and not its parents) if it does not exist yet
+EFI_STATUS
+FetchCreateDirectory (
+  IN CONST CHAR16 *Path
+  );
+
+#endif // FETCH_H_
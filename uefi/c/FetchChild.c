@@ -0,0 +1,566 @@
+/** @file
+  Concurrent download engine on top of raw EFI_HTTP_PROTOCOL children.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/HttpLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "Fetch.h"
+#include "HttpUtil.h"
+
+
+EFI_STATUS
+FetchChildCreate (
+  IN  EFI_HANDLE  Controller OPTIONAL,
+  IN  UINTN       Id,
+  IN  UINTN       Depth,
+  OUT FETCH_CHILD *Child
+  )
+{
+  EFI_STATUS Status;
+  UINTN      i;
+
+  if (Depth == 0 || Depth > FETCH_MAX_PIPELINE)
+    return EFI_INVALID_PARAMETER;
+
+  ZeroMem (Child, sizeof (*Child));
+  Child->Id    = Id;
+  Child->Depth = Depth;
+
+  Child->AccessPoint.UseDefaultAddress   = TRUE;
+  Child->ConfigData.HttpVersion          = HttpVersion11;
+  Child->ConfigData.LocalAddressIsIPv6   = FALSE;
+  Child->ConfigData.AccessPoint.IPv4Node = &Child->AccessPoint;
+
+  // Locate HTTP Service Binding protocol, either on the given NIC or on the
+  // first one found
+  if (Controller == NULL) {
+    Status = gBS->LocateProtocol (
+                    &gEfiHttpServiceBindingProtocolGuid,
+                    NULL,
+                    (VOID **)&Child->ServiceBinding
+                    );
+  } else {
+    Status = gBS->OpenProtocol (
+                    Controller,
+                    &gEfiHttpServiceBindingProtocolGuid,
+                    (VOID **)&Child->ServiceBinding,
+                    gImageHandle,
+                    Controller,
+                    EFI_OPEN_PROTOCOL_GET_PROTOCOL
+                    );
+  }
+  if (EFI_ERROR (Status))
+    return Status;
+
+  Status = Child->ServiceBinding->CreateChild (Child->ServiceBinding, &Child->Handle);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  Status = gBS->HandleProtocol (Child->Handle, &gEfiHttpProtocolGuid, (VOID **)&Child->Http);
+  if (EFI_ERROR (Status))
+    goto out_destroy_child_handle;
+
+  Status = Child->Http->Configure (Child->Http, &Child->ConfigData);
+  if (EFI_ERROR (Status))
+    goto out_destroy_child_handle;
+
+  // No notify functions: token events are only ever checked or waited on
+  Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &Child->ResponseToken.Event);
+  if (EFI_ERROR (Status))
+    goto out_destroy_child_handle;
+
+  for (i = 0; i < Depth; i++) {
+    Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &Child->Requests[i].Token.Event);
+    if (EFI_ERROR (Status))
+      goto out_close_request_events;
+  }
+
+  Child->Buffer = AllocatePool (FETCH_BUFFER_SIZE);
+  if (Child->Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_close_request_events;
+  }
+
+  return EFI_SUCCESS;
+
+out_close_request_events:
+  while (i > 0)
+    gBS->CloseEvent (Child->Requests[--i].Token.Event);
+
+  gBS->CloseEvent (Child->ResponseToken.Event);
+out_destroy_child_handle:
+  Child->ServiceBinding->DestroyChild (Child->ServiceBinding, Child->Handle);
+  Child->Handle = NULL;
+  return Status;
+}
+
+
+VOID
+FetchChildDestroy (
+  IN FETCH_CHILD *Child
+  )
+{
+  if (Child->Handle == NULL)
+    return;
+
+  Child->Http->Cancel (Child->Http, NULL);
+  Child->Http->Configure (Child->Http, NULL);
+
+  for (UINTN i = 0; i < Child->Depth; i++)
+    gBS->CloseEvent (Child->Requests[i].Token.Event);
+
+  gBS->CloseEvent (Child->ResponseToken.Event);
+  FreePool (Child->Buffer);
+
+  Child->ServiceBinding->DestroyChild (Child->ServiceBinding, Child->Handle);
+  Child->Handle = NULL;
+}
+
+
+// Get rid of anything in flight and reset the connection. Needed after an
+// error, since the child may be left with half a response pending.
+STATIC
+VOID
+FetchChildReset (
+  IN FETCH_CHILD *Child
+  )
+{
+  Child->Http->Cancel (Child->Http, NULL);
+  Child->Http->Configure (Child->Http, NULL);
+  Child->Http->Configure (Child->Http, &Child->ConfigData);
+
+  // Consume stale signals from canceled tokens
+  for (UINTN i = 0; i < Child->Depth; i++)
+    gBS->CheckEvent (Child->Requests[i].Token.Event);
+
+  gBS->CheckEvent (Child->ResponseToken.Event);
+}
+
+
+// Job of the oldest request in flight
+STATIC
+FETCH_JOB *
+FetchChildJob (
+  IN FETCH_CHILD *Child
+  )
+{
+  return Child->NRequests > 0 ? Child->Requests[Child->Head].Job : NULL;
+}
+
+
+// Finish the job of the oldest request. On error, the connection is reset, so
+// any job pipelined behind it goes back to the queue to be started again.
+STATIC
+VOID
+FetchChildFinish (
+  IN FETCH_CHILD *Child,
+  IN EFI_STATUS  Status
+  )
+{
+  FETCH_JOB  *Job = FetchChildJob (Child);
+  EFI_STATUS DoneStatus;
+
+  Job->Status = Status;
+  Job->EndTsc = AsmReadTsc ();
+
+  if (Job->Sink != NULL && Job->Sink->Done != NULL) {
+    DoneStatus = Job->Sink->Done (Job->Sink->Context, Job);
+    if (!EFI_ERROR (Job->Status) && EFI_ERROR (DoneStatus))
+      Job->Status = DoneStatus;
+  }
+
+  Child->Head = (Child->Head + 1) % FETCH_MAX_PIPELINE;
+  Child->NRequests--;
+
+  if (EFI_ERROR (Status)) {
+    FetchChildReset (Child);
+
+    for (; Child->NRequests > 0; Child->NRequests--) {
+      Child->Requests[Child->Head].Job->Status = EFI_NOT_STARTED;
+      Child->Head = (Child->Head + 1) % FETCH_MAX_PIPELINE;
+    }
+  }
+
+  Child->State = Child->NRequests > 0 ? FetchChildRequesting : FetchChildIdle;
+}
+
+
+// Queue a Response token. The first one also receives status and headers.
+STATIC
+EFI_STATUS
+FetchChildReceive (
+  IN FETCH_CHILD *Child,
+  IN BOOLEAN     WithHeaders
+  )
+{
+  EFI_STATUS Status;
+
+  Child->ResponseData.StatusCode       = HTTP_STATUS_UNSUPPORTED_STATUS;
+  Child->ResponseMessage.Data.Response = WithHeaders ? &Child->ResponseData : NULL;
+  Child->ResponseMessage.HeaderCount   = 0;
+  Child->ResponseMessage.Headers       = NULL;
+  Child->ResponseMessage.BodyLength    = FETCH_BUFFER_SIZE;
+  Child->ResponseMessage.Body          = Child->Buffer;
+  Child->ResponseToken.Status          = EFI_SUCCESS;
+  Child->ResponseToken.Message         = &Child->ResponseMessage;
+
+  Status = Child->Http->Response (Child->Http, &Child->ResponseToken);
+  if (!EFI_ERROR (Status))
+    Child->State = FetchChildReceiving;
+
+  return Status;
+}
+
+
+// Send the request for a job, behind any other request already in flight
+STATIC
+EFI_STATUS
+FetchChildSend (
+  IN FETCH_CHILD *Child,
+  IN FETCH_JOB   *Job
+  )
+{
+  FETCH_REQUEST *Request;
+  EFI_STATUS    Status;
+  UINTN         i;
+
+  Request = &Child->Requests[(Child->Head + Child->NRequests) % FETCH_MAX_PIPELINE];
+
+  Job->Child           = Child->Id;
+  Job->Status          = EFI_NOT_READY;
+  Job->StatusCode      = HTTP_STATUS_UNSUPPORTED_STATUS;
+  Job->ContentLength   = MAX_UINT64;
+  Job->ContentRange[0] = '\0';
+  Job->Bytes           = 0;
+  Job->StartTsc        = AsmReadTsc ();
+  Job->HeadersTsc      = 0;
+  Job->EndTsc          = 0;
+
+  Status = HttpUtilUrlHost (Job->Url, Request->Host, sizeof (Request->Host));
+  if (EFI_ERROR (Status))
+    goto out_fail;
+
+  Request->Headers[0].FieldName  = "Host";
+  Request->Headers[0].FieldValue = Request->Host;
+
+  for (i = 0; i < Job->HeaderCount && i < FETCH_MAX_HEADERS - 1; i++)
+    Request->Headers[i + 1] = Job->Headers[i];
+
+  Request->Job                  = Job;
+  Request->RequestData.Method   = Job->Method;
+  Request->RequestData.Url      = Job->Url;
+  Request->Message.Data.Request = &Request->RequestData;
+  Request->Message.HeaderCount  = i + 1;
+  Request->Message.Headers      = Request->Headers;
+  Request->Message.BodyLength   = 0;
+  Request->Message.Body         = NULL;
+  Request->Token.Status         = EFI_SUCCESS;
+  Request->Token.Message        = &Request->Message;
+
+  Status = Child->Http->Request (Child->Http, &Request->Token);
+  if (EFI_ERROR (Status))
+    goto out_fail;
+
+  if (Child->NRequests++ == 0)
+    Child->State = FetchChildRequesting;
+
+  return EFI_SUCCESS;
+
+out_fail:
+  Job->Status = Status;
+  Job->EndTsc = AsmReadTsc ();
+
+  // Don't break requests already in flight, but make sure an idle child is
+  // left in a clean state
+  if (Child->NRequests == 0)
+    FetchChildReset (Child);
+
+  return Status;
+}
+
+
+// Handle completion of the token in flight for the oldest request. Returns TRUE
+// if its job is over.
+STATIC
+BOOLEAN
+FetchChildProgress (
+  IN FETCH_CHILD *Child
+  )
+{
+  FETCH_REQUEST   *Request = &Child->Requests[Child->Head];
+  FETCH_JOB       *Job = Request->Job;
+  EFI_STATUS      Status;
+  UINTN           Length;
+  EFI_HTTP_HEADER *Header;
+
+  if (Child->State == FetchChildRequesting) {
+    Status = Request->Token.Status;
+    if (!EFI_ERROR (Status))
+      Status = FetchChildReceive (Child, TRUE);
+
+    if (EFI_ERROR (Status)) {
+      FetchChildFinish (Child, Status);
+      return TRUE;
+    }
+
+    return FALSE;
+  }
+
+  Status = Child->ResponseToken.Status;
+  if (EFI_ERROR (Status)) {
+    // Server closing the connection is the only way to end a body that has
+    // neither Content-Length nor chunked encoding
+    if (Status == EFI_CONNECTION_FIN && Job->HeadersTsc != 0 && HttpBodyEndsAtClose (&Child->Body))
+      Status = EFI_SUCCESS;
+
+    FetchChildFinish (Child, Status);
+    return TRUE;
+  }
+
+  if (Child->ResponseMessage.Data.Response != NULL) {
+    Job->HeadersTsc = AsmReadTsc ();
+    Job->StatusCode = Child->ResponseData.StatusCode;
+
+    HttpBodyInit (
+      &Child->Body,
+      Child->ResponseMessage.HeaderCount,
+      Child->ResponseMessage.Headers,
+      FALSE
+      );
+
+    // For HEAD this is the size of the body a GET would get, but there is no
+    // body to receive
+    Job->ContentLength = Child->Body.ContentLength;
+
+    Header = HttpBodyFindHeader (
+               Child->ResponseMessage.HeaderCount,
+               Child->ResponseMessage.Headers,
+               "Content-Range"
+               );
+
+    if (Header != NULL && Header->FieldValue != NULL)
+      AsciiStrnCpyS (
+        Job->ContentRange,
+        sizeof (Job->ContentRange),
+        Header->FieldValue,
+        sizeof (Job->ContentRange) - 1
+        );
+
+    if (Job->Method == HttpMethodHead)
+      HttpBodyInit (&Child->Body, 0, NULL, TRUE);
+
+    // The names and values of the fields were allocated too
+    HttpFreeHeaderFields (Child->ResponseMessage.Headers, Child->ResponseMessage.HeaderCount);
+
+    // Again, these are enum values, not real HTTP status codes
+    if (Job->StatusCode != HTTP_STATUS_200_OK && Job->StatusCode != HTTP_STATUS_206_PARTIAL_CONTENT) {
+      FetchChildFinish (Child, EFI_HTTP_ERROR);
+      return TRUE;
+    }
+  }
+
+  Length = HttpBodyFeed (&Child->Body, Child->Buffer, Child->ResponseMessage.BodyLength);
+
+  if (Length > 0 && Job->Sink != NULL) {
+    Status = Job->Sink->Write (Job->Sink->Context, Job, Job->Bytes, Child->Buffer, Length);
+    if (EFI_ERROR (Status)) {
+      FetchChildFinish (Child, Status);
+      return TRUE;
+    }
+  }
+
+  Job->Bytes += Length;
+
+  if (HttpBodyDone (&Child->Body)) {
+    FetchChildFinish (Child, EFI_SUCCESS);
+    return TRUE;
+  }
+
+  Status = FetchChildReceive (Child, FALSE);
+  if (EFI_ERROR (Status)) {
+    FetchChildFinish (Child, Status);
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+// Find the next job that has not been started yet and that the child at index
+// ChildIndex is allowed to run
+STATIC
+FETCH_JOB *
+FetchNextJob (
+  IN FETCH_JOB *Jobs,
+  IN UINTN     NJobs,
+  IN UINTN     ChildIndex
+  )
+{
+  for (UINTN i = 0; i < NJobs; i++) {
+    if (Jobs[i].Status != EFI_NOT_STARTED)
+      continue;
+
+    if (Jobs[i].ChildMask == 0 || (Jobs[i].ChildMask & (1U << ChildIndex)) != 0)
+      return &Jobs[i];
+  }
+
+  return NULL;
+}
+
+
+// Winner of a race got a successful response status: abort all the other jobs
+// of its group. Returns the number of jobs aborted. Without pipelining, the
+// only job in flight on a child is the oldest one.
+STATIC
+UINTN
+FetchAbortGroup (
+  IN FETCH_CHILD *Children,
+  IN UINTN       NChildren,
+  IN FETCH_JOB   *Jobs,
+  IN UINTN       NJobs,
+  IN FETCH_JOB   *Winner
+  )
+{
+  FETCH_JOB *Job;
+  UINTN     Aborted = 0;
+  UINTN     i;
+
+  for (i = 0; i < NJobs; i++) {
+    if (&Jobs[i] == Winner || Jobs[i].Group != Winner->Group)
+      continue;
+
+    if (Jobs[i].Status == EFI_NOT_STARTED) {
+      Jobs[i].Status = EFI_ABORTED;
+      Aborted++;
+    }
+  }
+
+  for (i = 0; i < NChildren; i++) {
+    Job = FetchChildJob (&Children[i]);
+
+    if (Job != NULL && Job != Winner && Job->Group == Winner->Group) {
+      FetchChildFinish (&Children[i], EFI_ABORTED);
+      Aborted++;
+    }
+  }
+
+  return Aborted;
+}
+
+
+EFI_STATUS
+FetchRun (
+  IN     HTTP_WAIT   *Wait,
+  IN     FETCH_CHILD *Children,
+  IN     UINTN       NChildren,
+  IN OUT FETCH_JOB   *Jobs,
+  IN     UINTN       NJobs
+  )
+{
+  EFI_HTTP_PROTOCOL *Http[FETCH_MAX_CHILDREN];
+  EFI_EVENT         Events[FETCH_MAX_CHILDREN];
+  FETCH_CHILD       *Owners[FETCH_MAX_CHILDREN];
+  FETCH_CHILD       *Child;
+  FETCH_JOB         *Job;
+  EFI_STATUS        Status;
+  UINTN             Pending = NJobs;
+  UINTN             NEvents;
+  UINTN             Index;
+  UINTN             i;
+  BOOLEAN           Pipelined = FALSE;
+  BOOLEAN           Grouped = FALSE;
+
+  if (NChildren == 0 || NChildren > FETCH_MAX_CHILDREN)
+    return EFI_INVALID_PARAMETER;
+
+  for (i = 0; i < NChildren; i++) {
+    Http[i]    = Children[i].Http;
+    Pipelined |= Children[i].Depth > 1;
+  }
+
+  for (i = 0; i < NJobs; i++) {
+    Jobs[i].Status = EFI_NOT_STARTED;
+    Grouped       |= Jobs[i].Group != 0;
+  }
+
+  if (Pipelined && Grouped)
+    return EFI_UNSUPPORTED;
+
+  Status = HttpWaitStart (Wait, FETCH_IDLE_TIMEOUT_MS);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  while (Pending > 0) {
+    // Hand out jobs to children with room for more requests. A job failing
+    // right away is over, so just move on to the next one.
+    for (i = 0; i < NChildren; i++) {
+      while (Children[i].NRequests < Children[i].Depth) {
+        Job = FetchNextJob (Jobs, NJobs, i);
+        if (Job == NULL)
+          break;
+
+        if (EFI_ERROR (FetchChildSend (&Children[i], Job)))
+          Pending--;
+      }
+    }
+
+    // Collect the tokens in flight, one per child: the Request token of the
+    // oldest request until it completes, then its Response token. Requests
+    // pipelined behind it are driven by Poll() all the same.
+    NEvents = 0;
+
+    for (i = 0; i < NChildren; i++) {
+      Child = &Children[i];
+      if (Child->State == FetchChildIdle)
+        continue;
+
+      Owners[NEvents] = Child;
+      Events[NEvents] = Child->State == FetchChildRequesting
+                        ? Child->Requests[Child->Head].Token.Event
+                        : Child->ResponseToken.Event;
+      NEvents++;
+    }
+
+    // Jobs left (if any) cannot be run by any child
+    if (NEvents == 0)
+      break;
+
+    Status = HttpWaitAny (Wait, Http, NChildren, Events, NEvents, &Index);
+    if (EFI_ERROR (Status)) {
+      // Nothing moved for too long (or waiting itself failed), give up on
+      // the oldest request of every child. Requests pipelined behind them are
+      // put back in the queue and get another chance.
+      for (i = 0; i < NEvents; i++) {
+        FetchChildFinish (Owners[i], Status);
+        Pending--;
+      }
+
+      if (Status != EFI_TIMEOUT)
+        return Status;
+    } else {
+      Job = FetchChildJob (Owners[Index]);
+      if (FetchChildProgress (Owners[Index]))
+        Pending--;
+
+      // Job->Status is still EFI_NOT_READY if the job is not over yet
+      if (Job->Group != 0 && Job->HeadersTsc != 0 && (Job->Status == EFI_NOT_READY || Job->Status == EFI_SUCCESS))
+        Pending -= FetchAbortGroup (Children, NChildren, Jobs, NJobs, Job);
+    }
+
+    // Any progress resets the idle timeout
+    Status = HttpWaitStart (Wait, FETCH_IDLE_TIMEOUT_MS);
+    if (EFI_ERROR (Status))
+      return Status;
+  }
+
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,416 @@
+/** @file
+  File helpers for the download engine.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/LoadedImage.h>
+#include <Protocol/SimpleFileSystem.h>
+
+#include "Fetch.h"
+
+
+// Open the root directory of the volume the app was loaded from (FS0 when run
+// from the startup script)
+STATIC
+EFI_STATUS
+FetchOpenRoot (
+  OUT EFI_FILE_PROTOCOL **Root
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_LOADED_IMAGE_PROTOCOL       *LoadedImage;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *Fs;
+
+  Status = gBS->HandleProtocol (gImageHandle, &gEfiLoadedImageProtocolGuid, (VOID **)&LoadedImage);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  Status = gBS->HandleProtocol (LoadedImage->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (VOID **)&Fs);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  return Fs->OpenVolume (Fs, Root);
+}
+
+
+// Skip the "FSn:" mapping prefix of a shell path, if any
+STATIC
+CONST CHAR16 *
+FetchSkipMapping (
+  IN CONST CHAR16 *Path
+  )
+{
+  UINTN i;
+
+  for (i = 0; Path[i] != L'\0' && Path[i] != L'\\' && Path[i] != L'/'; i++) {
+    if (Path[i] == L':')
+      return Path + i + 1;
+  }
+
+  return Path;
+}
+
+
+EFI_STATUS
+FetchReadFile (
+  IN  CONST CHAR16 *Path,
+  OUT CHAR8        **Data,
+  OUT UINTN        *Size
+  )
+{
+  EFI_STATUS        Status;
+  EFI_FILE_PROTOCOL *Root;
+  EFI_FILE_PROTOCOL *File;
+  UINT64            FileSize;
+  UINTN             ReadSize;
+  CHAR8             *Buffer;
+
+  Status = FetchOpenRoot (&Root);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  Status = Root->Open (Root, &File, (CHAR16 *)FetchSkipMapping (Path), EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR (Status))
+    goto out_close_root;
+
+  // Seeking to MAX_UINT64 moves to the end of the file, simpler than going
+  // through GetInfo() and EFI_FILE_INFO
+  Status = File->SetPosition (File, MAX_UINT64);
+  if (EFI_ERROR (Status))
+    goto out_close_file;
+
+  Status = File->GetPosition (File, &FileSize);
+  if (EFI_ERROR (Status))
+    goto out_close_file;
+
+  Status = File->SetPosition (File, 0);
+  if (EFI_ERROR (Status))
+    goto out_close_file;
+
+  if (FileSize >= MAX_UINTN) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_close_file;
+  }
+
+  Buffer = AllocatePool ((UINTN)FileSize + 1);
+  if (Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_close_file;
+  }
+
+  ReadSize = (UINTN)FileSize;
+  Status   = File->Read (File, &ReadSize, Buffer);
+  if (EFI_ERROR (Status)) {
+    FreePool (Buffer);
+    goto out_close_file;
+  }
+
+  Buffer[ReadSize] = '\0';
+  *Data = Buffer;
+  *Size = ReadSize;
+
+out_close_file:
+  File->Close (File);
+out_close_root:
+  Root->Close (Root);
+  return Status;
+}
+
+
+EFI_STATUS
+FetchCreateDirectory (
+  IN CONST CHAR16 *Path
+  )
+{
+  EFI_STATUS        Status;
+  EFI_FILE_PROTOCOL *Root;
+  EFI_FILE_PROTOCOL *Dir;
+
+  Status = FetchOpenRoot (&Root);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  Status = Root->Open (Root, &Dir, (CHAR16 *)FetchSkipMapping (Path),
+                       EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                       EFI_FILE_DIRECTORY);
+  if (!EFI_ERROR (Status))
+    Dir->Close (Dir);
+
+  Root->Close (Root);
+  return Status;
+}
+
+
+// Wait for the write of the other buffer to complete, if any
+STATIC
+EFI_STATUS
+FetchFileSinkWait (
+  IN FETCH_FILE_SINK *FileSink
+  )
+{
+  UINT64 Start;
+  UINTN  Index;
+
+  if (!FileSink->Pending)
+    return EFI_SUCCESS;
+
+  Start = AsmReadTsc ();
+  gBS->WaitForEvent (1, &FileSink->Token.Event, &Index);
+  FileSink->WaitTsc += AsmReadTsc () - Start;
+  FileSink->Pending = FALSE;
+
+  return FileSink->Token.Status;
+}
+
+
+// Start writing out the buffer being filled and switch to the other one, which
+// is only reused once its own write is complete
+STATIC
+EFI_STATUS
+FetchFileSinkSubmit (
+  IN FETCH_FILE_SINK *FileSink
+  )
+{
+  EFI_STATUS Status;
+  CHAR8      *Buffer = FileSink->Buffers[FileSink->Current];
+  UINTN      Size;
+  UINT64     Start;
+
+  Status = FetchFileSinkWait (FileSink);
+  if (EFI_ERROR (Status) || FileSink->Used == 0)
+    return Status;
+
+  Start = AsmReadTsc ();
+  FileSink->Writes++;
+
+  if (FileSink->Async) {
+    FileSink->Token.Status     = EFI_SUCCESS;
+    FileSink->Token.BufferSize = FileSink->Used;
+    FileSink->Token.Buffer     = Buffer;
+
+    Status = FileSink->File->WriteEx (FileSink->File, &FileSink->Token);
+    if (!EFI_ERROR (Status))
+      FileSink->Pending = TRUE;
+    else if (Status == EFI_UNSUPPORTED)
+      FileSink->Async = FALSE;
+  }
+
+  if (!FileSink->Async) {
+    Size   = FileSink->Used;
+    Status = FileSink->File->Write (FileSink->File, &Size, Buffer);
+    if (!EFI_ERROR (Status) && Size != FileSink->Used)
+      Status = EFI_VOLUME_FULL;
+  }
+
+  FileSink->WriteTsc += AsmReadTsc () - Start;
+  FileSink->Current  ^= 1;
+  FileSink->Used      = 0;
+  return Status;
+}
+
+
+STATIC
+EFI_STATUS
+FetchFileSinkOpen (
+  IN FETCH_FILE_SINK *FileSink
+  )
+{
+  EFI_STATUS        Status;
+  EFI_FILE_PROTOCOL *File;
+  CHAR16            *Path = (CHAR16 *)FetchSkipMapping (FileSink->Path);
+
+  Status = FetchOpenRoot (&FileSink->Root);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  // Start from an empty file. Delete() also closes the handle.
+  Status = FileSink->Root->Open (FileSink->Root, &File, Path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+  if (!EFI_ERROR (Status))
+    File->Delete (File);
+
+  Status = FileSink->Root->Open (FileSink->Root, &FileSink->File, Path,
+                                 EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+  if (EFI_ERROR (Status))
+    goto out_close_root;
+
+  FileSink->Buffers[0] = AllocatePool (FETCH_FILE_BUFFER_SIZE);
+  FileSink->Buffers[1] = AllocatePool (FETCH_FILE_BUFFER_SIZE);
+  if (FileSink->Buffers[0] == NULL || FileSink->Buffers[1] == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_free_buffers;
+  }
+
+  FileSink->Async = FileSink->File->Revision >= EFI_FILE_PROTOCOL_REVISION2;
+  if (FileSink->Async) {
+    Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &FileSink->Token.Event);
+    if (EFI_ERROR (Status))
+      goto out_free_buffers;
+  }
+
+  FileSink->Current = 0;
+  FileSink->Used    = 0;
+  FileSink->Pending = FALSE;
+  return EFI_SUCCESS;
+
+out_free_buffers:
+  if (FileSink->Buffers[0] != NULL)
+    FreePool (FileSink->Buffers[0]);
+  if (FileSink->Buffers[1] != NULL)
+    FreePool (FileSink->Buffers[1]);
+  FileSink->Buffers[0] = FileSink->Buffers[1] = NULL;
+  FileSink->File->Delete (FileSink->File);
+  FileSink->File = NULL;
+out_close_root:
+  FileSink->Root->Close (FileSink->Root);
+  FileSink->Root = NULL;
+  return Status;
+}
+
+
+STATIC
+EFI_STATUS
+FetchFileSinkWrite (
+  IN VOID       *Context,
+  IN FETCH_JOB  *Job,
+  IN UINT64     Offset,
+  IN CONST VOID *Data,
+  IN UINTN      Length
+  )
+{
+  FETCH_FILE_SINK *FileSink = Context;
+  CONST CHAR8     *Src      = Data;
+  EFI_STATUS      Status;
+  UINTN           Chunk;
+
+  if (FileSink->Owner == NULL && FileSink->File == NULL) {
+    Status = FetchFileSinkOpen (FileSink);
+    if (EFI_ERROR (Status))
+      return Status;
+
+    FileSink->Owner = Job;
+  }
+
+  if (Job != FileSink->Owner || FileSink->File == NULL)
+    return EFI_ACCESS_DENIED;
+
+  // Writes are appended, the file position is never moved
+  if (Offset != FileSink->Bytes)
+    return EFI_INVALID_PARAMETER;
+
+  while (Length > 0) {
+    Chunk = MIN (Length, FETCH_FILE_BUFFER_SIZE - FileSink->Used);
+    CopyMem (FileSink->Buffers[FileSink->Current] + FileSink->Used, Src, Chunk);
+
+    FileSink->Used  += Chunk;
+    FileSink->Bytes += Chunk;
+    Src             += Chunk;
+    Length          -= Chunk;
+
+    if (FileSink->Used == FETCH_FILE_BUFFER_SIZE) {
+      Status = FetchFileSinkSubmit (FileSink);
+      if (EFI_ERROR (Status))
+        return Status;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+
+EFI_STATUS
+FetchFileSinkClose (
+  IN FETCH_FILE_SINK *FileSink,
+  IN BOOLEAN         Keep
+  )
+{
+  EFI_STATUS Status = EFI_SUCCESS;
+
+  if (FileSink->File == NULL)
+    return EFI_SUCCESS;
+
+  if (Keep) {
+    Status = FetchFileSinkSubmit (FileSink);
+    if (!EFI_ERROR (Status))
+      Status = FetchFileSinkWait (FileSink);
+    if (!EFI_ERROR (Status))
+      Status = FileSink->File->Flush (FileSink->File);
+  }
+
+  // Never free a buffer that is still being written
+  FetchFileSinkWait (FileSink);
+
+  if (Keep && !EFI_ERROR (Status))
+    FileSink->File->Close (FileSink->File);
+  else
+    FileSink->File->Delete (FileSink->File);
+
+  if (FileSink->Token.Event != NULL) {
+    gBS->CloseEvent (FileSink->Token.Event);
+    FileSink->Token.Event = NULL;
+  }
+
+  FreePool (FileSink->Buffers[0]);
+  FreePool (FileSink->Buffers[1]);
+  FileSink->Buffers[0] = FileSink->Buffers[1] = NULL;
+  FileSink->Root->Close (FileSink->Root);
+  FileSink->Root = NULL;
+  FileSink->File = NULL;
+  return Status;
+}
+
+
+STATIC
+EFI_STATUS
+FetchFileSinkDone (
+  IN VOID      *Context,
+  IN FETCH_JOB *Job
+  )
+{
+  FETCH_FILE_SINK *FileSink = Context;
+  EFI_STATUS      Status;
+
+  // Somebody else won the race
+  if (FileSink->Owner != NULL && FileSink->Owner != Job)
+    return EFI_SUCCESS;
+
+  if (EFI_ERROR (Job->Status)) {
+    if (FileSink->Owner == NULL)
+      return EFI_SUCCESS;
+
+    return FetchFileSinkClose (FileSink, FALSE);
+  }
+
+  // Empty body, nothing was written but the file must still exist
+  if (FileSink->Owner == NULL) {
+    Status = FetchFileSinkOpen (FileSink);
+    if (EFI_ERROR (Status))
+      return Status;
+
+    FileSink->Owner = Job;
+  }
+
+  return FetchFileSinkClose (FileSink, TRUE);
+}
+
+
+VOID
+FetchFileSinkInit (
+  OUT FETCH_FILE_SINK *FileSink,
+  IN  CONST CHAR16    *Path
+  )
+{
+  ZeroMem (FileSink, sizeof (*FileSink));
+  StrCpyS (FileSink->Path, FETCH_PATH_MAX, Path);
+
+  FileSink->Sink.Write   = FetchFileSinkWrite;
+  FileSink->Sink.Done    = FetchFileSinkDone;
+  FileSink->Sink.Context = FileSink;
+}
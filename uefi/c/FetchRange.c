@@ -0,0 +1,281 @@
+/** @file
+  Segmented download with HTTP Range requests.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+
+#include "Fetch.h"
+
+typedef struct {
+  FETCH_SINK      Sink;
+  FETCH_SEGMENTED *Result;
+  UINT64          Start;
+  UINT64          Length;
+  CHAR8           Range[48];         // "bytes=<start>-<end>"
+  CHAR8           ContentRange[64];  // "bytes <start>-<end>/", what must come back
+} FETCH_SEGMENT;
+
+
+// Sink for a single stream: grow the buffer as needed
+STATIC
+EFI_STATUS
+FetchStreamWrite (
+  IN VOID       *Context,
+  IN FETCH_JOB  *Job,
+  IN UINT64     Offset,
+  IN CONST VOID *Data,
+  IN UINTN      Length
+  )
+{
+  FETCH_SEGMENTED *Result = Context;
+  UINTN           Pages;
+  VOID            *Buffer;
+
+  if (Offset + Length > EFI_PAGES_TO_SIZE (Result->Pages)) {
+    Pages  = MAX (Result->Pages * 2, EFI_SIZE_TO_PAGES (Offset + Length));
+    Buffer = AllocatePages (Pages);
+    if (Buffer == NULL)
+      return EFI_OUT_OF_RESOURCES;
+
+    if (Result->Buffer != NULL) {
+      CopyMem (Buffer, Result->Buffer, (UINTN)Offset);
+      FreePages (Result->Buffer, Result->Pages);
+    }
+
+    Result->Buffer = Buffer;
+    Result->Pages  = Pages;
+  }
+
+  CopyMem ((UINT8 *)Result->Buffer + Offset, Data, Length);
+  Result->Size = Offset + Length;
+  return EFI_SUCCESS;
+}
+
+
+// Sink for a segment: write it in place
+STATIC
+EFI_STATUS
+FetchSegmentWrite (
+  IN VOID       *Context,
+  IN FETCH_JOB  *Job,
+  IN UINT64     Offset,
+  IN CONST VOID *Data,
+  IN UINTN      Length
+  )
+{
+  FETCH_SEGMENT *Segment = Context;
+
+  // A server that does not support Range answers 200 with the whole body,
+  // FetchSegmented() starts over with a single stream then
+  if (Job->StatusCode != HTTP_STATUS_206_PARTIAL_CONTENT)
+    return EFI_UNSUPPORTED;
+
+  // Anything but the range asked for would end up in the wrong place
+  if (Offset == 0 &&
+      AsciiStrnCmp (Job->ContentRange, Segment->ContentRange, AsciiStrLen (Segment->ContentRange)) != 0)
+    return EFI_PROTOCOL_ERROR;
+
+  if (Offset + Length > Segment->Length)
+    return EFI_BAD_BUFFER_SIZE;
+
+  CopyMem ((UINT8 *)Segment->Result->Buffer + Segment->Start + Offset, Data, Length);
+  return EFI_SUCCESS;
+}
+
+
+// Download the whole body with a single GET. SizeHint is the expected size,
+// or MAX_UINT64 if unknown.
+STATIC
+EFI_STATUS
+FetchStream (
+  IN  HTTP_WAIT       *Wait,
+  IN  FETCH_CHILD     *Children,
+  IN  UINTN           NChildren,
+  IN  CHAR16          *Url,
+  IN  UINT64          SizeHint,
+  OUT FETCH_SEGMENTED *Result
+  )
+{
+  EFI_STATUS Status;
+  FETCH_SINK Stream = { FetchStreamWrite, Result };
+  FETCH_JOB  Job;
+
+  ZeroMem (&Job, sizeof (Job));
+  Job.Url    = Url;
+  Job.Method = HttpMethodGet;
+  Job.Sink   = &Stream;
+
+  if (SizeHint != MAX_UINT64 && SizeHint > 0) {
+    Result->Pages  = EFI_SIZE_TO_PAGES ((UINTN)SizeHint);
+    Result->Buffer = AllocatePages (Result->Pages);
+    if (Result->Buffer == NULL)
+      return EFI_OUT_OF_RESOURCES;
+  }
+
+  Result->Size      = 0;
+  Result->NSegments = 1;
+  Result->Ranged    = FALSE;
+
+  Status = FetchRun (Wait, Children, NChildren, &Job, 1);
+  if (!EFI_ERROR (Status))
+    Status = Job.Status;
+
+  Result->EndTsc = AsmReadTsc ();
+  return Status;
+}
+
+
+EFI_STATUS
+FetchSegmented (
+  IN  HTTP_WAIT       *Wait,
+  IN  FETCH_CHILD     *Children,
+  IN  UINTN           NChildren,
+  IN  CHAR16          *Url,
+  IN  UINTN           NSegments,
+  IN  UINT64          SegmentSize,
+  OUT FETCH_SEGMENTED *Result
+  )
+{
+  EFI_STATUS    Status;
+  FETCH_JOB     Head;
+  FETCH_JOB     *Jobs;
+  FETCH_SEGMENT *Segments;
+  UINT64        Size;
+  UINTN         i;
+
+  if (NSegments == 0 && SegmentSize == 0)
+    return EFI_INVALID_PARAMETER;
+
+  ZeroMem (Result, sizeof (*Result));
+
+  // Learn the size first
+  ZeroMem (&Head, sizeof (Head));
+  Head.Url    = Url;
+  Head.Method = HttpMethodHead;
+
+  Result->StartTsc = AsmReadTsc ();
+  Status = FetchRun (Wait, Children, NChildren, &Head, 1);
+  Result->HeadTsc = AsmReadTsc ();
+
+  if (EFI_ERROR (Status))
+    return Status;
+
+  // Some servers do not like HEAD or do not send Content-Length, nothing to
+  // split then
+  Size = EFI_ERROR (Head.Status) ? MAX_UINT64 : Head.ContentLength;
+  if (Size == MAX_UINT64 || Size == 0) {
+    Status = FetchStream (Wait, Children, NChildren, Url, Size, Result);
+    goto out_check;
+  }
+
+  if (SegmentSize == 0)
+    SegmentSize = DivU64x64Remainder (Size + NSegments - 1, NSegments, NULL);
+
+  NSegments = (UINTN)DivU64x64Remainder (Size + SegmentSize - 1, SegmentSize, NULL);
+  if (NSegments == 1) {
+    Status = FetchStream (Wait, Children, NChildren, Url, Size, Result);
+    goto out_check;
+  }
+
+  Result->Size   = Size;
+  Result->Pages  = EFI_SIZE_TO_PAGES ((UINTN)Size);
+  Result->Buffer = AllocatePages (Result->Pages);
+  if (Result->Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_check;
+  }
+
+  Jobs = AllocateZeroPool (NSegments * sizeof (*Jobs));
+  if (Jobs == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_check;
+  }
+
+  Segments = AllocateZeroPool (NSegments * sizeof (*Segments));
+  if (Segments == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto out_free_jobs;
+  }
+
+  for (i = 0; i < NSegments; i++) {
+    Segments[i].Sink.Write   = FetchSegmentWrite;
+    Segments[i].Sink.Context = &Segments[i];
+    Segments[i].Result       = Result;
+    Segments[i].Start        = MultU64x64 (i, SegmentSize);
+    Segments[i].Length       = MIN (SegmentSize, Size - Segments[i].Start);
+
+    AsciiSPrint (
+      Segments[i].Range,
+      sizeof (Segments[i].Range),
+      "bytes=%lu-%lu",
+      Segments[i].Start,
+      Segments[i].Start + Segments[i].Length - 1
+      );
+
+    AsciiSPrint (
+      Segments[i].ContentRange,
+      sizeof (Segments[i].ContentRange),
+      "bytes %lu-%lu/",
+      Segments[i].Start,
+      Segments[i].Start + Segments[i].Length - 1
+      );
+
+    Jobs[i].Url                   = Url;
+    Jobs[i].Method                = HttpMethodGet;
+    Jobs[i].Headers[0].FieldName  = "Range";
+    Jobs[i].Headers[0].FieldValue = Segments[i].Range;
+    Jobs[i].HeaderCount           = 1;
+    Jobs[i].Sink                  = &Segments[i].Sink;
+  }
+
+  Status = FetchRun (Wait, Children, NChildren, Jobs, NSegments);
+  Result->EndTsc = AsmReadTsc ();
+
+  if (EFI_ERROR (Status))
+    goto out_free_segments;
+
+  if (Jobs[0].StatusCode == HTTP_STATUS_200_OK) {
+    // Range ignored, all the segments were stopped right away
+    FreePages (Result->Buffer, Result->Pages);
+    Result->Buffer = NULL;
+    Result->Pages  = 0;
+
+    Status = FetchStream (Wait, Children, NChildren, Url, Size, Result);
+  } else {
+    Result->NSegments = NSegments;
+    Result->Ranged    = TRUE;
+
+    for (i = 0; i < NSegments; i++) {
+      Status = Jobs[i].Status;
+      if (!EFI_ERROR (Status) && Jobs[i].Bytes != Segments[i].Length)
+        Status = EFI_PROTOCOL_ERROR;
+      if (EFI_ERROR (Status))
+        break;
+    }
+  }
+
+out_free_segments:
+  FreePool (Segments);
+out_free_jobs:
+  FreePool (Jobs);
+out_check:
+  // A single stream must match the size from HEAD, if known
+  if (!EFI_ERROR (Status) && Size != MAX_UINT64 && Result->Size != Size)
+    Status = EFI_PROTOCOL_ERROR;
+
+  if (EFI_ERROR (Status) && Result->Buffer != NULL) {
+    FreePages (Result->Buffer, Result->Pages);
+    Result->Buffer = NULL;
+    Result->Pages  = 0;
+  }
+
+  return Status;
+}
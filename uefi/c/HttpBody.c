@@ -0,0 +1,156 @@
+/** @file
+  Incremental HTTP/1.1 response body framing.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+#include "HttpBody.h"
+
+
+EFI_HTTP_HEADER *
+HttpBodyFindHeader (
+  IN UINTN           HeaderCount,
+  IN EFI_HTTP_HEADER *Headers,
+  IN CONST CHAR8     *FieldName
+  )
+{
+  for (UINTN i = 0; i < HeaderCount; i++) {
+    if (Headers[i].FieldName != NULL && AsciiStriCmp (Headers[i].FieldName, FieldName) == 0)
+      return &Headers[i];
+  }
+
+  return NULL;
+}
+
+
+VOID
+HttpBodyInit (
+  OUT HTTP_BODY       *Body,
+  IN  UINTN           HeaderCount,
+  IN  EFI_HTTP_HEADER *Headers,
+  IN  BOOLEAN         NoBody
+  )
+{
+  EFI_HTTP_HEADER *Header;
+
+  ZeroMem (Body, sizeof (*Body));
+  Body->State         = ChunkSize;
+  Body->ContentLength = MAX_UINT64;
+
+  if (NoBody) {
+    Body->ContentLength = 0;
+    return;
+  }
+
+  Header = HttpBodyFindHeader (HeaderCount, Headers, "Transfer-Encoding");
+  if (Header != NULL && AsciiStriCmp (Header->FieldValue, "chunked") == 0) {
+    Body->Chunked = TRUE;
+    return;
+  }
+
+  Header = HttpBodyFindHeader (HeaderCount, Headers, "Content-Length");
+  if (Header != NULL && EFI_ERROR (AsciiStrDecimalToUint64S (Header->FieldValue, NULL, &Body->ContentLength)))
+    Body->ContentLength = MAX_UINT64;
+}
+
+
+UINTN
+HttpBodyFeed (
+  IN OUT HTTP_BODY *Body,
+  IN OUT CHAR8     *Buffer,
+  IN     UINTN     Length
+  )
+{
+  UINTN In = 0, Out = 0, N;
+  CHAR8 C;
+
+  Body->Received += Length;
+
+  if (!Body->Chunked)
+    return Length;
+
+  while (In < Length && Body->State != ChunkDone) {
+    switch (Body->State) {
+    case ChunkSize:
+      C = Buffer[In++];
+
+      if (C >= '0' && C <= '9') {
+        Body->Remaining = Body->Remaining * 16 + (C - '0');
+      } else if ((C | 0x20) >= 'a' && (C | 0x20) <= 'f') {
+        Body->Remaining = Body->Remaining * 16 + ((C | 0x20) - 'a' + 10);
+      } else if (C == '\n') {
+        Body->State = Body->Remaining ? ChunkData : ChunkTrailer;
+      } else {
+        // Either CR or the start of a chunk extension
+        Body->State = ChunkExt;
+      }
+      break;
+
+    case ChunkExt:
+      if (Buffer[In++] == '\n')
+        Body->State = Body->Remaining ? ChunkData : ChunkTrailer;
+      break;
+
+    case ChunkData:
+      N = (UINTN)MIN (Body->Remaining, Length - In);
+      CopyMem (Buffer + Out, Buffer + In, N);
+      In  += N;
+      Out += N;
+
+      Body->Remaining -= N;
+      if (Body->Remaining == 0)
+        Body->State = ChunkDataEnd;
+      break;
+
+    case ChunkDataEnd:
+      if (Buffer[In++] == '\n')
+        Body->State = ChunkSize;
+      break;
+
+    case ChunkTrailer:
+      // Trailer ends with an empty line
+      C = Buffer[In++];
+
+      if (C == '\n') {
+        if (Body->LineLength == 0)
+          Body->State = ChunkDone;
+        Body->LineLength = 0;
+      } else if (C != '\r') {
+        Body->LineLength++;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  return Out;
+}
+
+
+BOOLEAN
+HttpBodyDone (
+  IN HTTP_BODY *Body
+  )
+{
+  if (Body->Chunked)
+    return Body->State == ChunkDone;
+
+  return Body->Received >= Body->ContentLength;
+}
+
+
+BOOLEAN
+HttpBodyEndsAtClose (
+  IN HTTP_BODY *Body
+  )
+{
+  return !Body->Chunked && Body->ContentLength == MAX_UINT64;
+}
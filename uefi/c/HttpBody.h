@@ -0,0 +1,77 @@
+/** @file
+  Incremental HTTP/1.1 response body framing.
+
+  Keeps track of where a response body ends (Content-Length, chunked transfer
+  encoding, or connection close) and strips chunked framing on the fly. The
+  state survives across receive calls, so the body can be received through a
+  single fixed-size buffer no matter its size.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef HTTP_BODY_H_
+#define HTTP_BODY_H_
+
+#include <Uefi.h>
+#include <Protocol/Http.h>
+
+typedef enum {
+  ChunkSize,     // Reading hex chunk size
+  ChunkExt,      // Skipping chunk extensions up to LF
+  ChunkData,     // Passing through chunk data
+  ChunkDataEnd,  // Skipping CRLF after chunk data
+  ChunkTrailer,  // Skipping trailer lines after the last (empty) chunk
+  ChunkDone
+} CHUNK_STATE;
+
+typedef struct {
+  BOOLEAN     Chunked;
+  UINT64      ContentLength;  // MAX_UINT64 if the body ends at connection close
+  UINT64      Received;       // Bytes received so far, including chunk framing
+  CHUNK_STATE State;
+  UINT64      Remaining;      // Chunk size being parsed or chunk data left
+  UINTN       LineLength;     // Length of current trailer line
+} HTTP_BODY;
+
+// Find a header by (case-insensitive) name, NULL if not present
+EFI_HTTP_HEADER *
+HttpBodyFindHeader (
+  IN UINTN           HeaderCount,
+  IN EFI_HTTP_HEADER *Headers,
+  IN CONST CHAR8     *FieldName
+  );
+
+// Initialize body framing from response headers. NoBody is for responses that
+// never have a body regardless of their headers (e.g. to HEAD requests).
+VOID
+HttpBodyInit (
+  OUT HTTP_BODY       *Body,
+  IN  UINTN           HeaderCount,
+  IN  EFI_HTTP_HEADER *Headers,
+  IN  BOOLEAN         NoBody
+  );
+
+// Account for Length received bytes in Buffer, stripping chunked framing in
+// place. Returns the number of body bytes left at the start of Buffer.
+UINTN
+HttpBodyFeed (
+  IN OUT HTTP_BODY *Body,
+  IN OUT CHAR8     *Buffer,
+  IN     UINTN     Length
+  );
+
+// Whether the whole body has been received
+BOOLEAN
+HttpBodyDone (
+  IN HTTP_BODY *Body
+  );
+
+// Whether the body only ends when the server closes the connection
+BOOLEAN
+HttpBodyEndsAtClose (
+  IN HTTP_BODY *Body
+  );
+
+#endif // HTTP_BODY_H_
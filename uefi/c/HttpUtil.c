@@ -0,0 +1,58 @@
+/** @file
+  Small helpers shared by the BGGP5 C apps.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "HttpUtil.h"
+
+
+EFI_STATUS
+HttpUtilUrlHost (
+  IN  CONST CHAR16 *Url,
+  OUT CHAR8        *Host,
+  IN  UINTN        HostSize
+  )
+{
+  CONST CHAR16 *Authority = NULL;
+  UINTN        n;
+
+  // Url[n + 2] is only read if Url[n + 1] is not the terminator
+  for (n = 0; Url[n] != L'\0'; n++) {
+    if (Url[n] == L':' && Url[n + 1] == L'/' && Url[n + 2] == L'/') {
+      Authority = Url + n + 3;
+      break;
+    }
+  }
+
+  if (Authority == NULL)
+    return EFI_INVALID_PARAMETER;
+
+  for (n = 0; Authority[n] != L'\0' && Authority[n] != L'/' && Authority[n] != L'?' && Authority[n] != L'#'; n++) {
+    if (n + 1 >= HostSize || Authority[n] > 0x7f)
+      return EFI_INVALID_PARAMETER;
+
+    Host[n] = (CHAR8)Authority[n];
+  }
+
+  Host[n] = '\0';
+  return n > 0 ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
+}
+
+
+UINT64
+HttpUtilTscFrequency (
+  VOID
+  )
+{
+  UINT64 Start = AsmReadTsc ();
+
+  gBS->Stall (10000);
+  return MultU64x32 (AsmReadTsc () - Start, 100);
+}
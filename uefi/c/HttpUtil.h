@@ -0,0 +1,32 @@
+/** @file
+  Small helpers shared by the BGGP5 C apps.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef HTTP_UTIL_H_
+#define HTTP_UTIL_H_
+
+#include <Uefi.h>
+
+// Extract the authority (host[:port]) of an absolute Url, for the Host header.
+// Fails if there is no "scheme://" or the authority is empty, not ASCII, or
+// does not fit in HostSize bytes (NUL terminator included).
+EFI_STATUS
+HttpUtilUrlHost (
+  IN  CONST CHAR16 *Url,
+  OUT CHAR8        *Host,
+  IN  UINTN        HostSize
+  );
+
+// TimerLib on OVMF uses the 24-bit ACPI PM timer as performance counter, which
+// wraps around every ~4.7 seconds, and GetTime() only has 1s resolution. Return
+// the frequency of the TSC instead, calibrated with a 10ms Stall().
+UINT64
+HttpUtilTscFrequency (
+  VOID
+  );
+
+#endif // HTTP_UTIL_H_
@@ -0,0 +1,206 @@
+/** @file
+  Event-driven wait engine for EFI_HTTP_PROTOCOL tokens.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "HttpUtil.h"
+#include "HttpWait.h"
+
+// Timer periods are expressed in units of 100ns
+#define MS_TO_TIMER_PERIOD(Ms) MultU64x32 ((Ms), 10000)
+
+
+EFI_STATUS
+HttpWaitInit (
+  OUT HTTP_WAIT *Wait,
+  IN  UINTN     PollIntervalMs
+  )
+{
+  EFI_STATUS Status;
+
+  Wait->TimeoutEvent   = NULL;
+  Wait->PollEvent      = NULL;
+  Wait->PollIntervalMs = PollIntervalMs;
+
+  Status = gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Wait->TimeoutEvent);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  if (PollIntervalMs != 0) {
+    Status = gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Wait->PollEvent);
+    if (EFI_ERROR (Status))
+      goto out_close_timeout;
+
+    Status = gBS->SetTimer (Wait->PollEvent, TimerPeriodic, MS_TO_TIMER_PERIOD (PollIntervalMs));
+    if (EFI_ERROR (Status))
+      goto out_close_poll;
+  }
+
+  Wait->TscHz = HttpUtilTscFrequency ();
+
+  return EFI_SUCCESS;
+
+out_close_poll:
+  gBS->CloseEvent (Wait->PollEvent);
+  Wait->PollEvent = NULL;
+out_close_timeout:
+  gBS->CloseEvent (Wait->TimeoutEvent);
+  Wait->TimeoutEvent = NULL;
+  return Status;
+}
+
+
+VOID
+HttpWaitFree (
+  IN HTTP_WAIT *Wait
+  )
+{
+  if (Wait->PollEvent != NULL)
+    gBS->CloseEvent (Wait->PollEvent);
+  if (Wait->TimeoutEvent != NULL)
+    gBS->CloseEvent (Wait->TimeoutEvent);
+
+  Wait->PollEvent    = NULL;
+  Wait->TimeoutEvent = NULL;
+}
+
+
+EFI_STATUS
+HttpWaitStart (
+  IN HTTP_WAIT *Wait,
+  IN UINTN     TimeoutMs
+  )
+{
+  Wait->Stats.Polls     = 0;
+  Wait->Stats.Wakeups   = 0;
+  Wait->Stats.ElapsedUs = 0;
+  Wait->StartTsc        = AsmReadTsc ();
+
+  // Consume a stale signal from a previous timeout, if any
+  gBS->CheckEvent (Wait->TimeoutEvent);
+
+  if (TimeoutMs == 0)
+    return gBS->SetTimer (Wait->TimeoutEvent, TimerCancel, 0);
+
+  return gBS->SetTimer (Wait->TimeoutEvent, TimerRelative, MS_TO_TIMER_PERIOD (TimeoutMs));
+}
+
+
+EFI_STATUS
+HttpWaitAny (
+  IN  HTTP_WAIT         *Wait,
+  IN  EFI_HTTP_PROTOCOL **Http,
+  IN  UINTN             NHttp,
+  IN  EFI_EVENT         *Events,
+  IN  UINTN             NEvents,
+  OUT UINTN             *Index
+  )
+{
+  EFI_EVENT  WaitEvents[HTTP_WAIT_MAX_EVENTS + 2];
+  EFI_STATUS Status;
+  UINTN      Signaled;
+  UINTN      i;
+
+  if (NEvents == 0 || NEvents > HTTP_WAIT_MAX_EVENTS)
+    return EFI_INVALID_PARAMETER;
+
+  // Token events first, then timeout and poll timer
+  for (i = 0; i < NEvents; i++)
+    WaitEvents[i] = Events[i];
+
+  WaitEvents[NEvents]     = Wait->TimeoutEvent;
+  WaitEvents[NEvents + 1] = Wait->PollEvent;
+
+  for (;;) {
+    // Poll() pushes data through the TCP/TLS stack right away instead of
+    // waiting for the next MNP receive timer to fire
+    for (i = 0; i < NHttp; i++) {
+      Http[i]->Poll (Http[i]);
+      Wait->Stats.Polls++;
+    }
+
+    for (i = 0; i < NEvents; i++) {
+      if (gBS->CheckEvent (Events[i]) == EFI_SUCCESS) {
+        Status = EFI_SUCCESS;
+        *Index = i;
+        goto out;
+      }
+    }
+
+    if (gBS->CheckEvent (Wait->TimeoutEvent) == EFI_SUCCESS) {
+      Status = EFI_TIMEOUT;
+      goto out;
+    }
+
+    // Busy-spin mode, go around again right away
+    if (Wait->PollEvent == NULL)
+      continue;
+
+    // Sleep until the next poll tick, timeout or token completion. A signaled
+    // event returned by WaitForEvent() is also reset, so act on it directly.
+    Status = gBS->WaitForEvent (NEvents + 2, WaitEvents, &Signaled);
+    if (EFI_ERROR (Status))
+      goto out;
+
+    Wait->Stats.Wakeups++;
+
+    if (Signaled < NEvents) {
+      *Index = Signaled;
+      goto out;
+    }
+
+    if (Signaled == NEvents) {
+      Status = EFI_TIMEOUT;
+      goto out;
+    }
+  }
+
+out:
+  Wait->Stats.ElapsedUs = HttpWaitElapsedUs (Wait);
+  return Status;
+}
+
+
+EFI_STATUS
+HttpWaitToken (
+  IN HTTP_WAIT         *Wait,
+  IN EFI_HTTP_PROTOCOL *Http,
+  IN EFI_EVENT         Event,
+  IN UINTN             TimeoutMs
+  )
+{
+  EFI_STATUS Status;
+  UINTN      Index;
+
+  Status = HttpWaitStart (Wait, TimeoutMs);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  return HttpWaitAny (Wait, &Http, 1, &Event, 1, &Index);
+}
+
+
+UINT64
+HttpWaitElapsedUs (
+  IN HTTP_WAIT *Wait
+  )
+{
+  return HttpWaitTscToUs (Wait, AsmReadTsc () - Wait->StartTsc);
+}
+
+
+UINT64
+HttpWaitTscToUs (
+  IN HTTP_WAIT *Wait,
+  IN UINT64    Ticks
+  )
+{
+  return DivU64x64Remainder (MultU64x32 (Ticks, 1000000), Wait->TscHz, NULL);
+}
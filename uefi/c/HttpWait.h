@@ -0,0 +1,99 @@
+/** @file
+  Event-driven wait engine for EFI_HTTP_PROTOCOL tokens.
+
+  Instead of busy-spinning on EFI_HTTP_PROTOCOL.Poll() and checking the time
+  with EFI_RUNTIME_SERVICES.GetTime(), use a relative timer event for the
+  timeout and a periodic timer event for polling, and sleep in between through
+  EFI_BOOT_SERVICES.WaitForEvent().
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef HTTP_WAIT_H_
+#define HTTP_WAIT_H_
+
+#include <Uefi.h>
+#include <Protocol/Http.h>
+
+// Max number of token events that can be waited on at once
+#define HTTP_WAIT_MAX_EVENTS 62
+
+// Default poll interval. Timer events only fire on timer interrupts, so the
+// actual resolution is the platform timer period (10ms on OVMF). A value of 0
+// means spin on Poll() + CheckEvent() without ever sleeping (the old way).
+#define HTTP_WAIT_POLL_INTERVAL_MS 1
+
+typedef struct {
+  UINT64 Polls;      // Number of EFI_HTTP_PROTOCOL.Poll() calls
+  UINT64 Wakeups;    // Number of times WaitForEvent() returned
+  UINT64 ElapsedUs;  // Time spent waiting
+} HTTP_WAIT_STATS;
+
+typedef struct {
+  EFI_EVENT       TimeoutEvent;
+  EFI_EVENT       PollEvent;
+  UINTN           PollIntervalMs;
+  UINT64          TscHz;
+  UINT64          StartTsc;
+  HTTP_WAIT_STATS Stats;
+} HTTP_WAIT;
+
+// Create the timer events. PollIntervalMs == 0 selects busy-spinning.
+EFI_STATUS
+HttpWaitInit (
+  OUT HTTP_WAIT *Wait,
+  IN  UINTN     PollIntervalMs
+  );
+
+// Close the timer events
+VOID
+HttpWaitFree (
+  IN HTTP_WAIT *Wait
+  );
+
+// Arm the timeout timer and reset stats. TimeoutMs == 0 means no timeout.
+EFI_STATUS
+HttpWaitStart (
+  IN HTTP_WAIT *Wait,
+  IN UINTN     TimeoutMs
+  );
+
+// Drive all the given HTTP instances until one of the given token events is
+// signaled (returning its index in *Index) or the timeout armed by
+// HttpWaitStart() expires (returning EFI_TIMEOUT). Token events must be created
+// without EVT_NOTIFY_SIGNAL, or they cannot be waited on nor checked.
+EFI_STATUS
+HttpWaitAny (
+  IN  HTTP_WAIT         *Wait,
+  IN  EFI_HTTP_PROTOCOL **Http,
+  IN  UINTN             NHttp,
+  IN  EFI_EVENT         *Events,
+  IN  UINTN             NEvents,
+  OUT UINTN             *Index
+  );
+
+// Wait for a single token with its own timeout
+EFI_STATUS
+HttpWaitToken (
+  IN HTTP_WAIT         *Wait,
+  IN EFI_HTTP_PROTOCOL *Http,
+  IN EFI_EVENT         Event,
+  IN UINTN             TimeoutMs
+  );
+
+// Microseconds elapsed since the last HttpWaitStart()
+UINT64
+HttpWaitElapsedUs (
+  IN HTTP_WAIT *Wait
+  );
+
+// Convert a TSC delta to microseconds
+UINT64
+HttpWaitTscToUs (
+  IN HTTP_WAIT *Wait,
+  IN UINT64    Ticks
+  );
+
+#endif // HTTP_WAIT_H_
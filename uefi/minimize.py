@@ -3,24 +3,56 @@
 # @mebeim - 2024-07-20
 #
 
+import re
 import sys
+from argparse import ArgumentParser
+from bisect import bisect_right
 from collections import namedtuple
+from concurrent.futures import ProcessPoolExecutor
+from itertools import accumulate
+from multiprocessing import Value
 from operator import attrgetter
-from os import system
+from os import cpu_count
 from pathlib import Path
+from struct import unpack_from
+from subprocess import run
+from tempfile import TemporaryDirectory
 
-from iced_x86 import Decoder, Instruction
-from iced_x86.Mnemonic import ADD, SUB, PUSH, POP, RET
+from iced_x86 import Decoder, Encoder, Instruction, InstructionInfoFactory, \
+	MemorySizeExt, RegisterExt
+from iced_x86 import FlowControl, Mnemonic, OpAccess, OpKind, Register
+from iced_x86.Mnemonic import ADD, SUB, PUSH, POP, RET, JMP
 
 
 Chunk = namedtuple('Chunk', ['name', 'offset', 'size'])
 
+# Where code can go in a binary: file format ('pe', 'elf32' or 'elf64'), code
+# bitness, offset of the entry point and header holes
+Layout = namedtuple('Layout', ['fmt', 'bits', 'entry_offset', 'chunks'])
+
+# What an instruction reads and writes: registers as ('r', full register) and
+# single RFLAGS bits as ('f', bit), plus memory accesses. Barriers (branches,
+# calls and anything inside a loop) must stay where they are.
+Effects   = namedtuple('Effects', ['reads', 'writes', 'mem', 'barrier'])
+MemAccess = namedtuple('MemAccess', ['key', 'start', 'end', 'write'])
+
+# Source line of an instruction: line number (0-based), source text with local
+# label references made absolute, and labels defined right before it
+SrcInsn = namedtuple('SrcInsn', ['lineno', 'text', 'labels'])
+
+# Weights of the cost minimized by the solver: wasted bytes, taken JMPs and
+# instructions crossing a fetch line
+CostModel = namedtuple('CostModel', ['byte', 'jump', 'line'])
+
+# Estimated run time of a schedule: taken JMPs, instructions crossing a fetch
+# line, and estimated cycles (see runtime_cost())
+RuntimeCost = namedtuple('RuntimeCost', ['jumps', 'crossings', 'cycles'])
+
 InsnListT = list[Instruction]
 ScheduleT = list[tuple[Chunk,InsnListT]]
 
 ASM_DIR    = Path('asm')
 ASM_SOURCE = Path('BGGP5_Asm_v3.asm')
-EFI_BINARY = Path('BGGP5_Asm_v3.efi')
 
 ENTRY_OFFSET = 0xe4
 HEADER_CHUNKS = (
@@ -34,6 +66,39 @@ HEADER_CHUNKS = (
 	Chunk('HOLE7', 0xd4, 16),
 )
 
+# e_machine (ELF) or Machine (PE) -> code bitness
+MACHINE_BITS = {3: 32, 0x3e: 64, 0x14c: 32, 0x8664: 64}
+
+# Label definition at the start of a line of NASM source, and reference to a
+# local label (.name) in an operand
+LABEL_DEF_RE = re.compile(r'^\s*([A-Za-z_.?][\w.?@$#~]*):')
+LOCAL_REF_RE = re.compile(r'(?<![\w.$?@#~])\.(?=[A-Za-z_?])')
+
+# Mnemonic -> lowercase name
+MNEMONIC_NAMES = {v: k.lower() for k, v in vars(Mnemonic).items() if k.isupper()}
+
+# Operand kinds of near branches, with the Instruction attribute to set them
+NEAR_BRANCH_KINDS = {OpKind.NEAR_BRANCH16: 'near_branch16',
+	OpKind.NEAR_BRANCH32: 'near_branch32', OpKind.NEAR_BRANCH64: 'near_branch64'}
+
+# Only minimize the size by default
+SIZE_COST = CostModel(1, 0, 0)
+
+# Rough cycle counts for the run time estimate, assuming instructions run once:
+# instructions not listed take 1 cycle, plus MEM_CYCLES for a memory operand
+# (except LEA). A taken JMP costs TAKEN_JMP_CYCLES for the fetch redirect, and
+# an instruction crossing a FETCH_LINE-byte boundary costs LINE_CYCLES.
+FETCH_LINE       = 16
+MEM_CYCLES       = 4
+TAKEN_JMP_CYCLES = 2
+LINE_CYCLES      = 1
+CYCLES = {
+	'call': 3, 'ret': 3, 'loop': 5, 'xchg': 2, 'cld': 4, 'std': 4,
+	'lodsb': 3, 'lodsw': 3, 'lodsd': 3, 'stosb': 3, 'stosw': 3, 'stosd': 3,
+	'movsb': 4, 'outsb': 30, 'syscall': 100, 'int': 200, 'mul': 3, 'imul': 3,
+	'div': 25, 'idiv': 25,
+}
+
 
 def jmp_size(ip: int, target: int) -> int:
 	'''
@@ -72,13 +137,649 @@ def take_insns(insns: InsnListT, size: int) -> tuple[int,int]:
 	return n, size
 
 
-def solve(insns: InsnListT, chunks: tuple[Chunk, ...], cur_chunk: Chunk,
+def line_crossings(offset: int, sizes: list[int]) -> int:
+	'''
+	Count the instructions of the given sizes, placed one after the other from
+	offset, that cross a FETCH_LINE boundary.
+	'''
+	res = 0
+
+	for size in sizes:
+		res += offset // FETCH_LINE != (offset + size - 1) // FETCH_LINE
+		offset += size
+
+	return res
+
+
+def file_size(schedule: ScheduleT, entry_offset: int, data_sz: int) -> int:
+	'''
+	Size of the file for the given schedule: headers, ENTRY instructions and
+	their JMP, last (AHEAD) chunk instructions, and data.
+	'''
+	entry_chunk, entry_insns = schedule[0]
+	return entry_offset + sum(map(len, entry_insns)) \
+		+ chunk_jmp_size(entry_chunk, schedule[1][0]) \
+		+ sum(map(len, schedule[-1][1])) + data_sz
+
+
+def runtime_cost(schedule: ScheduleT) -> RuntimeCost:
+	'''
+	Estimate the run time of a schedule: sum of the CYCLES of the instructions,
+	each executed once, plus the cost of the JMPs between chunks (all taken)
+	and of the instructions (JMPs included) crossing a fetch line.
+	'''
+	cycles = 0
+	crossings = 0
+
+	for k, (chunk, insns) in enumerate(schedule):
+		sizes = list(map(len, insns))
+		if k < len(schedule) - 1:
+			sizes.append(chunk_jmp_size(chunk, schedule[k + 1][0]))
+
+		crossings += line_crossings(chunk.offset, sizes)
+
+		for insn in insns:
+			cycles += CYCLES.get(MNEMONIC_NAMES[insn.mnemonic], 1)
+			if MNEMONIC_NAMES[insn.mnemonic] != 'lea' and any(insn.op_kind(i)
+					== OpKind.MEMORY for i in range(insn.op_count)):
+				cycles += MEM_CYCLES
+
+	jumps = len(schedule) - 1
+	cycles += jumps * TAKEN_JMP_CYCLES + crossings * LINE_CYCLES
+	return RuntimeCost(jumps, crossings, cycles)
+
+
+def binary_layout(data: bytes) -> tuple[str,int]:
+	'''
+	Detect file format and code bitness from the headers of a PE or ELF file.
+	The machine field is used for the bitness, as e_ident[EI_CLASS] is ignored
+	by Linux and often overwritten with code.
+	'''
+	if data[:2] == b'MZ':
+		pe_off = unpack_from('<I', data, 0x3c)[0] if len(data) >= 0x40 else 0
+		if data[pe_off:pe_off + 4] != b'PE\0\0':
+			sys.exit('Invalid PE signature!')
+
+		return 'pe', MACHINE_BITS[unpack_from('<H', data, pe_off + 4)[0]]
+
+	if data[:4] == b'\x7fELF':
+		bits = MACHINE_BITS[unpack_from('<H', data, 0x12)[0]]
+		return f'elf{bits}', bits
+
+	sys.exit('Unknown binary format, only PE and ELF are supported!')
+
+
+def load_layout(path: Path, fmt: str, bits: int) -> Layout:
+	'''
+	Load a layout description from a text file. One directive per line, empty
+	lines and anything after a # are ignored:
+
+	    format elf64        # pe, elf32 or elf64 (detected from the binary)
+	    bits 64             # code bitness (detected from the binary)
+	    entry 0x78          # offset of the entry point
+	    hole NAME 0x4 12    # a hole: name, offset and size
+	'''
+	entry, chunks = None, []
+
+	for lineno, line in enumerate(path.read_text().splitlines(), 1):
+		line = line.split('#', 1)[0].split()
+		if not line:
+			continue
+
+		try:
+			match line:
+				case ['format', f] if f in ('pe', 'elf32', 'elf64'):
+					fmt = f
+				case ['bits', b] if b in ('32', '64'):
+					bits = int(b)
+				case ['entry', off]:
+					entry = int(off, 0)
+				case ['hole', name, off, size]:
+					chunks.append(Chunk(name, int(off, 0), int(size, 0)))
+				case _:
+					raise ValueError
+		except ValueError:
+			sys.exit(f'{path}:{lineno}: invalid directive')
+
+	if entry is None:
+		sys.exit(f'{path}: missing entry directive')
+
+	return Layout(fmt, bits, entry, tuple(sorted(chunks, key=attrgetter('offset'))))
+
+
+def pad_regex(label: str) -> str:
+	'''
+	Regexp matching the padding after a hole label in a NASM source, capturing
+	the size of the hole
+	'''
+	n = re.escape(label)
+	return rf'PAD_CHECK\s+{n}\s*,\s*(\w+)|times\s+(\w+)\s*-\s*\(\s*\$\s*-\s*{n}\s*\)'
+
+
+def detect_layout(src: Path, labels: dict[str,int], fmt: str, bits: int,
+		hole_re: str, entry_label: str) -> Layout:
+	'''
+	Detect a layout from the labels of a NASM source: holes are the labels
+	matching hole_re, with their size taken from the padding that follows
+	them, either `PAD_CHECK LABEL, SIZE` or `times SIZE - ($ - LABEL) ...`.
+	'''
+	text = src.read_text()
+	chunks = []
+
+	if entry_label not in labels:
+		sys.exit(f'Entry point label {entry_label} not found in {src}!')
+
+	for name, off in labels.items():
+		if not re.fullmatch(hole_re, name):
+			continue
+
+		m = re.search(pad_regex(name), text)
+		if m is None:
+			sys.exit(f'Cannot find the size of hole {name} in {src}!')
+
+		chunks.append(Chunk(name, off, int(m.group(1) or m.group(2), 0)))
+
+	if not chunks:
+		sys.exit(f'No labels matching {hole_re!r} in {src}!')
+
+	return Layout(fmt, bits, labels[entry_label],
+		tuple(sorted(chunks, key=attrgetter('offset'))))
+
+
+def assemble(src: Path) -> tuple[bytes,dict[str,int]]:
+	'''
+	Assemble a flat binary NASM source and return its contents along with the
+	file offset of each label, taken from a NASM map file
+	'''
+	with TemporaryDirectory() as tmp:
+		tmp = Path(tmp)
+		wrapper = tmp / 'wrapper.asm'
+		wrapper.write_text(f'[map symbols {tmp / "out.map"}]\n'
+			f'%include "{src.resolve()}"\n')
+
+		res = run(['nasm', '-fbin', '-I', f'{src.resolve().parent}/', '-o',
+			tmp / 'out', wrapper])
+		if res.returncode != 0:
+			sys.exit(f'Failed to compile {src}!')
+
+		data = (tmp / 'out').read_bytes()
+		mapfile = (tmp / 'out.map').read_text()
+
+	# Section symbols look like "<real hex> <virtual hex> <name>", constants
+	# with no section only have two columns
+	labels = {}
+	for m in re.finditer(r'^\s*([0-9a-f]+)\s+[0-9a-f]+\s+(\S+)\s*$', mapfile,
+			re.MULTILINE | re.IGNORECASE):
+		labels[m.group(2)] = int(m.group(1), 16)
+
+	return data, labels
+
+
+def decode_code(data: bytes, bits: int, entry_offset: int,
+		end_offset: int|None=None) -> InsnListT:
+	'''
+	Extract the instructions of the code. Code is assumed to start at the entry
+	point and run linearly from there without JMPing around, i.e. instructions
+	are from the entry point to end_offset, or to the first RET if not given.
+	'''
+	insns = []
+	end = len(data) if end_offset is None else end_offset
+
+	for insn in Decoder(bits, data[entry_offset:end], ip=entry_offset):
+		assert not insn.is_invalid
+		insns.append(insn)
+
+		# Stop at final RET
+		if insn.mnemonic == RET and end_offset is None:
+			break
+
+	return insns
+
+
+def insn_effects(insns: InsnListT) -> list[Effects]:
+	'''
+	Dataflow analysis of the given instructions: registers, flags and memory
+	read and written by each of them.
+	'''
+	factory = InstructionInfoFactory()
+	reads_acc = (OpAccess.READ, OpAccess.COND_READ, OpAccess.READ_WRITE,
+		OpAccess.READ_COND_WRITE)
+	writes_acc = (OpAccess.WRITE, OpAccess.COND_WRITE, OpAccess.READ_WRITE,
+		OpAccess.READ_COND_WRITE)
+	ip_index = {insn.ip: k for k, insn in enumerate(insns)}
+	res = []
+
+	for insn in insns:
+		info = factory.info(insn)
+		reads, writes, mem = set(), set(), []
+
+		for used in info.used_registers():
+			reg = RegisterExt.full_register(used.register)
+
+			if used.access in reads_acc:
+				reads.add(('r', reg))
+
+			if used.access in writes_acc:
+				writes.add(('r', reg))
+
+				# Writing 8/16-bit GPRs (or conditionally writing) keeps part of
+				# the old value: count it as read too. 32-bit GPRs are
+				# zero-extended.
+				if used.access != OpAccess.WRITE or not (reg == used.register
+						or RegisterExt.is_gpr32(used.register)):
+					reads.add(('r', reg))
+
+		for bit in range(32):
+			if insn.rflags_read & (1 << bit):
+				reads.add(('f', bit))
+			if insn.rflags_modified & (1 << bit):
+				writes.add(('f', bit))
+
+		for used in info.used_memory():
+			if used.access == OpAccess.NO_MEM_ACCESS:
+				continue
+
+			base, disp = used.base, used.displacement
+			if base in (Register.RIP, Register.EIP):
+				base, disp = Register.NONE, insn.memory_displacement
+
+			# Registers used for addressing are read too
+			for reg in (base, used.index):
+				if reg != Register.NONE:
+					reads.add(('r', RegisterExt.full_register(reg)))
+
+			disp = (disp + (1 << 63)) % (1 << 64) - (1 << 63)
+			size = MemorySizeExt.size(used.memory_size)
+			key = (used.segment, base, used.index, used.scale)
+
+			if used.access in reads_acc:
+				mem.append(MemAccess(key, disp, disp + size, False))
+			if used.access in writes_acc:
+				mem.append(MemAccess(key, disp, disp + size, True))
+
+		barrier = insn.flow_control != FlowControl.NEXT
+		res.append(Effects(frozenset(reads), frozenset(writes), tuple(mem), barrier))
+
+	# Nothing can enter or leave a loop: everything from a branch target to
+	# the branch is a barrier
+	for k, insn in enumerate(insns):
+		target = ip_index.get(insn.near_branch_target) \
+			if insn.flow_control != FlowControl.NEXT else None
+
+		if target is not None:
+			for j in range(min(k, target), max(k, target) + 1):
+				res[j] = res[j]._replace(barrier=True)
+
+	return res
+
+
+def mem_conflict(effects: list[Effects], i: int, j: int) -> bool:
+	'''
+	Whether instructions i < j access memory in a way that forces their
+	relative order: one of them writes memory that the other one could also
+	access. Accesses are known to be disjoint only if they use the same
+	addressing registers, not modified in between, with disjoint ranges.
+	'''
+	for a in effects[i].mem:
+		for b in effects[j].mem:
+			if not (a.write or b.write):
+				continue
+
+			if a.key != b.key or a.start == a.end or b.start == b.end:
+				return True
+
+			_, base, index, _ = a.key
+			regs = {('r', RegisterExt.full_register(r)) for r in (base, index)
+				if r != Register.NONE}
+
+			if any(regs & effects[k].writes for k in range(i, j)):
+				return True
+
+			if a.start < b.end and b.start < a.end:
+				return True
+
+	return False
+
+
+def live_writes(effects: list[Effects]) -> set[tuple[int,tuple]]:
+	'''
+	Register and flag writes (instruction index, resource) whose value is read
+	later on, or that are the last ones: everything is live at the end.
+	'''
+	res = set()
+
+	# Things overwritten later on before being read
+	dead = set()
+
+	for k in range(len(effects) - 1, -1, -1):
+		for r in effects[k].writes - dead:
+			res.add((k, r))
+
+		dead = (dead | effects[k].writes) - effects[k].reads
+
+	return res
+
+
+def dependency_preds(effects: list[Effects]) -> list[int]:
+	'''
+	For each instruction, the bitmask of earlier instructions that it must come
+	after. Any order respecting these keeps the same dependency_graph(): reads
+	see the same writes (RAW), writes do not clobber values still to be read
+	(WAR), and live writes to the same thing stay in order (WAW). Dead writes,
+	e.g. flags set by an ADD and never read, can move around freely.
+	'''
+	live = live_writes(effects)
+	preds = []
+
+	for j, b in enumerate(effects):
+		mask = 0
+
+		for i in range(j):
+			a = effects[i]
+			waw = any((i, r) in live or (j, r) in live for r in a.writes & b.writes)
+
+			if a.barrier or b.barrier or a.writes & b.reads or a.reads & b.writes \
+					or waw or mem_conflict(effects, i, j):
+				mask |= 1 << i
+
+		preds.append(mask)
+
+	return preds
+
+
+def dependency_graph(effects: list[Effects]) -> set[tuple]:
+	'''
+	Dependency graph of a sequence of instructions as a set of edges: which
+	write (or -1 for the initial value) each read of a register or flag sees,
+	which writes are the final ones, and the order of conflicting memory
+	accesses and barriers. Two orders of the same instructions are equivalent
+	if their graphs are the same.
+	'''
+	graph = set()
+	last_write = {}
+
+	for j, b in enumerate(effects):
+		for r in b.reads:
+			graph.add(('raw', last_write.get(r, -1), j, r))
+
+		for r in b.writes:
+			last_write[r] = j
+
+		for i in range(j):
+			if effects[i].barrier or b.barrier or mem_conflict(effects, i, j):
+				graph.add(('order', i, j))
+
+	for r, i in last_write.items():
+		graph.add(('out', i, r))
+
+	return graph
+
+
+def branch_targets(insns: InsnListT) -> dict[int,int]:
+	'''
+	Near branches whose target is one of the given instructions, as a dict of
+	{branch index: target index}.
+	'''
+	ip_index = {insn.ip: k for k, insn in enumerate(insns)}
+	res = {}
+
+	for k, insn in enumerate(insns):
+		if insn.flow_control != FlowControl.NEXT and insn.op_count > 0 \
+				and insn.op0_kind in NEAR_BRANCH_KINDS \
+				and insn.near_branch_target in ip_index:
+			res[k] = ip_index[insn.near_branch_target]
+
+	return res
+
+
+class VerifyError(Exception):
+	pass
+
+
+def check(ok: bool, msg: str):
+	'''
+	Like assert, but not stripped by python -O, so that the output is always
+	verified
+	'''
+	if not ok:
+		raise VerifyError(msg)
+
+
+def verify_order(insns: InsnListT, order: list[int], ip: int, bits: int=64):
+	'''
+	Check that executing insns in the given order (indices) starting at the
+	given address is equivalent to executing them in their original order:
+	re-encode them at their new addresses, decode them again and compare
+	dependency graphs.
+
+	Branches are matched to their targets by index, not by address: after
+	apply_replacements() the instructions following a shorter replacement keep
+	their old addresses, so the new addresses of all of them (and of the
+	branch targets) are recomputed here. Raises VerifyError if they are not.
+	'''
+	encoder = Encoder(bits)
+	code = bytearray()
+	targets = branch_targets(insns)
+	new_ip = dict(zip(order, accumulate((len(insns[k]) for k in order), initial=ip)))
+
+	for k in order:
+		insn = insns[k]
+
+		if k in targets:
+			insn = insn.copy()
+			setattr(insn, NEAR_BRANCH_KINDS[insn.op0_kind], new_ip[targets[k]])
+
+		size = encoder.encode(insn, ip + len(code))
+		check(size == len(insns[k]), f'{insns[k]} changed size when moved')
+		code += encoder.take_buffer()
+
+	new = list(Decoder(bits, bytes(code), ip=ip))
+	check(len(new) == len(order), 'Wrong number of instructions after reordering!')
+
+	for k, insn in zip(order, new):
+		check(insn.code == insns[k].code, f'{insns[k]} re-decoded as {insn}')
+		if k not in targets:
+			check(str(insn) == str(insns[k]), f'{insns[k]} re-decoded as {insn}')
+
+	# Branches must still land on the same instructions
+	new_targets = branch_targets(new)
+	check({order[j]: order[t] for j, t in new_targets.items()} == targets,
+		'Branch targets changed after reordering!')
+
+	old_graph = dependency_graph(insn_effects(insns))
+
+	def remap(edge):
+		return tuple(order[x] if isinstance(x, int) and x >= 0 else x
+			for x in edge)
+
+	new_graph = set(map(remap, dependency_graph(insn_effects(new))))
+	check(new_graph == old_graph, 'Dependency graph mismatch after reordering!')
+
+
+def find_label(lines: list[str], label: str) -> int:
+	'''
+	Index of the line defining the given label
+	'''
+	for i, line in enumerate(lines):
+		m = LABEL_DEF_RE.match(line)
+		if m and m.group(1) == label:
+			return i
+
+	sys.exit(f'Label {label} not found in the source!')
+
+
+def map_source(lines: list[str], entry_label: str, insns: InsnListT) \
+		-> list[SrcInsn]:
+	'''
+	Find the source line of each instruction, assuming that the code after the
+	entry label is written one instruction per line in the same order as it was
+	decoded. Local labels (.name) are made absolute (scope.name) both in
+	definitions and references so that the code can be moved around freely.
+	'''
+	res = []
+	scope = entry_label
+	labels = []
+	i = find_label(lines, entry_label)
+
+	while len(res) < len(insns):
+		i += 1
+		if i >= len(lines):
+			sys.exit('Source ended before all the instructions were found!')
+
+		code, _, comment = lines[i].partition(';')
+		code = code.strip()
+		m = LABEL_DEF_RE.match(code)
+
+		if m is not None:
+			name = m.group(1)
+			if name.startswith('.'):
+				name = scope + name
+			else:
+				scope = name
+
+			labels.append(name)
+			code = code[m.end():].strip()
+
+		if not code:
+			continue
+
+		# Allow a prefix (e.g. REP) before the mnemonic
+		insn = insns[len(res)]
+		if MNEMONIC_NAMES[insn.mnemonic] not in code.lower().split()[:2]:
+			sys.exit(f'Line {i + 1} of the source does not match decoded '
+				f'instruction {insn}, only one instruction per line is supported!')
+
+		text = LOCAL_REF_RE.sub(scope + '.', code)
+		if comment.strip():
+			text = f'{text:40s} ; {comment.strip()}'
+
+		res.append(SrcInsn(i, text, labels))
+		labels = []
+
+	return res
+
+
+def emit_source(lines: list[str], src_name: str, layout: Layout,
+		entry_label: str, srcmap: dict[int,SrcInsn], schedule: ScheduleT,
+		hang: bool) -> str:
+	'''
+	Write NASM source for the given schedule: the original source with the code
+	of each chunk moved in the corresponding hole, followed by a JMP (short or
+	near, as planned) to the next chunk. The first chunk goes at the entry
+	point, immediately followed by the last one (AHEAD label). If hang is
+	True, the code ends with an infinite loop. Holes need to be labels.
+	'''
+	# Line ranges to replace with code, as (first, last + 1, chunk index)
+	ranges = []
+
+	for k, (chunk, _) in enumerate(schedule[1:-1], 1):
+		start = find_label(lines, chunk.name) + 1
+		end = start
+
+		while end < len(lines) and not re.search(pad_regex(chunk.name), lines[end]):
+			end += 1
+
+		if end == len(lines):
+			sys.exit(f'Cannot find the padding after hole {chunk.name}!')
+
+		ranges.append((start, end, k))
+
+	# Everything from the entry label to the end of the code, including the
+	# skipped prolog and epilog
+	last = max(src.lineno for src in srcmap.values())
+	ranges.append((find_label(lines, entry_label) + 1, last + 1, 0))
+
+	def code(k: int) -> list[str]:
+		chunk, insns = schedule[k]
+		res = []
+
+		for insn in insns:
+			src = srcmap[id(insn)]
+			res.extend(f'{label}:' for label in src.labels)
+			res.append(f'    {src.text}')
+
+		if k < len(schedule) - 1:
+			nxt = schedule[k + 1][0]
+			target = 'AHEAD' if k + 1 == len(schedule) - 1 else nxt.name
+			kind = 'short' if chunk_jmp_size(chunk, nxt) == 2 else 'near'
+			res.append(f'    jmp    {kind} {target}')
+
+		return res
+
+	out = list(lines)
+
+	for start, end, k in sorted(ranges, reverse=True):
+		new = code(k)
+		if k == 0:
+			new += ['AHEAD:'] + code(len(schedule) - 1)
+			if hang:
+				new.append('    jmp    $')
+
+		out[start:end] = new
+
+	header = [f'; Generated by minimize.py from {src_name}, do not edit.',
+		f'; {layout.fmt.upper()} layout, {len(layout.chunks)} holes.', ';']
+	return '\n'.join(header + out) + '\n'
+
+
+def verify_packed(data: bytes, bits: int, entry_offset: int,
+		schedule: ScheduleT, insns: InsnListT):
+	'''
+	Check that the code of a packed binary, starting at the entry point and
+	following the JMPs between chunks, matches the given schedule: same
+	instructions with the same registers and size (addresses can change), same
+	JMP sizes, and branches still targeting the same instructions. Raises
+	VerifyError if it does not.
+	'''
+	ip = entry_offset
+	new_ip = {}
+	stream = []
+
+	def decode(ip: int) -> Instruction:
+		insn = next(Decoder(bits, data[ip:ip + 15], ip=ip))
+		check(not insn.is_invalid, f'Invalid instruction at {ip:#x}')
+		return insn
+
+	def regs(insn: Instruction) -> list[int]:
+		return [insn.op_register(i) for i in range(insn.op_count)]
+
+	for k, (chunk, chunk_insns) in enumerate(schedule):
+		for old in chunk_insns:
+			new = decode(ip)
+			check(new.code == old.code and len(new) == len(old)
+				and regs(new) == regs(old),
+				f'{chunk.name}: expected {old} at {ip:#x}, found {new}')
+
+			new_ip[old.ip] = ip
+			stream.append((old, new))
+			ip += len(new)
+
+		if k < len(schedule) - 1:
+			jmp = decode(ip)
+			check(jmp.mnemonic == JMP, f'{chunk.name}: expected JMP at {ip:#x}, found {jmp}')
+			check(len(jmp) == chunk_jmp_size(chunk, schedule[k + 1][0]),
+				f'{chunk.name}: JMP at {ip:#x} has unexpected size')
+			ip = jmp.near_branch_target
+
+	# Branches inside the code must still land on the same instructions
+	orig_ips = {insn.ip for insn in insns}
+
+	for old, new in stream:
+		if old.flow_control != FlowControl.NEXT and old.near_branch_target in orig_ips:
+			check(new.near_branch_target == new_ip[old.near_branch_target],
+				f'{new} at {new.ip:#x} branches to the wrong place')
+
+
+def solve_naive(insns: InsnListT, chunks: tuple[Chunk, ...], cur_chunk: Chunk,
 		cost: int=0, min_cost: float=float('inf'), schedule: ScheduleT=[]) \
 			-> tuple[ScheduleT,int]:
 	'''
 	Find an order for the given chunks and assign instructions to fill them such
 	the amount of space wasted due to non-short JMPs and chunks not being
 	completely filled with instructions is minimal.
+
+	This is the original plain recursive search, exploring all the orders of
+	the chunks, kept as reference for solve() (see minimize_bench.py).
 	'''
 	if not chunks:
 		# Done, last chunks takes all remaining instructions
@@ -113,8 +814,8 @@ def solve(insns: InsnListT, chunks: tuple[Chunk, ...], cur_chunk: Chunk,
 		new_schedule = schedule + [(cur_chunk, cur_chunk_insns)]
 		rem_chunks = chunks[:i] + chunks[i + 1:]
 
-		final_schedule, final_cost = solve(rem_insns, rem_chunks, next_chunk,
-			new_cost, min_cost, new_schedule)
+		final_schedule, final_cost = solve_naive(rem_insns, rem_chunks,
+			next_chunk, new_cost, min_cost, new_schedule)
 
 		if final_cost < min_cost:
 			min_cost = final_cost
@@ -129,116 +830,761 @@ def solve(insns: InsnListT, chunks: tuple[Chunk, ...], cur_chunk: Chunk,
 	return best_schedule, min_cost
 
 
-def minimize(insns: InsnListT, chunks: tuple[Chunk,...], entry_offset: int) \
-		-> tuple[int,tuple[Chunk,...],list[InsnListT]]:
+def solve(insns: InsnListT, chunks: tuple[Chunk, ...], cur_chunk: Chunk,
+		max_cost: float=float('inf'), preds: list[int]|None=None,
+		window: int=0, model: CostModel=SIZE_COST, max_holes: int|None=None) \
+			-> tuple[ScheduleT|None,float]:
+	'''
+	Same as solve_naive(), but see solve_indices()
+	'''
+	schedule, cost = solve_indices(list(map(len, insns)), chunks, cur_chunk,
+		max_cost, preds, window, model, max_holes)
+	return remap_schedule(schedule, insns), cost
+
+
+def solve_indices(sizes: list[int], chunks: tuple[Chunk, ...],
+		cur_chunk: Chunk, max_cost: float=float('inf'),
+		preds: list[int]|None=None, window: int=0,
+		model: CostModel=SIZE_COST, max_holes: int|None=None) \
+			-> tuple[list[tuple[Chunk,list[int]]]|None,float]:
+	'''
+	Find the best schedule for instructions of the given sizes, as instruction
+	indices. Same as solve_naive(), but as a memoized branch-and-bound search: the cost
+	to go only depends on the set of chunks already used, the set of
+	instructions already placed and the current chunk, so each of these states
+	is solved once. Only schedules costing less than max_cost are looked for:
+	if there is none, the returned cost is a lower bound >= max_cost and the
+	schedule is None.
+
+	Without preds, instructions are kept in order and the placed ones are
+	always a prefix. With preds (see dependency_preds()), instructions up to
+	window positions after the first one not yet placed can also be moved
+	ahead of it, as long as all their dependencies are already placed, to
+	better fill the chunks.
+
+	The cost is the wasted bytes times model.byte, plus model.jump for each
+	JMP between chunks and model.line for each instruction crossing a fetch
+	line (weights must be non-negative integers). Holes can be left unused,
+	wasting all their space (but the one of a JMP), if model.jump is not 0 or
+	if at most max_holes of them can be used.
+	'''
+	# Index 0 is the current (ENTRY) chunk, the last one is the final (AHEAD)
+	# chunk, the ones in between are holes, which have a bit in the state mask
+	all_chunks = (cur_chunk,) + chunks
+	last = len(all_chunks) - 1
+	holes = range(1, last)
+	inf = float('inf')
+
+	n_insns = len(sizes)
+	all_placed = (1 << n_insns) - 1
+	reorder = preds is not None and window > 1
+	can_skip = model.jump != 0 or max_holes is not None
+
+	# prefix[i] = size of the first i instructions
+	prefix = [0] + list(accumulate(sizes))
+
+	def fill(i: int, avail: int) -> tuple[int,int]:
+		# Same as take_insns(insns[i:], avail), but absolute and O(log n)
+		j = bisect_right(prefix, prefix[i] + avail, i) - 1
+		return j, avail - (prefix[j] - prefix[i])
+
+	def first_unplaced(placed: int) -> int:
+		return (~placed & (placed + 1)).bit_length() - 1
+
+	def placed_size(placed: int) -> int:
+		# Everything before the first unplaced instruction is placed, the rest
+		# is within the window
+		i = first_unplaced(placed)
+		res = prefix[i]
+		placed >>= i
+
+		while placed:
+			low = placed & -placed
+			res += sizes[i + low.bit_length() - 1]
+			placed ^= low
+
+		return res
+
+	# Extra bytes of the JMP from the end of chunk a to the start of chunk b
+	def extra_row(a: int) -> list[int]:
+		return [chunk_jmp_size(all_chunks[a], b) - 2 for b in all_chunks]
+
+	# Once out of ENTRY, the search only depends on it through the JMPs to
+	# AHEAD (and the fetch lines of AHEAD, if they count), which are the same
+	# for most ENTRY sizes. Calls solving the same problem after ENTRY (see
+	# minimize()) share what they learn about it: memo, fills, lower bounds and
+	# JMPs between holes. Start over once too many states are memoized.
+	to_last = tuple(chunk_jmp_size(all_chunks[a], all_chunks[last]) - 2 for a in holes)
+	context = (tuple(sizes), all_chunks[1:last], to_last,
+		all_chunks[last].offset % FETCH_LINE if model.line else None,
+		None if preds is None else tuple(preds), window, model, max_holes)
+
+	if sum(len(shared[0]) for shared in _shared.values()) > MEMO_MAX_STATES:
+		_shared.clear()
+
+	memo, fill_cache, hole_least, hole_extra = \
+		_shared.setdefault(context, ({}, {}, {}, []))
+
+	if not hole_extra:
+		hole_extra.extend(map(extra_row, holes))
+
+	# AHEAD is never left, it has no row
+	extra = [extra_row(0)] + hole_extra
+
+	# ENTRY is only ever the current chunk of the initial state
+	memo.pop((0, 0, 0), None)
+
+	def fills(placed: int, avail: int) -> list[tuple[int,int]]:
+		# All the ways to fill avail bytes starting from the given placed set,
+		# as (wasted bytes, new placed set). Only maximal ones are considered:
+		# if another instruction could still fit, it goes in
+		if not reorder:
+			i = first_unplaced(placed)
+			j, rem = fill(i, avail)
+			return [(rem, (1 << j) - 1)]
+
+		key = (placed, avail)
+		res = fill_cache.get(key)
+		if res is not None:
+			return res
+
+		i = first_unplaced(placed)
+		cand = [k for k in range(i, min(n_insns, i + window))
+			if not placed & (1 << k)]
+		res = []
+
+		def ready(k: int, cur: int) -> bool:
+			return not cur & (1 << k) and not preds[k] & ~cur
+
+		# Dependencies always come earlier in the original order, so adding
+		# candidates in increasing order visits each placed set exactly once
+		def dfs(pos: int, cur: int, space: int):
+			for idx in range(pos, len(cand)):
+				k = cand[idx]
+				if sizes[k] <= space and ready(k, cur):
+					dfs(idx + 1, cur | (1 << k), space - sizes[k])
+
+			if not any(sizes[k] <= space and ready(k, cur) for k in cand):
+				res.append((space, cur))
+
+		dfs(0, placed, avail)
+		res.sort()
+		fill_cache[key] = res
+		return res
+
+	# Least cost of chunk a, for any next chunk: when reordering, instructions
+	# can fill chunks in many ways, so only count the JMP. Holes that can be
+	# skipped cost at most their space. Only the one of ENTRY changes between
+	# calls.
+	def least_cost(a: int) -> float:
+		res = min((e for e in extra[a][1:] if e <= all_chunks[a].size - 2), default=inf)
+		if can_skip and a != 0:
+			res = min(res, all_chunks[a].size - 2)
+
+		return res
+
+	if not hole_least:
+		hole_least.update((a, least_cost(a)) for a in holes)
+
+	least = [least_cost(0)] + [hole_least[a] for a in holes]
+
+	# Chunks each chunk can reach with a short JMP, and chunks that can reach
+	# each chunk with one, as bitmasks
+	short_to = [sum(1 << b for b in range(1, last + 1) if b != a and not extra[a][b])
+		for a in range(last)]
+	short_from = [sum(1 << a for a in range(last) if a != b and not extra[a][b])
+		for b in range(last + 1)]
+
+	def reorder_bound(mask: int, placed: int, cur: int) -> float:
+		# The current chunk and each unused hole cost at least their least
+		# cost. Also, the cost of a chunk is its size minus 2 minus the size of
+		# the instructions in it, so whatever the remaining instructions cannot
+		# fill is wasted too.
+		res = least[cur]
+		space = all_chunks[cur].size - 2
+
+		for h in holes:
+			if not mask & (1 << h):
+				res += least[h]
+				space += all_chunks[h].size - 2
+
+		res = max(res, space - (prefix[n_insns] - placed_size(placed)))
+		return model.byte * res + model.jump
+
+	def bound(mask: int, placed: int, cur: int, deep: bool=False) -> float:
+		# Admissible lower bound of the cost to go. Without reordering, it is
+		# the space of the chunks left minus the size of the instructions
+		# placed in them, which are the ones up to where the last chunk ends.
+		# The current chunk ends where filling it ends, depending on whether
+		# its JMP is short or long (3 more bytes). The others end at best on
+		# the last instruction within their space minus their JMPs: a chunk
+		# with no short JMP to any chunk left needs a long one, if it fits,
+		# and without skipping holes, so does each hole left (and AHEAD) with
+		# no short JMP from any chunk left. Skipped holes waste their space.
+		# With deep, which takes longer, the last hole before AHEAD ends at
+		# best on the last instruction within its space after the others end.
+		if reorder:
+			return reorder_bound(mask, placed, cur)
+
+		unused = [h for h in holes if not mask & (1 << h)]
+		left = sum(1 << h for h in unused) | (1 << cur)
+		targets = (left & ~(1 << cur)) | (1 << last)
+		space = 0
+		out_extras = []
+
+		for h in unused:
+			space += all_chunks[h].size - 2
+			e = 0
+			if not short_to[h] & targets:
+				e = 3 if all_chunks[h].size >= 5 else inf
+				if can_skip:
+					e = min(e, all_chunks[h].size - 2)
+			out_extras.append(e)
+
+		out_extra = sum(out_extras)
+		if out_extra == inf:
+			return inf
+
+		in_extra = 0
+		if not can_skip:
+			in_extra = 3 * sum(not short_from[h] & left for h in unused + [last])
+
+		i = first_unplaced(placed)
+		size = all_chunks[cur].size
+		reach = -1
+
+		for e, ok in ((0, short_to[cur] & targets), (3, True)):
+			if not ok or size - 2 - e < 0:
+				continue
+
+			j, _ = fill(i, size - 2 - e)
+			k, _ = fill(j, max(0, space - max(out_extra, in_extra - e)))
+			end = prefix[k]
+
+			if deep and unused and end > reach:
+				best = prefix[j]
+
+				for h, out in zip(unused, out_extras):
+					avail = all_chunks[h].size - 2 - extra[h][last]
+					if avail < 0:
+						continue
+
+					others = max(out_extra - out, in_extra - e - extra[h][last])
+					k, _ = fill(j, max(0, space - (all_chunks[h].size - 2) - others))
+					k, _ = fill(k, avail)
+					best = max(best, prefix[k])
+					if best >= end:
+						break
+
+				end = best
+
+			reach = max(reach, end)
+
+		if reach < 0:
+			return inf
+
+		return model.byte * (prefix[i] + size - 2 + space - reach) + model.jump
+
+	def search(mask: int, placed: int, cur: int, budget: float) -> float:
+		# Returns the exact cost to go if < budget, otherwise a lower bound of
+		# it which is >= budget
+		if cur == last:
+			return 0
+
+		key = (mask, placed, cur)
+		known = memo.get(key)
+		if known is not None and (known[1] or known[0] >= budget):
+			return known[0]
+
+		lb = bound(mask, placed, cur)
+		if known is not None:
+			lb = max(lb, known[0])
+		elif lb < budget:
+			lb = bound(mask, placed, cur, True)
+
+		if lb >= budget:
+			# No need to remember what bound() tells anyway
+			if known is not None:
+				memo[key] = (lb, False, -1, -1)
+			return lb
+
+		# Cheapest moves first, to find good schedules (and cut more) early
+		unused = [h for h in holes if not mask & (1 << h)]
+		if max_holes is not None and len(holes) - len(unused) >= max_holes:
+			nexts = [last]
+		else:
+			nexts = unused + [last] if can_skip or not unused else unused
+
+		moves = []
+
+		for nxt in nexts:
+			avail = all_chunks[cur].size - extra[cur][nxt] - 2
+			if avail < 0:
+				continue
+
+			for rem, new_placed in fills(placed, avail):
+				cost = model.byte * (extra[cur][nxt] + rem) + model.jump
+
+				if nxt == last:
+					# Unused holes only hold a JMP at best
+					cost += model.byte * sum(all_chunks[h].size - 2 for h in unused)
+
+				if model.line:
+					chunk_sizes = [sizes[k] for k in bits_to_indices(new_placed & ~placed)]
+					cost += model.line * line_crossings(all_chunks[cur].offset,
+						chunk_sizes + [extra[cur][nxt] + 2])
+
+					if nxt == last:
+						last_sizes = [sizes[k] for k in bits_to_indices(all_placed & ~new_placed)]
+						cost += model.line * line_crossings(all_chunks[last].offset,
+							last_sizes)
+
+				moves.append((cost, nxt, new_placed))
+
+		moves.sort()
+		best, best_next, best_placed = inf, -1, -1
+
+		for cost, nxt, new_placed in moves:
+			limit = min(budget, best)
+			if cost >= limit:
+				# This and the following moves cost at least this much
+				best = min(best, cost)
+				break
+
+			sub = cost + search(mask | (1 << nxt), new_placed, nxt, limit - cost)
+			if sub < best:
+				best, best_next, best_placed = sub, nxt, new_placed
+				if best <= lb:
+					break
+
+		memo[key] = (best, best < budget, best_next, best_placed)
+		return best
+
+	# Iterative deepening: look for a schedule costing 0, then 1 and so on (or
+	# rather, up to the lower bound found by the previous failed attempt). Tight
+	# budgets cut most of the search, and lower bounds learned in the memo
+	# carry over to the next attempt.
+	budget = 1
+	cost = inf
+
+	while budget <= max_cost:
+		cost = search(0, 0, 0, budget)
+		if cost < budget or cost == inf:
+			break
+
+		budget = cost + 1
+
+	if cost >= max_cost or cost == inf:
+		return None, cost
+
+	# Follow the best moves to rebuild the schedule. Instructions in the same
+	# chunk keep their original relative order.
+	schedule = []
+	mask, placed, cur = 0, 0, 0
+
+	while cur != last:
+		_, _, nxt, new_placed = memo[mask, placed, cur]
+		schedule.append((all_chunks[cur], bits_to_indices(new_placed & ~placed)))
+		mask, placed, cur = mask | (1 << nxt), new_placed, nxt
+
+	schedule.append((all_chunks[last], bits_to_indices(all_placed & ~placed)))
+	return schedule, cost
+
+
+def bits_to_indices(bits: int) -> list[int]:
+	'''
+	Indices of the bits set in the given bitmask, in increasing order
+	'''
+	return [k for k in range(bits.bit_length()) if bits & (1 << k)]
+
+
+def schedule_to_indices(schedule: ScheduleT|None) \
+		-> list[tuple[Chunk,list[int]]]|None:
+	'''
+	Replace the instructions in a schedule that keeps them in their original
+	order (e.g. from solve_naive()) with their indices
+	'''
+	if schedule is None:
+		return None
+
+	res = []
+	i = 0
+
+	for chunk, chunk_insns in schedule:
+		res.append((chunk, list(range(i, i + len(chunk_insns)))))
+		i += len(chunk_insns)
+
+	return res
+
+
+def remap_schedule(schedule: list[tuple[Chunk,list[int]]]|None,
+		insns: InsnListT) -> ScheduleT|None:
+	'''
+	Replace the instruction indices in a schedule with the instructions in insns
+	'''
+	if schedule is None:
+		return None
+
+	return [(chunk, [insns[k] for k in idx]) for chunk, idx in schedule]
+
+
+# Smallest ENTRY size with a schedule within the budget being tried, shared
+# among minimize() workers
+_found = None
+
+# Most states solve_indices() keeps memoized across calls
+MEMO_MAX_STATES = 1 << 20
+
+# What solve_indices() learned about the states after ENTRY, for each context
+# (see solve_indices()): (memo, fill cache, waste rows, least costs of the
+# holes, JMP sizes from the holes). The memo maps states to (cost to go,
+# exact?, next chunk, next placed set).
+_shared = {}
+
+
+def _init_worker(found):
+	global _found
+	_found = found
+
+
+def _solve_entry(insns: InsnListT, chunks: tuple[Chunk,...], entry_offset: int,
+		entry_size: int, naive: bool, preds: list[int]|None, window: int,
+		model: CostModel, max_holes: int|None, max_cost: float) \
+			-> tuple[list[tuple[Chunk,list[int]]]|None,float]:
+	'''
+	Solve for the given ENTRY chunk size, only looking for schedules costing
+	less than max_cost (see solve_indices()). Skip the search entirely if a
+	smaller ENTRY size already has one. The schedule is returned as
+	instruction indices (see remap_schedule()).
+	'''
+	entry_chunk = Chunk('ENTRY', entry_offset, entry_size)
+
+	# Final (AHEAD) chunk will be after ENTRY and last in the schedule
+	final_chunk = Chunk('AHEAD', entry_offset + entry_size, 0xffffffff)
+	chunks = chunks + (final_chunk,)
+
+	if naive:
+		schedule, cost = solve_naive(insns, chunks, entry_chunk)
+		return schedule_to_indices(schedule), cost
+
+	if _found is not None and _found.value < entry_size:
+		return None, max_cost
+
+	schedule, cost = solve_indices(list(map(len, insns)), chunks, entry_chunk,
+		max_cost, preds, window, model, max_holes)
+
+	if _found is not None and schedule is not None:
+		with _found.get_lock():
+			_found.value = min(_found.value, entry_size)
+
+	return schedule, cost
+
+
+def minimize(insns: InsnListT, chunks: tuple[Chunk,...], entry_offset: int,
+		jobs: int=1, naive: bool=False, verbose: bool=True,
+		preds: list[int]|None=None, window: int=0, model: CostModel=SIZE_COST,
+		max_holes: int|None=None) -> ScheduleT:
 	'''
 	Find the best size for the ENTRY chunk and the best order for the subsequent
 	chunks to minimize the amount of space wasted due to non-short JMPs and
-	chunks not being completely filled with instructions.
+	chunks not being completely filled with instructions. ENTRY sizes are
+	solved independently, spread over jobs worker processes (at most one per
+	CPU core). With naive=True use solve_naive() sequentially instead. With
+	preds and window, also move independent instructions around to fill the
+	chunks, and with model and max_holes minimize a different cost (see
+	solve_indices()). Among the best schedules, the one with the smallest ENTRY
+	chunk wins, whatever the number of jobs.
 	'''
-	min_cost = float('inf')
 	best_schedule: ScheduleT|None = None
+	entry_sizes = range(sum(map(len, insns)))
+	jobs = max(1, min(jobs, cpu_count() or 1))
+
+	if verbose:
+		print(f'Need to schedule {len(insns)} instructions')
+		print('Solving... ', end='', flush=True)
 
-	print(f'Need to schedule {len(insns)} instructions')
-	print('Solving... ', end='', flush=True)
+	if naive:
+		results = [_solve_entry(insns, chunks, entry_offset, size, True, preds,
+			window, model, max_holes, float('inf')) for size in entry_sizes]
 
-	# Try any possible sizes for the ENTRY chunk
-	for entry_size in range(sum(map(len, insns))):
-		entry_chunk = Chunk('ENTRY', entry_offset, entry_size)
+		# Cheapest first, then smallest ENTRY
+		candidates = sorted((cost, size) for size, (schedule, cost) in
+			zip(entry_sizes, results) if schedule is not None)
+		if candidates:
+			best_schedule = remap_schedule(results[candidates[0][1]][0], insns)
+	else:
+		found = Value('q', len(entry_sizes))
+		pool = None
 
-		# Final (AHEAD) chunk will be after ENTRY and last in the schedule
-		final_chunk = Chunk('AHEAD', entry_offset + entry_size, 0xffffffff)
+		if jobs > 1:
+			# Workers only need instruction sizes: send them bytes objects of
+			# the same lengths, they send back instruction indices
+			pool = ProcessPoolExecutor(jobs, initializer=_init_worker, initargs=(found,))
+			blobs = [bytes(len(insn)) for insn in insns]
+		else:
+			_init_worker(found)
 
-		schedule, cost = solve(insns, chunks + (final_chunk,), entry_chunk)
-		if cost < min_cost:
-			min_cost = cost
-			best_schedule = schedule
+		# Iterative deepening over all the ENTRY sizes at once: look for a
+		# schedule costing 0 with any of them, then 1 and so on (or rather, up
+		# to the least lower bound found by the previous failed attempt). No
+		# ENTRY size is searched past the best cost, and the first one (the
+		# smallest) with a schedule within the budget wins.
+		budget = 1
 
-		# Stop at the first optimal solution found. This corresponds to the case
-		# where all chunks are completely filled with instructions and all the
-		# JMPs are 2-byte short JMPs.
-		if cost == 0:
-			break
+		while best_schedule is None and budget < float('inf'):
+			found.value = len(entry_sizes)
+			n = len(entry_sizes)
+
+			if pool is None:
+				results = (_solve_entry(insns, chunks, entry_offset, size, False,
+					preds, window, model, max_holes, budget) for size in entry_sizes)
+			else:
+				results = pool.map(_solve_entry, [blobs] * n, [chunks] * n,
+					[entry_offset] * n, entry_sizes, [False] * n, [preds] * n,
+					[window] * n, [model] * n, [max_holes] * n, [budget] * n,
+					chunksize=max(1, n // (jobs * 8)))
+
+			least = float('inf')
+
+			for schedule, cost in results:
+				if schedule is not None:
+					best_schedule = remap_schedule(schedule, insns)
+					break
+
+				least = min(least, cost)
+
+			budget = least + 1
+
+		if pool is not None:
+			pool.shutdown(cancel_futures=True)
+
+		_init_worker(None)
+		_shared.clear()
+
+	if verbose:
+		print('done!')
 
-	print('done!')
 	assert best_schedule is not None
 	return best_schedule
 
 
+def pareto_front(insns: InsnListT, chunks: tuple[Chunk,...], entry_offset: int,
+		data_sz: int, jobs: int=1, preds: list[int]|None=None, window: int=0,
+		model: CostModel=SIZE_COST) -> list[tuple[int,RuntimeCost,ScheduleT]]:
+	'''
+	Find the best schedule (see minimize()) using at most 0, 1, 2, ... of the
+	holes: each hole skipped saves a taken JMP but makes the file bigger.
+	Return the (file size, run time estimate, schedule) that are not worse in
+	both file size and estimated cycles than any other, smallest file first.
+	'''
+	points = []
+
+	for max_holes in range(len(chunks) + 1):
+		schedule = minimize(insns, chunks, entry_offset, jobs, verbose=False,
+			preds=preds, window=window, model=model, max_holes=max_holes)
+		points.append((file_size(schedule, entry_offset, data_sz),
+			runtime_cost(schedule), schedule))
+
+	front = []
+
+	for point in sorted(points, key=lambda p: (p[0], p[1].cycles)):
+		if not front or point[1].cycles < front[-1][1].cycles:
+			front.append(point)
+
+	return front
+
+
+def parse_weights(arg: str) -> CostModel:
+	try:
+		model = CostModel(*map(int, arg.split(',')))
+	except (TypeError, ValueError):
+		raise ValueError(f'Invalid weights: {arg}')
+
+	# The solver prunes on partial costs, which only works if they never go down
+	if any(w < 0 for w in model):
+		raise ValueError(f'Invalid weights: {arg}')
+
+	return model
+
+
 def main():
-	src = (ASM_DIR / ASM_SOURCE)
-	app = (ASM_DIR / EFI_BINARY)
+	ap = ArgumentParser(description='Find the best way to pack the code of a '
+		'NASM source into PE or ELF header holes')
+	ap.add_argument('source', type=Path, nargs='?', default=ASM_DIR / ASM_SOURCE,
+		help=f'NASM source to pack (default: {ASM_DIR / ASM_SOURCE})')
+	ap.add_argument('-l', '--layout', type=Path,
+		help='file describing the holes (see load_layout()), by default they '
+			'are detected from the labels in the source')
+	ap.add_argument('--holes', default=r'HOLE\d+', metavar='REGEX',
+		help=r'labels of the holes to detect (default: HOLE\d+)')
+	ap.add_argument('--entry', default='ENTRY', metavar='LABEL',
+		help='label of the code to pack (default: ENTRY)')
+	ap.add_argument('--end', metavar='LABEL',
+		help='label of the end of the code to pack (default: first RET)')
+	ap.add_argument('-j', '--jobs', type=int, default=cpu_count() or 1,
+		help='worker processes for the search (default and max: number of CPU cores)')
+	ap.add_argument('--naive', action='store_true',
+		help='use the original exhaustive search (slow, for reference)')
+	ap.add_argument('-w', '--window', type=int, default=8,
+		help='move independent instructions up to this many positions ahead '
+			'to fill holes, 0 to keep the original order (default: 8)')
+	ap.add_argument('--weights', type=parse_weights, default=SIZE_COST,
+		metavar='B,J,L', help='non-negative integer weights of wasted bytes, taken JMPs and '
+			'instructions crossing a 16-byte fetch line in the cost to minimize '
+			'(default: 1,0,0, only the file size)')
+	ap.add_argument('--pareto', action='store_true',
+		help='find the best layouts using at most 0, 1, 2, ... holes and print '
+			'the ones with the best trade-offs between file size and estimated '
+			'run time, instead of a single best layout')
+	ap.add_argument('--pick', type=int, default=0, metavar='N',
+		help='layout of the Pareto front to use for the output, 0 is the '
+			'smallest (default: 0)')
+	ap.add_argument('-S', '--superopt', action='store_true',
+		help='first replace instruction sequences with shorter equivalent ones '
+			'found by superopt.py')
+	ap.add_argument('-o', '--output', type=Path, metavar='ASM',
+		help='write the packed NASM source here, then build it with the '
+			'Makefile in its directory (or above) and check the result')
+	args = ap.parse_args()
+
+	if args.naive and (args.pareto or args.weights != SIZE_COST):
+		sys.exit('The naive solver only minimizes the file size!')
+
+	src = args.source
 
 	if not src.is_file():
 		print(f'{src} not found!', file=sys.stderr)
 		sys.exit('You are not launching this scipt from the right directory!')
 
-	# Compile the binary
-	if system(f'make -C {ASM_DIR} {EFI_BINARY}') != 0:
-		sys.exit(f'Failed to compile {src}!')
+	# Compile the binary and find out where the holes are
+	data, labels = assemble(src)
+	fmt, bits = binary_layout(data)
 
-	# Load the file and extract all the instructions. Code is assumed to start
-	# at the ENTRY label and run linearly from there without JMPing around, i.e.
-	# instructions are from ENTRY to the end of the file.
-	data = app.read_bytes()
-	insns = []
+	if args.layout is not None:
+		layout = load_layout(args.layout, fmt, bits)
+	else:
+		layout = detect_layout(src, labels, fmt, bits, args.holes, args.entry)
 
-	for insn in Decoder(64, data[ENTRY_OFFSET:], ip=ENTRY_OFFSET):
-		assert not insn.is_invalid
-		insns.append(insn)
+	entry_offset, chunks = layout.entry_offset, layout.chunks
+	print(f'{layout.fmt.upper()} layout, {layout.bits}-bit code, '
+		f'{len(chunks)} holes, entry at {entry_offset:#x}')
 
-		# Stop at final RET
-		if insn.mnemonic == RET:
-			break
+	end_offset = None
+	if args.end is not None:
+		if args.end not in labels:
+			sys.exit(f'End label {args.end} not found in {src}!')
+		end_offset = labels[args.end]
 
+	insns = decode_code(data, layout.bits, entry_offset, end_offset)
 	print(f'Parsed {len(insns)} instructions')
+	all_insns = insns
 
-	# We don't care about the prolog, skip initial PUSHs and SUB ESP,xxx.
-	for i, insn in enumerate(insns):
-		if insns[i].mnemonic not in (SUB, PUSH):
-			break
+	# Whatever follows the code is data to embed in the file
+	data_sz = len(data) - (insns[-1].ip + len(insns[-1]))
 
-	print(f'Ignoring prolog of {i} instructions')
-	insns = insns[i:]
+	# UEFI apps return to the firmware like normal functions, but we don't
+	# care about that: skip the prolog and epilog
+	if layout.fmt == 'pe':
+		# Skip initial PUSHs and SUB ESP,xxx.
+		for i, insn in enumerate(insns):
+			if insns[i].mnemonic not in (SUB, PUSH):
+				break
 
-	# We don't care about the epilog, skip final ADD ESP,xxx, POPs and RET
-	for i in range(len(insns) - 1, -1, -1):
-		if insns[i].mnemonic not in (ADD, POP, RET):
-			break
+		print(f'Ignoring prolog of {i} instructions')
+		insns = insns[i:]
+
+		# Skip final ADD ESP,xxx, POPs and RET
+		for i in range(len(insns) - 1, -1, -1):
+			if insns[i].mnemonic not in (ADD, POP, RET):
+				break
+
+		print(f'Ignoring epilog of {len(insns) - (i + 1)} instructions')
+		insns = insns[:i + 1]
+
+	# Bytes of the instructions, including the ones added below
+	raw = {id(insn): data[insn.ip:insn.ip + len(insn)] for insn in insns}
+	replaced = []
+
+	if args.superopt:
+		from superopt import apply_replacements, superoptimize
+
+		print('Looking for shorter sequences:')
+		repls = superoptimize(insns, layout.bits, verbose=True)
+		new_insns, applied = apply_replacements(insns, repls, layout.bits)
+
+		for r, new in applied:
+			replaced.append((insns[r.start:r.end], r.ops, new))
+			offs = list(accumulate(map(len, new), initial=0))
+			raw.update((id(insn), r.code[a:b]) for insn, a, b in zip(new, offs, offs[1:]))
+
+		saved = sum(map(len, insns)) - sum(map(len, new_insns))
+		print(f'Applied {len(applied)} replacements, {saved} bytes saved')
+		insns = new_insns
+
+	# Find which instructions can be reordered
+	effects = insn_effects(insns)
+	preds = dependency_preds(effects)
+	free = sum(p != (1 << k) - 1 for k, p in enumerate(preds))
+	print(f'{free} instructions can move ahead of some of the previous ones')
 
-	print(f'Ignoring epilog of {len(insns) - (i + 1)} instructions')
-	insns = insns[:i + 1]
+	# Find optimal schedule, or the ones with the best trade-offs between file
+	# size and run time
+	if args.pareto:
+		front = pareto_front(insns, chunks, entry_offset, data_sz, args.jobs,
+			preds, args.window, args.weights)
 
-	# Find optimal schedule
-	schedule = minimize(insns, HEADER_CHUNKS, ENTRY_OFFSET)
+		print('Pareto front of file size against estimated run time:')
+		for k, (size, rt, _) in enumerate(front):
+			print(f'    [{k}] {size:4d} bytes, {rt.cycles:4d} cycles '
+				f'({rt.jumps} taken JMPs, {rt.crossings} fetch line crossings)')
+
+		if not 0 <= args.pick < len(front):
+			sys.exit(f'Invalid --pick, there are {len(front)} layouts!')
+
+		schedule = front[args.pick][2]
+	else:
+		schedule = minimize(insns, chunks, entry_offset, args.jobs,
+			args.naive, preds=preds, window=args.window, model=args.weights)
+
+	# Double check the new order of the instructions
+	index = {id(insn): k for k, insn in enumerate(insns)}
+	order = [index[id(insn)] for _, chunk_insns in schedule for insn in chunk_insns]
+	try:
+		verify_order(insns, order, insns[0].ip, layout.bits)
+	except VerifyError as e:
+		sys.exit(f'Reordering verification failed: {e}')
+
+	moved = sum(k != i for i, k in enumerate(order))
+	print(f'Reordering verified, {moved} instructions moved')
+
+	# Keep a copy without the dummy JMPs added below for the output stage
+	packed = [(chunk, list(chunk_insns)) for chunk, chunk_insns in schedule]
 
 	# Add dummy JMP insns for correct size calculation and insn display
 	for i in range(len(schedule) - 1):
 		jmp_sz = chunk_jmp_size(schedule[i][0], schedule[i + 1][0])
-		schedule[i][1].append(next(Decoder(
-			64, b'\xeb\xfe' if jmp_sz == 2 else b'\xe9\xfb\xff\xff\xff', ip=0)))
+		jmp = b'\xeb\xfe' if jmp_sz == 2 else b'\xe9\xfb\xff\xff\xff'
+		schedule[i][1].append(next(Decoder(layout.bits, jmp, ip=0)))
+		raw[id(schedule[i][1][-1])] = jmp
 
-	# Start with just the heders
-	file_sz = ENTRY_OFFSET
-
-	# Add size of insns in ENTRY and last (AHEAD) chunk, which are after headers
-	file_sz += sum(map(len, schedule[0][1]))
-	file_sz += sum(map(len, schedule[-1][1]))
-
-	# Add size of data constants to embed in the file
-	data_sz  = len('https://binary.golf/5/5')
-	data_sz += len('Host\0')
-	data_sz += len('binary.golf\0')
-	data_sz += 32 # 2 GUIDs
-	file_sz += data_sz
+	# Headers, ENTRY and last (AHEAD) chunk, data constants to embed
+	file_sz = file_size(packed, entry_offset, data_sz)
+	rt = runtime_cost(packed)
 
 	# Parts of the header that are not used as code
-	pure_header_sz = ENTRY_OFFSET - sum(map(attrgetter('size'), HEADER_CHUNKS))
-
+	pure_header_sz = entry_offset - sum(map(attrgetter('size'), chunks))
 	print('-' * 40)
 	print('Best possible file size:', file_sz, 'bytes')
 	print('Of which pure header:', pure_header_sz, 'bytes')
 	print('Of which data:', data_sz, 'bytes')
+	print(f'Estimated run time: {rt.cycles} cycles ({rt.jumps} taken JMPs, '
+		f'{rt.crossings} fetch line crossings)')
+
+	used = {chunk.name for chunk, _ in packed}
+	unused = [chunk.name for chunk in chunks if chunk.name not in used]
+	if unused:
+		print('Unused holes:', ', '.join(unused))
+
 	print('\nExecution plan:')
 
 	for chunk, insns in schedule[:-1]:
@@ -258,8 +1604,63 @@ def main():
 		print(f'\n{chunk.name}:')
 
 		for insn in insns:
-			raw = data[insn.ip:insn.ip + len(insn)].hex()
-			print(f'    {raw:16s}', insn)
+			print(f'    {raw[id(insn)].hex():16s}', insn)
+
+	if args.output is not None:
+		write_packed(args.output, src, layout, args.entry, all_insns, packed,
+			replaced)
+
+
+def write_packed(out: Path, src: Path, layout: Layout, entry_label: str,
+		all_insns: InsnListT, schedule: ScheduleT, replaced: list=()):
+	'''
+	Write the packed NASM source for the given schedule, build it with the
+	closest Makefile and check the resulting binary. Instructions of the
+	schedule need to be among all_insns, which are all the instructions
+	decoded after the entry label in src, or among the new instructions of
+	replaced, a list of (old instructions, new ops, new instructions) from
+	the superoptimizer.
+	'''
+	lines = src.read_text().splitlines()
+	srcmap = dict(zip(map(id, all_insns), map_source(lines, entry_label, all_insns)))
+
+	if replaced:
+		from superopt import format_op
+
+	# New instructions take the place of the first old one, with all labels
+	for old, ops, new in replaced:
+		first = srcmap[id(old[0])]
+		labels = [label for insn in old for label in srcmap[id(insn)].labels]
+
+		for k, (op, insn) in enumerate(zip(ops, new)):
+			srcmap[id(insn)] = SrcInsn(first.lineno, f'{format_op(op):40s} ; superopt',
+				labels if k == 0 else [])
+
+	# UEFI apps had their epilog removed, so they cannot return: hang instead
+	out.write_text(emit_source(lines, src.name, layout, entry_label, srcmap,
+		schedule, layout.fmt == 'pe'))
+
+	# Build with the same rule used for the other sources, i.e. the Makefile in
+	# uefi/asm/ or elf/
+	makedir = out.resolve().parent
+	while not (makedir / 'Makefile').is_file():
+		if makedir == makedir.parent:
+			sys.exit(f'No Makefile found to build {out}!')
+		makedir = makedir.parent
+
+	binary = out.resolve().with_suffix('.efi' if layout.fmt == 'pe' else '')
+	if run(['make', '-C', makedir, binary.relative_to(makedir)]).returncode != 0:
+		sys.exit(f'Failed to build {out}!')
+
+	data = binary.read_bytes()
+	try:
+		verify_packed(data, layout.bits, layout.entry_offset, schedule,
+			[insn for _, chunk_insns in schedule for insn in chunk_insns])
+	except VerifyError as e:
+		sys.exit(f'Verification of {binary.name} failed: {e}')
+
+	print(f'\nWrote {out}, built {binary.name} ({len(data)} bytes) and '
+		'verified its code')
 
 
 if __name__ == '__main__':
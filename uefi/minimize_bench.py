@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Benchmark of the minimize.py solvers: the original exhaustive search
+# (solve_naive()) against the memoized branch-and-bound one (solve()), both
+# sequential and spread over a process pool. Instances are random but seeded:
+# instruction sizes distributed roughly like in the asm sources, and holes of
+# random sizes scattered before the entry point like in a packed header.
+#
+
+import sys
+from argparse import ArgumentParser
+from os import cpu_count
+from random import Random
+from time import perf_counter
+
+from minimize import Chunk, HEADER_CHUNKS, ENTRY_OFFSET, ScheduleT, \
+	chunk_jmp_size, minimize
+
+# Instruction sizes and how common they are
+INSN_SIZES   = (1, 2, 3, 4, 5, 6, 7, 8, 10)
+INSN_WEIGHTS = (8, 14, 12, 10, 8, 4, 4, 2, 1)
+
+
+def random_insns(rng: Random, total_size: int) -> list[bytes]:
+	'''
+	Random instructions adding up to at least total_size bytes. Only their
+	length matters to the solvers.
+	'''
+	insns = []
+
+	while total_size > 0:
+		insns.append(bytes(rng.choices(INSN_SIZES, INSN_WEIGHTS)[0]))
+		total_size -= len(insns[-1])
+
+	return insns
+
+
+def random_chunks(rng: Random, n: int) -> tuple[tuple[Chunk,...],int]:
+	'''
+	Random holes of 4 to 40 bytes with gaps of 2 to 24 bytes between them,
+	followed by the entry point
+	'''
+	chunks = []
+	off = 0x0c
+
+	for i in range(n):
+		size = rng.randint(4, 40)
+		chunks.append(Chunk(f'HOLE{i}', off, size))
+		off += size + rng.randint(2, 24)
+
+	return tuple(chunks), off
+
+
+def schedule_cost(schedule: ScheduleT) -> int:
+	cost = 0
+
+	for (cur, insns), (nxt, _) in zip(schedule, schedule[1:]):
+		jmp_sz = chunk_jmp_size(cur, nxt)
+		cost += jmp_sz - 2 + cur.size - jmp_sz - sum(map(len, insns))
+
+	return cost
+
+
+def timed(f, *a, **kwa):
+	start = perf_counter()
+	res = f(*a, **kwa)
+	return res, perf_counter() - start
+
+
+def main():
+	ap = ArgumentParser(description='Compare the minimize.py solvers on random '
+		'instances with more and more holes')
+	ap.add_argument('--holes', type=int, nargs='+', default=[4, 6, 8, 12, 16, 20],
+		help='hole counts to try (default: 4 6 8 12 16 20)')
+	ap.add_argument('--code-ratio', type=float, default=2.0,
+		help='size of the code to pack relative to the total size of the '
+			'holes (default: 2.0, like in BGGP5_Asm_v3.asm)')
+	ap.add_argument('--max-naive-holes', type=int, default=8,
+		help='do not run the naive solver with more holes (default: 8)')
+	ap.add_argument('-j', '--jobs', type=int, default=cpu_count() or 1,
+		help='worker processes for the parallel run (default and max: number of CPU cores)')
+	ap.add_argument('--seed', type=int, default=5)
+	args = ap.parse_args()
+
+	# More workers than cores only slow minimize() down, so it caps them
+	args.jobs = max(1, min(args.jobs, cpu_count() or 1))
+
+	rng = Random(args.seed)
+	instances = [('PE (HEADER_CHUNKS)', HEADER_CHUNKS, ENTRY_OFFSET)]
+	instances += [('random', *random_chunks(rng, n)) for n in args.holes]
+
+	print(f'{"layout":20s} {"holes":>5s} {"insns":>5s} {"naive":>9s} '
+		f'{"bnb":>9s} {f"bnb -j{args.jobs}":>9s} {"cost":>5s}')
+
+	for name, chunks, entry_offset in instances:
+		insns = random_insns(rng, int(args.code_ratio * sum(c.size for c in chunks)))
+		row = f'{name:20s} {len(chunks):5d} {len(insns):5d}'
+		naive_cost = None
+
+		if len(chunks) <= args.max_naive_holes:
+			schedule, t = timed(minimize, insns, chunks, entry_offset, naive=True, verbose=False)
+			naive_cost = schedule_cost(schedule)
+			row += f' {t:8.3f}s'
+		else:
+			row += f' {"-":>9s}'
+
+		schedule, t = timed(minimize, insns, chunks, entry_offset, 1, verbose=False)
+		cost = schedule_cost(schedule)
+		row += f' {t:8.3f}s'
+
+		schedule, t = timed(minimize, insns, chunks, entry_offset, args.jobs, verbose=False)
+		row += f' {t:8.3f}s {cost:5d}'
+
+		# All solvers must agree on the best cost, and on the instructions
+		if schedule_cost(schedule) != cost or (naive_cost is not None and naive_cost != cost):
+			print(row, 'MISMATCH')
+			sys.exit(1)
+
+		assert [i for _, c in schedule for i in c] == insns
+		print(row, flush=True)
+
+
+if __name__ == '__main__':
+	main()
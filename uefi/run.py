@@ -7,24 +7,59 @@
 #
 
 import atexit
+import json
+import os
+import re
+import shlex
 import socket
 import sys
 from argparse import ArgumentParser, Namespace, RawTextHelpFormatter
-from os import getenv
+from concurrent.futures import ThreadPoolExecutor
 from pathlib import Path
-from shutil import rmtree
-from string import ascii_lowercase, digits
-from subprocess import Popen
+from shutil import copyfile, rmtree, which
+from subprocess import Popen, PIPE, run
 from tempfile import mkdtemp
 from textwrap import TextWrapper
-from time import sleep
-from typing import Tuple, Optional, Iterable
+from threading import Condition, Thread
+from time import monotonic, sleep
+from typing import Callable, Dict, List, Tuple, Optional, Iterable
 
 
 # Dir for temporary files created on demand that will be wiped on exit / CTRL+C
 TMPDIR = None
-# How much time to wait before starting to send keystrokes in auto mode
-EFI_SHELL_WAIT_TIME = 25
+# All QEMU instances started, to stop them on CTRL+C
+QEMUS = []
+# Max time to wait for the UEFI shell to come up and get a DHCP lease
+BOOT_TIMEOUT = 120
+# Max time to wait for each app to finish
+APP_TIMEOUT = 60
+# Max time to wait for each benchmark app to finish (--bench-csv)
+BENCH_TIMEOUT = 600
+# Lines surrounding the CSV results printed by BGGP5_Bench.efi
+BENCH_CSV_BEGIN = b'BGGP5-BENCH-CSV-BEGIN'
+BENCH_CSV_END = b'BGGP5-BENCH-CSV-END'
+# Marker lines echoed by the generated startup.nsh (see make_startup_script())
+RUN_READY = b'BGGP5-RUN-READY'
+RUN_BEGIN = b'BGGP5-RUN-BEGIN'
+RUN_END = b'BGGP5-RUN-END'
+RUN_DONE = b'BGGP5-RUN-DONE'
+# Printed by the UEFI shell before running startup.nsh, any key skips the wait
+SHELL_COUNTDOWN = b'to skip startup.nsh'
+# What a successful BGGP5 download looks like
+BGGP5_DATA = b'Another #BGGP5 download!! @binarygolf https://binary.golf\n'
+# QEMU user networking gateway, pinged to tell when we have a DHCP lease
+SLIRP_GATEWAY = '10.0.2.2'
+# Where the warm-start snapshot lives (see warm_snapshot())
+SNAPSHOT_DIR = Path('snapshot')
+SNAPSHOT_TAG = 'ready'
+# Max time to wait for the hotplugged apps drive to show up in the UEFI shell
+HOTPLUG_TIMEOUT = 10
+# Offline stand-in server for binary.golf (see --serve), and the address where
+# the guest reaches it through guestfwd
+SERVE_PY = Path(__file__).resolve().parent.parent / 'serve.py'
+SERVE_ADDR = '10.0.2.100'
+# URL the apps download from, replaced in their copies with --serve
+BGGP5_URL = 'https://binary.golf/5/5'
 
 
 def get_tmpdir():
@@ -49,8 +84,9 @@ def wrap_help(body: str, width: int=65) -> str:
 def parse_args() -> Namespace:
 	ap = ArgumentParser(
 		description=wrap_help('Run EDKII OVMF in qemu-system-x86_64 and '
-			'optionally also automatically run some UEFI apps through UEFI '
-			'shell with QEMU monitor -- (C) 2024 Marco Bonelli (@mebeim)', 69),
+			'optionally also automatically run some UEFI apps through a '
+			'generated UEFI shell startup script -- (C) 2024 Marco Bonelli '
+			'(@mebeim)', 69),
 		formatter_class=RawTextHelpFormatter
 	)
 
@@ -58,12 +94,40 @@ def parse_args() -> Namespace:
 		help=wrap_help('when --auto or --auto-verify are used, copy these UEFI '
 			'apps into build/ and automatically run them after starting QEMU'))
 	ap.add_argument('--auto', action='store_true',
-		help=wrap_help('automatically run the UEFI apps (sends shell input '
-			'through QEMU monitor)'))
+		help=wrap_help('automatically run the UEFI apps from a generated '
+			'startup.nsh as soon as the network is up, then stop QEMU'))
 	ap.add_argument('--auto-verify', action='store_true',
-		help=wrap_help('Like --auto, but also redirect serial to a temporary '
-			'file and verify that one successful BGGP5 download per UEFI app '
-			'is logged (you will not see any output)'))
+		help=wrap_help('Like --auto, but hide serial output and verify that one '
+			'successful BGGP5 download per UEFI app is logged, stopping QEMU as '
+			'soon as all of them are seen'))
+	ap.add_argument('--bench-csv', metavar='OUT.csv', type=Path,
+		help=wrap_help('Like --auto, but hide serial output, and collect the '
+			'benchmark results printed by each app (see BGGP5_Bench.efi) into '
+			'OUT.csv, with an additional "app" column'))
+	ap.add_argument('--parallel', action='store_true',
+		help=wrap_help('with --auto, --auto-verify or --bench-csv, split the '
+			'apps among multiple QEMU instances running at the same time (see '
+			'--jobs) instead of running them all in one'))
+	ap.add_argument('-j', '--jobs', metavar='N', type=int, default=os.cpu_count() or 1,
+		help=wrap_help('max number of QEMU instances for --parallel (default: '
+			'number of CPU cores)'))
+	ap.add_argument('--warm', action='store_true',
+		help=wrap_help('start from a snapshot of a VM that already booted and '
+			'got a DHCP lease (created on first use in ./snapshot/) instead of '
+			'booting from scratch. Apps are then hotplugged as a USB drive'))
+	ap.add_argument('--warm-reset', action='store_true',
+		help=wrap_help('like --warm, but recreate the snapshot first'))
+	ap.add_argument('--serve', action='store_true',
+		help=wrap_help(f'do not use the Internet: make the stand-in server '
+			f'{SERVE_PY.name} reachable from the guest at {SERVE_ADDR} (ports '
+			f'80 and 443), and point the copies of the apps to '
+			f'http://{SERVE_ADDR}/5/5 instead of {BGGP5_URL}'))
+	ap.add_argument('--serve-https', action='store_true',
+		help=wrap_help(f'like --serve, but point the apps to '
+			f'https://{SERVE_ADDR}/5/5'))
+	ap.add_argument('--serve-args', metavar='ARGS', default='',
+		help=wrap_help(f'additional options for {SERVE_PY.name}, e.g. '
+			'"--latency 50 --bandwidth 1M --chunked"'))
 	ap.add_argument('--edk2-debug', action='store_true',
 		help=wrap_help('enable EDK II debug output to ./edk2-debug.log (only '
 			'useful if you are running an EDK II debug build)'))
@@ -73,9 +137,142 @@ def parse_args() -> Namespace:
 	return ap.parse_args()
 
 
+class SerialWatcher:
+	'''Read QEMU serial output live from a pipe in a background thread, keeping
+	all of it in memory, optionally echoing it, and noting when each marker line
+	printed by the generated startup.nsh shows up. Keystrokes can be sent back
+	through the same serial port.'''
+
+	def __init__(self, qemu: Popen, echo: bool=False, log_path: Optional[Path]=None):
+		self.qemu = qemu
+		self.echo = echo
+		self.log_file = log_path.open('wb') if log_path else None
+		self.data = bytearray()
+		self.markers: List[Tuple[float, bytes]] = []
+		self.closed = False
+		self.cond = Condition()
+		self.thread = Thread(target=self._reader, daemon=True)
+		self.thread.start()
+
+	def _reader(self):
+		fd = self.qemu.stdout.fileno()
+		partial = b''
+
+		while 1:
+			chunk = os.read(fd, 0x1000)
+			if not chunk:
+				break
+
+			if self.echo:
+				sys.stdout.buffer.write(chunk)
+				sys.stdout.buffer.flush()
+			if self.log_file:
+				self.log_file.write(chunk)
+
+			now = monotonic()
+			*lines, partial = (partial + chunk).split(b'\n')
+
+			with self.cond:
+				self.data += chunk
+
+				# Lines may start with terminal escape sequences
+				for line in lines:
+					i = line.find(b'BGGP5-RUN-')
+					if i >= 0:
+						self.markers.append((now, line[i:].strip()))
+
+				self.cond.notify_all()
+
+		with self.cond:
+			self.closed = True
+			self.cond.notify_all()
+
+		if self.log_file:
+			self.log_file.close()
+
+	def send(self, data: bytes):
+		self.qemu.stdin.write(data)
+		self.qemu.stdin.flush()
+
+	def wait_for(self, predicate: Callable[[bytes], bool], timeout: float) -> bool:
+		'''Wait until predicate(serial output so far) is true. Returns False on
+		timeout or if QEMU exits first.'''
+		with self.cond:
+			self.cond.wait_for(lambda: self.closed or predicate(self.data), timeout)
+			return predicate(self.data)
+
+	def output(self) -> bytes:
+		with self.cond:
+			return bytes(self.data)
+
+
+def setup_script_lines() -> List[str]:
+	'''UEFI shell commands setting up the network like the interactive
+	startup.nsh does (same drivers, taken from ./startup.nsh), then waiting for
+	a DHCP lease'''
+	setup = []
+
+	for line in Path('startup.nsh').read_text().splitlines():
+		line = line.strip()
+		if re.match(r'^(FS\d+:|load |ifconfig -s )', line):
+			setup.append(line)
+
+	return setup + [
+		# The lease is held once the gateway answers pings: ping fails right
+		# away as long as the interface has no address
+		'set ready 0',
+		'for %a run (1 300)',
+		'  if "%ready%" == "0" then',
+		f'    ping -n 1 {SLIRP_GATEWAY}',
+		'    if %lasterror% eq 0 then',
+		'      set ready 1',
+		'    else',
+		'      stall 200000',
+		'    endif',
+		'  endif',
+		'endfor',
+	]
+
+
+def run_script_lines(apps: Iterable[Path]) -> List[str]:
+	'''UEFI shell commands running the apps surrounded by marker lines, then
+	shutting down'''
+	script = [f'echo {RUN_READY.decode()}']
+
+	for app in apps:
+		script += [
+			f'echo {RUN_BEGIN.decode()} {app.stem}',
+			f'{app.name}',
+			f'echo {RUN_END.decode()} {app.stem} %lasterror%',
+		]
+
+	return script + [f'echo {RUN_DONE.decode()}', 'reset -s']
+
+
+def make_script(lines: Iterable[str]) -> str:
+	return '\r\n'.join(['echo -off', *lines]) + '\r\n'
+
+
+def make_startup_script(apps: Iterable[Path]) -> str:
+	'''Generate a startup.nsh that sets up the network, waits for a DHCP
+	lease, runs the apps surrounded by marker lines, and shuts down'''
+	return make_script(setup_script_lines() + run_script_lines(apps))
+
+
 def qemu_run(ovmf_code: Path, ovmf_vars: Path, fs_dir: Path,
-		serial_log: Optional[Path]=None, monitor: bool=False, kvm: bool=False,
-		edk2_debug: bool=False) -> Tuple[Popen,Optional[socket.socket]]:
+		piped: bool=False, monitor: bool=False, kvm: bool=False,
+		edk2_debug: bool=False, tmpdir: Optional[Path]=None,
+		warm: Optional[str]=None,
+		guestfwds: Iterable[str]=()) -> Tuple[Popen,Optional[socket.socket]]:
+	'''Start QEMU. For warm starts (see warm_snapshot()), warm is the snapshot
+	tag to load, or '' when creating it: the vars are a qcow2 image to hold the
+	snapshot, the fs dir is read-only (or savevm would refuse to run) and there
+	is an xHCI controller to hotplug the apps drive into later. guestfwds are
+	additional user networking guestfwd rules (see serve_guestfwds()).'''
+	fat = 'fat:rw:' if warm is None else 'fat:'
+	vars_format = 'raw' if warm is None else 'qcow2'
+	nic = ','.join(['user', 'model=virtio-net-pci'] + [f'guestfwd={g}' for g in guestfwds])
+
 	argv = [
 		'qemu-system-x86_64',
 		'-machine', 'q35',
@@ -84,24 +281,25 @@ def qemu_run(ovmf_code: Path, ovmf_vars: Path, fs_dir: Path,
 		'-nographic',
 		'-no-reboot',
 		'-drive', f'if=pflash,format=raw,unit=0,file={ovmf_code},readonly=on',
-		'-drive', f'if=pflash,format=raw,unit=1,file={ovmf_vars}',
-		'-drive', f'format=raw,file=fat:rw:{fs_dir}',
+		'-drive', f'if=pflash,format={vars_format},unit=1,file={ovmf_vars}',
+		'-drive', f'format=raw,file={fat}{fs_dir}',
 		'-global', 'driver=cfi.pflash01,property=secure,value=on',
-		'-nic', 'user,model=virtio-net-pci'
+		'-nic', nic,
+		# Serial on stdio: either the terminal or pipes read by SerialWatcher
+		'-serial', 'stdio'
 	]
 
-	if serial_log:
-		argv += ['-serial', f'file:{serial_log}']
-	else:
-		argv += ['-serial', 'stdio']
-
 	if monitor:
 		# Create a FIFO pipe for QEMU monitor interface in a temporary dir
-		monitor_sock_path = get_tmpdir() / 'monitor.fifo'
+		monitor_sock_path = (tmpdir or get_tmpdir()) / 'monitor.fifo'
 		argv += ['-monitor', f'unix:{monitor_sock_path},server,nowait']
 	else:
 		argv += ['-monitor', 'none']
 
+	if warm is not None:
+		argv += ['-device', 'qemu-xhci,id=xhci']
+	if warm:
+		argv += ['-loadvm', warm]
 	if kvm:
 		argv += ['-enable-kvm']
 	if edk2_debug:
@@ -110,7 +308,12 @@ def qemu_run(ovmf_code: Path, ovmf_vars: Path, fs_dir: Path,
 			'-debugcon', 'file:./edk2-debug.log'
 		]
 
-	qemu = Popen(argv)
+	if piped:
+		qemu = Popen(argv, stdin=PIPE, stdout=PIPE)
+	else:
+		qemu = Popen(argv)
+
+	QEMUS.append(qemu)
 
 	if monitor:
 		monitor_sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
@@ -122,56 +325,349 @@ def qemu_run(ovmf_code: Path, ovmf_vars: Path, fs_dir: Path,
 				break
 			except FileNotFoundError:
 				sleep(0.1)
+
+		# Skip the banner up to the first prompt
+		monitor_command(monitor_sock, None)
 	else:
 		monitor_sock = None
 
 	return qemu, monitor_sock
 
 
-def qemu_send_as_keys(monitor: socket.socket, keys: str):
-	keymap = {c: c for c in ascii_lowercase + digits}
-	keymap |= {c.upper(): f'shift-{c}' for c in ascii_lowercase}
-	keymap |= {
-		'(': 'shift-9', ')': 'shift-0', '.': 'dot', ' ': 'spc',
-		"'": 'apostrophe', '"': 'shift-apostrophe',
-		'=': 'equal', '+': 'shift-equal', '-': 'minus', '_': 'shift-minus',
-		',': 'comma', ';': 'semicolon', '&': 'shift-7', '\n': 'ret'
+def monitor_command(monitor: socket.socket, cmd: Optional[str],
+		timeout: float=30) -> str:
+	'''Send a command to QEMU monitor (if not None) and return its output, up
+	to the next prompt'''
+	out = b''
+	monitor.settimeout(timeout)
+
+	if cmd is not None:
+		monitor.sendall(cmd.encode() + b'\n')
+
+	while b'(qemu)' not in out:
+		chunk = monitor.recv(0x1000)
+		if not chunk:
+			break
+
+		out += chunk
+
+	return out.decode(errors='replace')
+
+
+def warm_snapshot(rootfs: Path, args: Namespace) -> Path:
+	'''Make sure there is an up to date snapshot of a VM that booted, loaded the
+	network drivers, got a DHCP lease and is sitting at the UEFI shell prompt,
+	and return the directory holding it. The snapshot is an internal one
+	(savevm) stored in a qcow2 overlay on top of a copy of OVMF_VARS.fd, since
+	savevm needs a qcow2 image to write the VM state to. It is recreated when
+	anything it depends on changes.'''
+	fs_dir = SNAPSHOT_DIR / 'fs'
+	vars_base = SNAPSHOT_DIR / 'OVMF_VARS.fd'
+	vars_qcow2 = SNAPSHOT_DIR / 'OVMF_VARS.qcow2'
+	key_file = SNAPSHOT_DIR / 'key.json'
+	drivers = sorted(f for f in rootfs.glob('*.efi') if not f.name.startswith('BGGP5'))
+	script = make_script(setup_script_lines() + [f'echo {RUN_READY.decode()}'])
+
+	key = {
+		'kvm': args.kvm,
+		'script': script,
+		'files': {
+			f.name: [f.stat().st_size, f.stat().st_mtime]
+			for f in [rootfs / 'OVMF_CODE.fd', rootfs / 'OVMF_VARS.fd', *drivers]
+		}
 	}
 
-	for k in keys:
-		monitor.sendall(f'sendkey {keymap[k]}\n'.encode())
+	if not args.warm_reset and key_file.is_file() and json.loads(key_file.read_text()) == key:
+		return SNAPSHOT_DIR
 
-	# Just for good measure...
-	sleep(0.5)
+	if which('qemu-img') is None:
+		log('ERROR: qemu-img is needed to create the warm-start snapshot!')
+		sys.exit(1)
 
+	log('Creating warm-start snapshot (this is only needed once)...')
+	start = monotonic()
 
-def run_apps(qemu_monitor: socket.socket, apps: Iterable[Path], verbose: bool=False):
-	if verbose:
-		log('Waiting for UEFI shell + DHCP lease...')
-
-	if getenv('DEV') == '1':
-		# Do things faster while devving on my system
-		sleep(3)
-		# Skip iPXE wait
-		qemu_send_as_keys(qemu_monitor, '\n')
-		# Skip shell wait
-		qemu_send_as_keys(qemu_monitor, '\n')
-		# Wait for commands and DHCP
-		sleep(5)
+	rmtree(SNAPSHOT_DIR, ignore_errors=True)
+	fs_dir.mkdir(parents=True)
+
+	for f in drivers:
+		copyfile(f, fs_dir / f.name)
+
+	(fs_dir / 'startup.nsh').write_text(script)
+	copyfile(rootfs / 'OVMF_VARS.fd', vars_base)
+	run(['qemu-img', 'create', '-q', '-f', 'qcow2', '-F', 'raw', '-b',
+		str(vars_base.resolve()), str(vars_qcow2)], check=True)
+
+	tmpdir = get_tmpdir() / 'snapshot'
+	tmpdir.mkdir()
+
+	qemu, monitor_sock = qemu_run(rootfs / 'OVMF_CODE.fd', vars_qcow2, fs_dir,
+		True, True, args.kvm, args.edk2_debug, tmpdir, '')
+	serial = SerialWatcher(qemu, log_path=tmpdir / 'serial.log')
+	ok = False
+
+	try:
+		if serial.wait_for(lambda out: SHELL_COUNTDOWN in out, BOOT_TIMEOUT):
+			serial.send(b'\r')
+
+			# Wait for the shell prompt after the script is done
+			at_prompt = lambda out: RUN_READY in out and b':\\> ' in out[out.find(RUN_READY):]
+
+			if serial.wait_for(at_prompt, BOOT_TIMEOUT):
+				out = monitor_command(monitor_sock, f'savevm {SNAPSHOT_TAG}', 300)
+				ok = 'Error' not in out and 'error' not in out
+
+				if not ok:
+					log(out.strip())
+	finally:
+		qemu.terminate()
+		qemu.wait()
+		monitor_sock.close()
+
+	if not ok:
+		log('ERROR: failed to create warm-start snapshot')
+		rmtree(SNAPSHOT_DIR, ignore_errors=True)
+		sys.exit(1)
+
+	key_file.write_text(json.dumps(key))
+	log(f'Snapshot created in {monotonic() - start:.1f}s')
+	return SNAPSHOT_DIR
+
+
+def serve_guestfwds(args: Namespace) -> List[str]:
+	'''guestfwd rules making the stand-in server reachable from the guest at
+	SERVE_ADDR, ports 80 (HTTP) and 443 (HTTPS). QEMU spawns a new server for
+	each connection, talking to it through stdin/stdout. The certificates are
+	created once here instead of by each of them.'''
+	if not SERVE_PY.is_file():
+		log(f'ERROR: {SERVE_PY} not found!')
+		sys.exit(1)
+
+	certs = get_tmpdir() / 'certs'
+	run([sys.executable, str(SERVE_PY), '--certs', str(certs), '--make-certs'], check=True)
+	rules = []
+
+	for port, proto in ((80, 'http'), (443, 'https')):
+		cmd = shlex.join([sys.executable, str(SERVE_PY), '--inetd', proto,
+			'--certs', str(certs), *shlex.split(args.serve_args)])
+		# Commas are option separators for QEMU, escaped by doubling them
+		rules.append(f'tcp:{SERVE_ADDR}:{port}-cmd:{cmd}'.replace(',', ',,'))
+
+	return rules
+
+
+def serve_app(app: Path, url: str, tag: str=''):
+	'''Point the copy of an app to url instead of BGGP5_URL, patching the
+	URL in place, NUL-padded (url must not be longer). Both UTF-16 and ASCII
+	copies of it are replaced, the latter for apps that convert it at runtime.'''
+	data = orig = app.read_bytes()
+
+	for enc in ('utf-16-le', 'ascii'):
+		old = BGGP5_URL.encode(enc)
+		data = data.replace(old, url.encode(enc).ljust(len(old), b'\0'))
+
+	if data == orig:
+		log(f'{tag}WARNING: {BGGP5_URL} not found in {app.name}, it will not '
+			'use the stand-in server')
 	else:
-		# Wait for iPXE timeout + UEFI shell timeout + commands + DHCP
-		sleep(EFI_SHELL_WAIT_TIME)
+		app.write_bytes(data)
 
-	qemu_send_as_keys(qemu_monitor, 'ifconfig -l\n')
 
-	for app in apps:
+def hotplug_apps(monitor: socket.socket, apps_dir: Path):
+	'''Plug a read-only USB drive with the contents of apps_dir into a VM started
+	from the warm-start snapshot'''
+	monitor_command(monitor, f'drive_add 0 if=none,id=apps,format=raw,readonly=on,file=fat:{apps_dir}')
+	monitor_command(monitor, 'device_add usb-storage,bus=xhci.0,drive=apps,id=apps-disk')
+
+
+def run_hotplugged_script(serial: SerialWatcher, script: str) -> bool:
+	'''Have the UEFI shell of a VM started from the warm-start snapshot pick up
+	the hotplugged apps drive (as FS1), switch to it and run the given script
+	from it, typing the commands through serial'''
+	deadline = monotonic() + HOTPLUG_TIMEOUT
+
+	# USB enumeration takes a moment, and the shell only maps new file systems
+	# when asked to
+	while monotonic() < deadline:
+		start = len(serial.output())
+		serial.send(b'map -r\r')
+
+		if serial.wait_for(lambda out: b'FS1:' in out[start:], 1):
+			break
+	else:
+		return False
+
+	# The script calls the apps by bare name, which the shell only looks up in
+	# the current directory (and the path), still FS0: after the boot
+	start = len(serial.output())
+	serial.send(b'FS1:\r')
+
+	if not serial.wait_for(lambda out: b'FS1:\\>' in out[start:], max(1, deadline - monotonic())):
+		return False
+
+	serial.send(f'{script}\r'.encode())
+	return True
+
+
+def run_apps(serial: SerialWatcher, apps: List[Path], app_timeout: float,
+		stop_early: Optional[Callable[[bytes], bool]]=None,
+		verbose: bool=False, tag: str='',
+		booting: bool=True) -> Dict[str, Tuple[float, Optional[str]]]:
+	'''Follow the generated startup.nsh through the serial output. Returns the
+	time taken and exit status of each app that ran. If stop_early is given,
+	stop waiting as soon as stop_early(serial output so far) is true. Log
+	messages are prefixed with tag, to tell parallel instances apart. booting
+	is False for a VM started from the warm-start snapshot, which is already
+	past the UEFI shell countdown.'''
+	start = monotonic()
+	done = lambda out: RUN_DONE in out or (stop_early is not None and stop_early(out))
+	say = lambda msg: log(tag + msg)
+
+	if verbose:
+		say('Waiting for UEFI shell...')
+
+	if serial.wait_for(lambda out: SHELL_COUNTDOWN in out or RUN_READY in out, BOOT_TIMEOUT):
+		# Skip the countdown before startup.nsh runs
+		if booting:
+			serial.send(b'\r')
+
 		if verbose:
-			log(f'Running {app.name}...')
+			say(f'UEFI shell up after {monotonic() - start:.1f}s, waiting for DHCP lease...')
+
+		if serial.wait_for(lambda out: RUN_READY in out, BOOT_TIMEOUT):
+			if verbose:
+				say(f'Network ready after {monotonic() - start:.1f}s')
+
+			serial.wait_for(done, app_timeout * len(apps))
+		else:
+			say('ERROR: timed out waiting for DHCP lease')
+	else:
+		say('ERROR: timed out waiting for UEFI shell')
+
+	with serial.cond:
+		markers = list(serial.markers)
+
+	# Pair up begin/end markers to time each app
+	results = {}
+	begin = {}
+
+	for t, line in markers:
+		kind, *rest = line.decode(errors='replace').split()
+		if kind == RUN_BEGIN.decode() and rest:
+			begin[rest[0]] = t
+		elif kind == RUN_END.decode() and rest and rest[0] in begin:
+			results[rest[0]] = (t - begin.pop(rest[0]), rest[1] if len(rest) > 1 else None)
 
-		qemu_send_as_keys(qemu_monitor, f'{app.stem}\n')
-		sleep(2)
+	# Apps still running when we stopped waiting
+	for name, t in begin.items():
+		results[name] = (monotonic() - t, None)
 
-	qemu_monitor.sendall(b'quit\n')
+	return results
+
+
+def app_outputs(serial_output: bytes) -> Dict[str, bytes]:
+	'''Split serial output into the output of each app, using the marker lines
+	printed before each one'''
+	outputs = {}
+
+	for segment in serial_output.split(RUN_BEGIN)[1:]:
+		name, _, rest = segment.partition(b'\n')
+		outputs[name.strip().decode(errors='replace')] = rest.split(RUN_END, 1)[0]
+
+	return outputs
+
+
+def serve_url(args: Namespace) -> str:
+	return f'{"https" if args.serve_https else "http"}://{SERVE_ADDR}/5/5'
+
+
+def run_instance(rootfs: Path, apps: List[Path], args: Namespace,
+		tmpdir: Path, echo: bool, tag: str='',
+		warm_dir: Optional[Path]=None) -> Tuple[Dict[str, Tuple[float, Optional[str]]], bytes]:
+	'''Run the apps in a QEMU instance of its own, with a private vars copy,
+	fs dir (holding the drivers, the apps and the generated startup.nsh),
+	monitor socket and serial log, all in tmpdir. With warm_dir, start from the
+	warm-start snapshot in there instead, hotplugging a drive with the apps and
+	a script to run them. Returns per-app results (see run_apps()) along with
+	the whole serial output.'''
+	fs_dir = tmpdir / 'fs'
+	fs_dir.mkdir(parents=True)
+
+	names = {a.name for a in apps}
+
+	for f in rootfs.glob('*.efi'):
+		if (not f.name.startswith('BGGP5') and not warm_dir) or f.name in names:
+			copyfile(f, fs_dir / f.name)
+
+	if args.serve:
+		for a in apps:
+			serve_app(fs_dir / a.name, serve_url(args), tag)
+
+	if warm_dir:
+		(fs_dir / 'run.nsh').write_text(make_script(run_script_lines(apps)))
+		vars_copy = tmpdir / 'OVMF_VARS.qcow2'
+		copyfile(warm_dir / 'OVMF_VARS.qcow2', vars_copy)
+
+		qemu, monitor_sock = qemu_run(rootfs / 'OVMF_CODE.fd', vars_copy,
+			warm_dir / 'fs', True, True, args.kvm, args.edk2_debug, tmpdir,
+			SNAPSHOT_TAG, args.guestfwds)
+	else:
+		(fs_dir / 'startup.nsh').write_text(make_startup_script(apps))
+		vars_copy = tmpdir / 'OVMF_VARS.copy.fd'
+		copyfile(rootfs / 'OVMF_VARS.fd', vars_copy)
+
+		qemu, monitor_sock = qemu_run(rootfs / 'OVMF_CODE.fd', vars_copy, fs_dir,
+			True, True, args.kvm, args.edk2_debug, tmpdir, None, args.guestfwds)
+
+	serial = SerialWatcher(qemu, echo=echo, log_path=tmpdir / 'serial.log')
+	stop_early = None
+
+	# Every expected download seen, no need to wait for the rest
+	if args.auto_verify and not args.bench_csv:
+		stop_early = lambda out: out.count(BGGP5_DATA) >= len(apps)
+
+	try:
+		if warm_dir:
+			hotplug_apps(monitor_sock, fs_dir)
+
+			if not run_hotplugged_script(serial, 'run.nsh'):
+				log(f'{tag}ERROR: hotplugged apps drive did not show up')
+				return {}, serial.output()
+
+		results = run_apps(serial, apps, BENCH_TIMEOUT if args.bench_csv else APP_TIMEOUT,
+			stop_early, True, tag, warm_dir is None)
+	finally:
+		if qemu.poll() is None:
+			qemu.terminate()
+
+		qemu.wait()
+		monitor_sock.close()
+		serial.thread.join()
+
+	return results, serial.output()
+
+
+def parse_bench_csv(serial_output: bytes) -> List[str]:
+	'''Extract CSV lines between markers, adding the name of the app that
+	printed them (taken from the marker line before them) as first column'''
+	header = None
+	rows = []
+
+	for segment in serial_output.split(RUN_BEGIN)[1:]:
+		name = segment.split(None, 1)[0].decode(errors='replace')
+
+		for chunk in segment.split(BENCH_CSV_BEGIN)[1:]:
+			chunk = chunk.split(BENCH_CSV_END, 1)[0]
+			lines = [l.strip() for l in chunk.decode(errors='replace').splitlines()]
+			lines = [l for l in lines if l]
+
+			if not lines:
+				continue
+
+			header = 'app,' + lines[0]
+			rows += (f'{name},{l}' for l in lines[1:])
+
+	return [header] + rows if header else []
 
 
 def main():
@@ -184,12 +680,16 @@ def main():
 		log('Are you rinning this script from the directory where it is located?')
 		sys.exit(1)
 
-	if args.auto_verify:
+	if args.auto_verify or args.bench_csv:
 		args.auto = True
+	if args.warm_reset:
+		args.warm = True
+	if args.serve_https:
+		args.serve = True
 
 	if args.auto:
 		if not args.apps:
-			log('ERROR: --auto and --auto-verify require at least one APP argument!')
+			log('ERROR: --auto, --auto-verify and --bench-csv require at least one APP argument!')
 			sys.exit(1)
 
 		apps = list(map(Path, args.apps))
@@ -218,53 +718,124 @@ def main():
 			log(f'ERROR: {f} not found or not a file!')
 			sys.exit(1)
 
-	# Copy the startup script in the fs
-	Path(rootfs / 'startup.nsh').write_bytes(startup_script.read_bytes())
-	# Create a copy of the OVMF_VARS.fd file since it will be mounted R/W
-	tmp_ovmf_vars.write_bytes(ovmf_vars.read_bytes())
+	warm_dir = warm_snapshot(rootfs, args) if args.warm else None
+	args.guestfwds = serve_guestfwds(args) if args.serve else []
 
-	# Print some info for the user of this script to understand what's going on
-	if args.auto:
-		n_apps = len(apps)
-		print(f'Will wait {EFI_SHELL_WAIT_TIME}s for UEFI shell + DHCP lease, '
-			f'then run {n_apps} app{"s"[:n_apps ^ 1]}:\n', file=sys.stderr)
+	if args.serve and not args.auto:
+		log(f'Stand-in server reachable from the guest at {SERVE_ADDR}, e.g. '
+			f'BGGP5_Fetch.efi {serve_url(args)}')
+
+	if not args.auto and warm_dir:
+		# Resume the VM at the shell prompt, with build/ as a USB drive
+		tmp_ovmf_vars = get_tmpdir() / 'OVMF_VARS.qcow2'
+		copyfile(warm_dir / 'OVMF_VARS.qcow2', tmp_ovmf_vars)
+
+		log('Launching QEMU from snapshot, run "map -r" to find build/ as FS1...')
+		qemu, monitor_sock = qemu_run(ovmf_code, tmp_ovmf_vars, warm_dir / 'fs',
+			False, True, args.kvm, args.edk2_debug, None, SNAPSHOT_TAG,
+			args.guestfwds)
+		hotplug_apps(monitor_sock, rootfs)
+
+		try:
+			qemu.wait()
+		except KeyboardInterrupt:
+			pass
+
+		return
+
+	if not args.auto:
+		# Copy the startup script in the fs and a copy of the OVMF_VARS.fd file
+		# since it will be mounted R/W
+		Path(rootfs / 'startup.nsh').write_bytes(startup_script.read_bytes())
+		tmp_ovmf_vars.write_bytes(ovmf_vars.read_bytes())
 
-		for a in apps:
-			log(f'  - {a.name} ({a.stat().st_size} bytes)')
-		log('')
-
-		if getenv('DEV') != '1':
-			# Give some time to read the above before the VM clears the terminal
-			if not args.auto_verify:
-				for i in range(5, 0, -1):
-					print(f'\rLaunching QEMU in {i}s...', file=sys.stderr, end='', flush=True)
-					sleep(1)
-	else:
 		log('Launching QEMU...')
+		qemu, _ = qemu_run(ovmf_code, tmp_ovmf_vars, rootfs, False, False,
+			args.kvm, args.edk2_debug, None, None, args.guestfwds)
 
-	if args.auto_verify:
-		serial_log = get_tmpdir() / Path('serial.log')
-	else:
-		serial_log = None
+		try:
+			qemu.wait()
+		except KeyboardInterrupt:
+			pass
 
-	qemu, monitor_sock = qemu_run(ovmf_code, tmp_ovmf_vars, rootfs, serial_log,
-		args.auto, args.kvm, args.edk2_debug)
+		return
 
-	if args.auto:
-		run_apps(monitor_sock, apps, args.auto_verify)
+	# Print some info for the user of this script to understand what's going on
+	n_apps = len(apps)
+	n_instances = min(max(args.jobs, 1), n_apps) if args.parallel else 1
+	log(f'Will run {n_apps} app{"s"[:n_apps ^ 1]} in {n_instances} QEMU '
+		f'instance{"s"[:n_instances ^ 1]} as soon as the network is up:\n')
+
+	for a in apps:
+		log(f'  - {a.name} ({a.stat().st_size} bytes)')
+	log('')
+
+	# Round-robin apps over instances. Only a single instance gets its serial
+	# output shown, since more would interleave.
+	shards = [apps[i::n_instances] for i in range(n_instances)]
+	quiet = args.auto_verify or bool(args.bench_csv) or n_instances > 1
+	start = monotonic()
+
+	with ThreadPoolExecutor(n_instances) as pool:
+		futures = [
+			pool.submit(run_instance, rootfs, shard, args, get_tmpdir() / f'qemu{i}',
+				not quiet, f'[qemu{i}] ' if n_instances > 1 else '', warm_dir)
+			for i, shard in enumerate(shards)
+		]
 
-	try:
-		qemu.wait()
-	except KeyboardInterrupt:
-		pass
+		try:
+			instances = [f.result() for f in futures]
+		except KeyboardInterrupt:
+			for qemu in QEMUS:
+				if qemu.poll() is None:
+					qemu.terminate()
 
-	if args.auto_verify:
-		data = b'Another #BGGP5 download!! @binarygolf https://binary.golf\n'
+			sys.exit(1)
+
+	results = {}
+	outputs = {}
+	serial_outputs = []
+
+	for res, serial_output in instances:
+		results.update(res)
+		outputs.update(app_outputs(serial_output))
+		serial_outputs.append(serial_output)
+
+	# Per-app report: time and exit status, plus verification result
+	n_ok = 0
+
+	for app in apps:
+		line = f'  {app.stem}: '
+
+		if app.stem in results:
+			elapsed, status = results[app.stem]
+			line += f'{elapsed:.2f}s (exit status {status or "?"})'
+		else:
+			line += 'did not run'
 
-		with serial_log.open('rb') as f:
-			serial_output = f.read()
+		if args.auto_verify:
+			ok = BGGP5_DATA in outputs.get(app.stem, b'')
+			n_ok += ok
+			line += ' OK' if ok else ' FAIL'
 
-		n_ok = serial_output.count(data)
+		log(line)
+
+	log(f'Total time: {monotonic() - start:.2f}s')
+
+	if args.bench_csv:
+		lines = []
+
+		for serial_output in serial_outputs:
+			new = parse_bench_csv(serial_output)
+			lines += new[1:] if lines else new
+
+		args.bench_csv.write_text(''.join(l + '\n' for l in lines))
+		log(f'Wrote {max(len(lines) - 1, 0)} benchmark results to {args.bench_csv}')
+
+		if not lines:
+			sys.exit(1)
+
+	if args.auto_verify:
 		log(f'{n_ok}/{n_apps} successful BGGP5 downloads')
 		sys.exit(int(n_ok != n_apps))
 
@@ -0,0 +1,1053 @@
+#!/usr/bin/env python3
+#
+# Bounded superoptimizer for the code packed by minimize.py (see --superopt
+# there). Every window of a few consecutive simple instructions is compared
+# against all the sequences of up to a couple of instructions (MOV, XOR, ADD,
+# INC, PUSH/POP, LEA, ...) on the registers and constants of the window. A
+# sequence shorter than the window (or as long, but with fewer instructions) is
+# proposed if it is equivalent on everything that is live after the window.
+#
+# Equivalence is checked on a small emulator of the supported instructions,
+# first on random machine states, then symbolically: values are kept as affine
+# expressions of the initial registers (modulo 2^width), anything else becomes
+# an uninterpreted term. Equal expressions mean equal values, so a candidate is
+# proven equivalent when all its live outputs have the same expressions as the
+# original ones. The stack below RSP is considered dead.
+#
+
+import sys
+from argparse import ArgumentParser
+from collections import namedtuple
+from pathlib import Path
+from random import Random
+
+from iced_x86 import Decoder, FlowControl, MemorySizeExt, OpKind, Register, \
+	RegisterExt, RflagsBits
+
+from minimize import ASM_DIR, ASM_SOURCE, InsnListT, MNEMONIC_NAMES, \
+	assemble, binary_layout, decode_code, insn_effects
+
+
+Reg = namedtuple('Reg', ['name'])
+Imm = namedtuple('Imm', ['value'])
+Mem = namedtuple('Mem', ['base', 'index', 'scale', 'disp', 'width'])
+Op  = namedtuple('Op', ['mnemonic', 'operands'])
+
+# A proposed replacement of insns[start:end] with ops (encoded as code). Proven
+# means that the symbolic check succeeded, not only the random tests.
+Replacement = namedtuple('Replacement', ['start', 'end', 'ops', 'code', 'proven'])
+
+GPR64 = ('rax', 'rcx', 'rdx', 'rbx', 'rsp', 'rbp', 'rsi', 'rdi') \
+	+ tuple(f'r{i}' for i in range(8, 16))
+GPR32 = ('eax', 'ecx', 'edx', 'ebx', 'esp', 'ebp', 'esi', 'edi') \
+	+ tuple(f'r{i}d' for i in range(8, 16))
+GPR16 = ('ax', 'cx', 'dx', 'bx', 'sp', 'bp', 'si', 'di') \
+	+ tuple(f'r{i}w' for i in range(8, 16))
+GPR8  = ('al', 'cl', 'dl', 'bl', 'spl', 'bpl', 'sil', 'dil') \
+	+ tuple(f'r{i}b' for i in range(8, 16))
+GPR8H = ('ah', 'ch', 'dh', 'bh')
+
+# Register name -> (index of the full register, width, bit offset)
+REGS = {}
+for _w, _names in ((64, GPR64), (32, GPR32), (16, GPR16), (8, GPR8)):
+	REGS.update({n: (i, _w, 0) for i, n in enumerate(_names)})
+REGS.update({n: (i, 8, 8) for i, n in enumerate(GPR8H)})
+
+# Register name -> number in ModRM/opcode encodings (REX bit included)
+REG_NUM = {n: i for names in (GPR64, GPR32, GPR16, GPR8) for i, n in enumerate(names)}
+REG_NUM.update({n: 4 + i for i, n in enumerate(GPR8H)})
+
+# iced_x86 register -> name
+REG_NAMES = {v: k.lower() for k, v in vars(Register).items() if k.isupper()}
+
+RSP = 4
+FLAGS = ('CF', 'PF', 'AF', 'ZF', 'SF', 'OF')
+
+# Instructions known to the emulator
+SUPPORTED = {'mov', 'movzx', 'lea', 'xchg', 'add', 'sub', 'xor', 'and', 'or',
+	'inc', 'dec', 'neg', 'not', 'push', 'pop', 'cdq'}
+
+# Opcode of "OP r/m8, r8" and /digit of "OP r/m, imm"
+ALU_OPCODE = {'add': 0x00, 'or': 0x08, 'and': 0x20, 'sub': 0x28, 'xor': 0x30}
+ALU_DIGIT  = {'add': 0, 'or': 1, 'and': 4, 'sub': 5, 'xor': 6}
+
+
+def mask(w: int) -> int:
+	return (1 << w) - 1
+
+
+def signed(v: int, w: int) -> int:
+	v &= mask(w)
+	return v - (1 << w) if v >> (w - 1) else v
+
+
+def fits(v: int, w: int) -> bool:
+	'''
+	Whether v fits a sign-extended w-bit immediate
+	'''
+	return -(1 << (w - 1)) <= v < (1 << (w - 1))
+
+
+def op_width(op: Op, bits: int) -> int:
+	'''
+	Operand size of an instruction
+	'''
+	if op.mnemonic in ('push', 'pop'):
+		return bits
+	if not op.operands:
+		return 32
+
+	o = op.operands[0]
+	return REGS[o.name][1] if isinstance(o, Reg) else o.width
+
+
+def format_op(op: Op) -> str:
+	'''
+	NASM syntax for an instruction
+	'''
+	def fmt(o):
+		if isinstance(o, Reg):
+			return o.name
+		if isinstance(o, Imm):
+			return hex(o.value)
+
+		res = ' + '.join(filter(None, (o.base, o.index and f'{o.index}*{o.scale}')))
+		if o.disp or not res:
+			res += f' + {o.disp:#x}' if o.disp >= 0 else f' - {-o.disp:#x}'
+		return f'[{res}]'
+
+	return f'{op.mnemonic:6s} ' + ', '.join(map(fmt, op.operands))
+
+
+class Unknown(Exception):
+	'''
+	The symbolic domain cannot tell, e.g. memory accesses that may alias
+	'''
+
+
+class Concrete:
+	'''
+	Concrete values: plain integers. Memory never written reads as random.
+	'''
+	def __init__(self, seed: int):
+		self.seed = seed
+		self.mem = {}
+
+	def const(self, c, w):
+		return c & mask(w)
+
+	def at(self, v, w):
+		return v & mask(w)
+
+	def add(self, a, b, w):
+		return (a + b) & mask(w)
+
+	def sub(self, a, b, w):
+		return (a - b) & mask(w)
+
+	def scale(self, a, c, w):
+		return (a * c) & mask(w)
+
+	@staticmethod
+	def bitop(name, a, b, w):
+		a, b = a & mask(w), b & mask(w)
+		return {'xor': a ^ b, 'and': a & b, 'or': a | b}[name]
+
+	def not_(self, a, w):
+		return ~a & mask(w)
+
+	@staticmethod
+	def sign_fill(a, w):
+		return mask(w) if a >> (w - 1) & 1 else 0
+
+	def extract(self, v, w, shift):
+		return (v >> shift) & mask(w)
+
+	@staticmethod
+	def insert(old, v, w, shift):
+		return (old & ~(mask(w) << shift) | (v & mask(w)) << shift) & mask(64)
+
+	@staticmethod
+	def flag(name, kind, w, a, b, r):
+		if name == 'ZF':
+			return int(r == 0)
+		if name == 'SF':
+			return r >> (w - 1) & 1
+		if name == 'PF':
+			return int(bin(r & 0xff).count('1') % 2 == 0)
+		if kind == 'logic':
+			# AF is undefined
+			return None if name == 'AF' else 0
+		if name == 'AF':
+			return (a ^ b ^ r) >> 4 & 1
+		if kind == 'add':
+			if name == 'CF':
+				return (a + b) >> w & 1
+			return ((a ^ r) & (b ^ r)) >> (w - 1) & 1
+		if name == 'CF':
+			return int(a < b)
+		return ((a ^ b) & (a ^ r)) >> (w - 1) & 1
+
+	def load(self, addr, w):
+		res = 0
+
+		for i in range(w // 8):
+			a = (addr + i) & mask(64)
+			byte = self.mem.get(a)
+			if byte is None:
+				byte = ((a * 0x9e3779b97f4a7c15 + self.seed) >> 29) & 0xff
+			res |= byte << (8 * i)
+
+		return res
+
+	def store(self, addr, w, v):
+		for i in range(w // 8):
+			self.mem[(addr + i) & mask(64)] = v >> (8 * i) & 0xff
+
+	def final_mem(self, rsp):
+		return {a: v for a, v in self.mem.items()
+			if not 0 < (rsp - a) & mask(64) <= 0x1000}
+
+	def key(self, v, w):
+		return None if v is None else v & mask(w)
+
+
+class Sym:
+	'''
+	Symbolic value: sum(coeff * atom) + const modulo 2^w, zero-extended to 64
+	bits. Atoms are the initial registers, memory loads and uninterpreted terms.
+	'''
+	__slots__ = ('terms', 'const', 'w', 'key')
+
+	def __init__(self, terms: dict, const: int, w: int):
+		self.terms = tuple(sorted(((a, c & mask(w)) for a, c in terms.items()
+			if c & mask(w)), key=repr))
+		self.const = const & mask(w)
+		self.w = w
+		self.key = (self.terms, self.const, w)
+
+	def is_const(self) -> bool:
+		return not self.terms
+
+
+class Symbolic:
+	'''
+	Symbolic values (see Sym). Memory is a list of writes, and reads must be
+	told apart from them by constant distances between addresses.
+	'''
+	def __init__(self):
+		self.writes = []
+		self.atoms = {}
+
+	def atom(self, w, *term):
+		sym = Sym({term: 1}, 0, w)
+		self.atoms[term] = sym
+		return sym
+
+	def const(self, c, w):
+		return Sym({}, c, w)
+
+	def at(self, v, w):
+		if v.w >= w:
+			return Sym(dict(v.terms), v.const, w)
+		if v.is_const():
+			return Sym({}, v.const, w)
+		return self.atom(w, 'zx', v.w, v.key)
+
+	def add(self, a, b, w):
+		a, b = self.at(a, w), self.at(b, w)
+		terms = dict(a.terms)
+		for t, c in b.terms:
+			terms[t] = terms.get(t, 0) + c
+		return Sym(terms, a.const + b.const, w)
+
+	def scale(self, a, c, w):
+		a = self.at(a, w)
+		return Sym({t: k * c for t, k in a.terms}, a.const * c, w)
+
+	def sub(self, a, b, w):
+		return self.add(a, self.scale(b, -1, w), w)
+
+	def bitop(self, name, a, b, w):
+		a, b = self.at(a, w), self.at(b, w)
+		if a.is_const() and b.is_const():
+			return Sym({}, Concrete.bitop(name, a.const, b.const, w), w)
+		if a.key == b.key:
+			return Sym({}, 0, w) if name == 'xor' else a
+		if b.is_const():
+			a, b = b, a
+		if a.is_const():
+			if a.const == 0:
+				return a if name == 'and' else b
+			if a.const == mask(w) and name != 'xor':
+				return b if name == 'and' else a
+
+		k1, k2 = sorted((a.key, b.key), key=repr)
+		return self.atom(w, name, w, k1, k2)
+
+	def not_(self, a, w):
+		return self.sub(self.scale(a, -1, w), Sym({}, 1, w), w)
+
+	def sign_fill(self, a, w):
+		a = self.at(a, w)
+		if a.is_const():
+			return Sym({}, Concrete.sign_fill(a.const, w), w)
+		return self.atom(w, 'sx', w, a.key)
+
+	def extract(self, v, w, shift):
+		if v.is_const():
+			return Sym({}, v.const >> shift, w)
+
+		# Reading back a partial register that was just written
+		if len(v.terms) == 1 and v.const == 0 and v.terms[0][1] == 1:
+			term = v.terms[0][0]
+			if term[0] == 'ins' and term[1:3] == (w, shift):
+				return self.atoms[term[4]]
+
+		if shift == 0:
+			return self.at(v, w)
+		return self.atom(w, 'hi', w, shift, v.key)
+
+	def insert(self, old, v, w, shift):
+		old, v = self.at(old, 64), self.at(v, w)
+		if old.is_const() and v.is_const():
+			return Sym({}, Concrete.insert(old.const, v.const, w, shift), 64)
+
+		self.atoms[v.key] = v
+		return self.atom(64, 'ins', w, shift, old.key, v.key)
+
+	def flag(self, name, kind, w, a, b, r):
+		if all(x is None or x.is_const() for x in (a, b, r)):
+			val = Concrete.flag(name, kind, w, a and a.const, b and b.const, r.const)
+			return None if val is None else Sym({}, val, 1)
+		if name in ('ZF', 'SF', 'PF'):
+			return self.atom(1, 'flag', name, w, r.key)
+		if kind == 'logic':
+			return None if name == 'AF' else Sym({}, 0, 1)
+		return self.atom(1, 'flag', name, kind, w, a.key, b.key)
+
+	def distance(self, a, b):
+		d = self.sub(a, b, 64)
+		if not d.is_const():
+			raise Unknown
+		return signed(d.const, 64)
+
+	def load(self, addr, w):
+		for waddr, ww, wv in reversed(self.writes):
+			d = self.distance(addr, waddr)
+			if d == 0 and w == ww:
+				return wv
+			if d < ww // 8 and -d < w // 8:
+				raise Unknown
+
+		return self.atom(w, 'load', w, addr.key)
+
+	def store(self, addr, w, v):
+		self.writes.append((addr, w, self.at(v, w)))
+
+	def final_mem(self, rsp):
+		res = {}
+
+		for i, (addr, w, v) in enumerate(self.writes):
+			try:
+				if self.distance(addr, self.at(rsp, 64)) < 0:
+					continue
+			except Unknown:
+				pass
+
+			# Partially overwritten values are not supported
+			for addr2, w2, _ in self.writes[i + 1:]:
+				d = self.distance(addr2, addr)
+				if (d, w2) != (0, w) and d < w // 8 and -d < w2 // 8:
+					raise Unknown
+
+			res[addr.key] = (w, v.key)
+
+		return res
+
+	def key(self, v, w):
+		return None if v is None else self.at(v, w).key
+
+
+class Machine:
+	'''
+	Emulator of the SUPPORTED instructions, on concrete or symbolic values
+	'''
+	def __init__(self, dom, regs: list, bits: int):
+		self.dom = dom
+		self.regs = list(regs)
+		self.flags = {}
+		self.bits = bits
+
+	def addr(self, m: Mem):
+		d = self.dom
+		a = d.const(m.disp, self.bits)
+		if m.base:
+			a = d.add(a, self.read(Reg(m.base)), self.bits)
+		if m.index:
+			a = d.add(a, d.scale(self.read(Reg(m.index)), m.scale, self.bits), self.bits)
+		return d.at(a, 64)
+
+	def read(self, o, w: int=None):
+		if isinstance(o, Reg):
+			idx, rw, shift = REGS[o.name]
+			return self.dom.extract(self.regs[idx], rw, shift)
+		if isinstance(o, Imm):
+			return self.dom.const(o.value, w)
+		return self.dom.load(self.addr(o), o.width)
+
+	def write(self, o, v):
+		d = self.dom
+		if isinstance(o, Mem):
+			d.store(self.addr(o), o.width, v)
+			return
+
+		idx, w, shift = REGS[o.name]
+		if w >= 32:
+			self.regs[idx] = d.at(v, w)
+		else:
+			self.regs[idx] = d.insert(self.regs[idx], v, w, shift)
+
+	def set_flags(self, kind, w, a, b, r, keep_cf=False):
+		for name in FLAGS:
+			if name != 'CF' or not keep_cf:
+				self.flags[name] = self.dom.flag(name, kind, w, a, b, r)
+
+	def step(self, op: Op):
+		d = self.dom
+		mn, ops = op
+		w = op_width(op, self.bits)
+
+		if mn == 'mov':
+			self.write(ops[0], self.read(ops[1], w))
+		elif mn == 'movzx':
+			self.write(ops[0], d.at(self.read(ops[1]), w))
+		elif mn == 'lea':
+			self.write(ops[0], d.at(self.addr(ops[1]), w))
+		elif mn == 'xchg':
+			a, b = self.read(ops[0]), self.read(ops[1])
+			self.write(ops[0], b)
+			self.write(ops[1], a)
+		elif mn in ('add', 'sub'):
+			a, b = self.read(ops[0]), self.read(ops[1], w)
+			r = (d.add if mn == 'add' else d.sub)(a, b, w)
+			self.set_flags(mn, w, a, b, r)
+			self.write(ops[0], r)
+		elif mn in ('xor', 'and', 'or'):
+			r = d.bitop(mn, self.read(ops[0]), self.read(ops[1], w), w)
+			self.set_flags('logic', w, None, None, r)
+			self.write(ops[0], r)
+		elif mn in ('inc', 'dec'):
+			a, b = self.read(ops[0]), d.const(1, w)
+			r = (d.add if mn == 'inc' else d.sub)(a, b, w)
+			self.set_flags('add' if mn == 'inc' else 'sub', w, a, b, r, keep_cf=True)
+			self.write(ops[0], r)
+		elif mn == 'neg':
+			a, zero = self.read(ops[0]), d.const(0, w)
+			r = d.sub(zero, a, w)
+			self.set_flags('sub', w, zero, a, r)
+			self.write(ops[0], r)
+		elif mn == 'not':
+			self.write(ops[0], d.not_(self.read(ops[0]), w))
+		elif mn == 'push':
+			v = self.read(ops[0], w)
+			self.regs[RSP] = d.sub(self.regs[RSP], d.const(w // 8, w), w)
+			d.store(d.at(self.regs[RSP], 64), w, v)
+		elif mn == 'pop':
+			v = d.load(d.at(self.regs[RSP], 64), w)
+			self.regs[RSP] = d.add(self.regs[RSP], d.const(w // 8, w), w)
+			self.write(ops[0], v)
+		elif mn == 'cdq':
+			self.write(Reg('edx'), d.sign_fill(self.read(Reg('eax')), 32))
+		else:
+			raise ValueError(f'Unsupported instruction: {mn}')
+
+	def outputs(self, live_regs: set[int], live_flags: set[str]) -> tuple:
+		'''
+		Values of live registers and flags ('same' if never written), and
+		memory written
+		'''
+		d = self.dom
+		return (tuple(d.key(self.regs[i], self.bits) for i in sorted(live_regs)),
+			tuple(d.key(self.flags[f], 1) if f in self.flags else 'same'
+				for f in sorted(live_flags)),
+			d.final_mem(self.regs[RSP]))
+
+
+def same_outputs(exp: tuple, out: tuple) -> bool:
+	'''
+	Compare outputs: flags that the original leaves undefined can be anything
+	'''
+	regs, flags, mem = exp
+	return regs == out[0] and mem == out[2] \
+		and all(f is None or f == g for f, g in zip(flags, out[1]))
+
+
+def random_state(rng: Random, bits: int) -> list[int]:
+	'''
+	Random register values, biased towards interesting ones
+	'''
+	regs = []
+
+	for i in range(16):
+		kind = rng.randrange(6)
+		if i == RSP:
+			regs.append((0x7ffc0000 << (bits - 32)) + rng.randrange(1 << 16) * 8)
+		elif kind == 0:
+			regs.append(rng.choice((0, 1, mask(64), mask(32), 0x80, 0x80000000)))
+		elif kind == 1:
+			regs.append(rng.randrange(0x100))
+		elif kind == 2:
+			regs.append(rng.getrandbits(32))
+		else:
+			regs.append(rng.getrandbits(64))
+
+	return regs
+
+
+def run_concrete(ops: list[Op], state: tuple[list[int],int], bits: int,
+		live_regs: set[int], live_flags: set[str]) -> tuple:
+	regs, seed = state
+	m = Machine(Concrete(seed), regs, bits)
+	for op in ops:
+		m.step(op)
+	return m.outputs(live_regs, live_flags)
+
+
+def run_symbolic(ops: list[Op], bits: int, live_regs: set[int],
+		live_flags: set[str]) -> tuple:
+	dom = Symbolic()
+	m = Machine(dom, [dom.atom(64, 'reg', i) for i in range(16)], bits)
+	for op in ops:
+		m.step(op)
+	return m.outputs(live_regs, live_flags)
+
+
+def _modrm(bits: int, w: int, opcode: bytes, reg, rm: str|None,
+		suffix: bytes=b'', mem: Mem=None) -> bytes|None:
+	'''
+	Encode opcode followed by ModRM: reg is a register name or a /digit, rm a
+	register name (mod 11) unless mem is given ([base + disp] only)
+	'''
+	names = [n for n in (reg, rm, mem and mem.base) if isinstance(n, str)]
+	r = REG_NUM[reg] if isinstance(reg, str) else reg
+
+	if mem is None:
+		b = REG_NUM[rm]
+		modrm = bytes([0xc0 | (r & 7) << 3 | (b & 7)])
+	else:
+		b = REG_NUM[mem.base]
+		if mem.disp == 0 and b & 7 != 5:
+			mod, disp = 0, b''
+		elif fits(mem.disp, 8):
+			mod, disp = 1, (mem.disp & 0xff).to_bytes(1, 'little')
+		else:
+			mod, disp = 2, (mem.disp & mask(32)).to_bytes(4, 'little')
+
+		modrm = bytes([mod << 6 | (r & 7) << 3 | (b & 7)])
+		modrm += (b'\x24' if b & 7 == 4 else b'') + disp
+
+	rex = (8 if w == 64 else 0) | (4 if r > 7 else 0) | (1 if b > 7 else 0)
+	need_rex = rex or any(n in ('spl', 'bpl', 'sil', 'dil') for n in names)
+
+	if need_rex and (bits == 32 or any(n in GPR8H for n in names)):
+		return None
+
+	prefix = (b'\x66' if w == 16 else b'') + (bytes([0x40 | rex]) if need_rex else b'')
+	return prefix + opcode + modrm + suffix
+
+
+def _short(bits: int, w: int, opcode: int, reg: str, suffix: bytes=b'') -> bytes|None:
+	'''
+	Encode opcode+reg (PUSH r, MOV r,imm, XCHG eax,r, ...)
+	'''
+	n = REG_NUM[reg]
+	rex = (8 if w == 64 else 0) | n >> 3
+	need_rex = rex or reg in ('spl', 'bpl', 'sil', 'dil')
+
+	if need_rex and bits == 32:
+		return None
+
+	prefix = (b'\x66' if w == 16 else b'') + (bytes([0x40 | rex]) if need_rex else b'')
+	return prefix + bytes([opcode | (n & 7)]) + suffix
+
+
+def encode(op: Op, bits: int) -> bytes|None:
+	'''
+	Encode the instructions used in candidate sequences the same way NASM would
+	(shortest form), None if not encodable
+	'''
+	mn, ops = op
+	w = op_width(op, bits)
+
+	def imm(v: int, size: int) -> bytes:
+		return (v & mask(size)).to_bytes(size // 8, 'little')
+
+	if mn == 'mov' and isinstance(ops[1], Reg):
+		return _modrm(bits, w, b'\x88' if w == 8 else b'\x89', ops[1].name, ops[0].name)
+
+	if mn == 'mov':
+		v = ops[1].value
+		if w == 64:
+			# NASM would use MOV r32,imm32 for these, which does the same
+			if 0 <= v < (1 << 32) or not fits(v, 32):
+				return None
+			return _modrm(bits, w, b'\xc7', 0, ops[0].name, imm(v, 32))
+		return _short(bits, w, 0xb0 if w == 8 else 0xb8, ops[0].name, imm(v, w))
+
+	if mn in ALU_OPCODE and isinstance(ops[1], Reg):
+		opcode = bytes([ALU_OPCODE[mn] | (w != 8)])
+		return _modrm(bits, w, opcode, ops[1].name, ops[0].name)
+
+	if mn in ALU_OPCODE:
+		v, dst = ops[1].value, ops[0].name
+		if w == 8:
+			if dst == 'al':
+				return bytes([ALU_OPCODE[mn] | 4]) + imm(v, 8)
+			return _modrm(bits, w, b'\x80', ALU_DIGIT[mn], dst, imm(v, 8))
+		if fits(signed(v, w), 8):
+			return _modrm(bits, w, b'\x83', ALU_DIGIT[mn], dst, imm(v, 8))
+		if w == 64 and not fits(v, 32):
+			return None
+
+		size = min(w, 32)
+		if REGS[dst][0] == 0:
+			# OP AX/EAX/RAX, imm
+			prefix = b'\x66' if w == 16 else b'\x48' if w == 64 else b''
+			return prefix + bytes([ALU_OPCODE[mn] | 5]) + imm(v, size)
+		return _modrm(bits, w, b'\x81', ALU_DIGIT[mn], dst, imm(v, size))
+
+	if mn in ('inc', 'dec'):
+		digit = 0 if mn == 'inc' else 1
+		if w == 8:
+			return _modrm(bits, w, b'\xfe', digit, ops[0].name)
+		if bits == 32:
+			return _short(bits, w, 0x40 | digit << 3, ops[0].name)
+		return _modrm(bits, w, b'\xff', digit, ops[0].name)
+
+	if mn in ('neg', 'not'):
+		return _modrm(bits, w, b'\xf6' if w == 8 else b'\xf7', 3 if mn == 'neg' else 2,
+			ops[0].name)
+
+	if mn == 'push' and isinstance(ops[0], Imm):
+		v = ops[0].value
+		if fits(v, 8):
+			return b'\x6a' + imm(v, 8)
+		return b'\x68' + imm(v, 32) if fits(v, 32) else None
+
+	if mn in ('push', 'pop'):
+		# Only full registers, the operand size is implied
+		return _short(bits, 32, 0x50 if mn == 'push' else 0x58, ops[0].name)
+
+	if mn == 'lea':
+		return _modrm(bits, w, b'\x8d', ops[0].name, None, mem=ops[1])
+
+	if mn == 'xchg':
+		# Only the short form with AX/EAX/RAX, the one NASM always picks
+		a, b = (o.name for o in ops)
+		if REGS[b][0] == 0:
+			a, b = b, a
+		if w == 8 or REGS[a][0] != 0 or REGS[b][0] == 0:
+			return None
+		return _short(bits, w, 0x90, b)
+
+	if mn == 'movzx':
+		return _modrm(bits, 32, b'\x0f\xb6', ops[0].name, ops[1].name)
+
+	if mn == 'cdq':
+		return b'\x99'
+
+	return None
+
+
+def to_op(insn, bits: int) -> Op|None:
+	'''
+	Convert a decoded instruction to an Op, None if not supported
+	'''
+	mn = MNEMONIC_NAMES[insn.mnemonic]
+	if mn not in SUPPORTED or insn.has_lock_prefix or insn.has_rep_prefix \
+			or insn.has_repne_prefix or insn.segment_prefix != Register.NONE:
+		return None
+
+	imm_kinds = (OpKind.IMMEDIATE8, OpKind.IMMEDIATE16, OpKind.IMMEDIATE32,
+		OpKind.IMMEDIATE64, OpKind.IMMEDIATE8TO16, OpKind.IMMEDIATE8TO32,
+		OpKind.IMMEDIATE8TO64, OpKind.IMMEDIATE32TO64)
+	ops = []
+
+	for i in range(insn.op_count):
+		kind = insn.op_kind(i)
+
+		if kind == OpKind.REGISTER:
+			name = REG_NAMES.get(insn.op_register(i))
+			if name not in REGS:
+				return None
+			ops.append(Reg(name))
+		elif kind in imm_kinds:
+			ops.append(Imm(signed(insn.immediate(i), 64)))
+		elif kind == OpKind.MEMORY:
+			base, index = (REG_NAMES.get(r) if r != Register.NONE else None
+				for r in (insn.memory_base, insn.memory_index))
+			if any(r is not None and r not in REGS for r in (base, index)):
+				return None
+			ops.append(Mem(base, index, insn.memory_index_scale,
+				signed(insn.memory_displacement, 64),
+				MemorySizeExt.size(insn.memory_size) * 8))
+		else:
+			return None
+
+	return Op(mn, tuple(ops))
+
+
+def same_op(a: Op, b: Op|None, bits: int) -> bool:
+	'''
+	Whether two ops are the same instruction: immediates are compared at the
+	operand size, XCHG operands in any order
+	'''
+	if b is None or a.mnemonic != b.mnemonic or len(a.operands) != len(b.operands):
+		return False
+	if a.mnemonic == 'xchg':
+		return set(a.operands) == set(b.operands)
+
+	w = op_width(a, bits)
+	for x, y in zip(a.operands, b.operands):
+		if isinstance(x, Imm) and isinstance(y, Imm):
+			if (x.value ^ y.value) & mask(w):
+				return False
+		elif x != y:
+			return False
+
+	return True
+
+
+def liveness(insns: InsnListT) -> list[tuple[set[int],set[str]]]:
+	'''
+	Registers (as indices of full registers) and flags live after each
+	instruction. Everything is live at the end, and also at calls, syscalls and
+	branches: arguments passed in registers are not among the registers that
+	an instruction reads, and branch targets are not followed.
+	'''
+	effects = insn_effects(insns)
+	flag_names = {getattr(RflagsBits, f): f for f in FLAGS}
+
+	def convert(resources):
+		regs, flags = set(), set()
+
+		for kind, r in resources:
+			if kind == 'r':
+				name = REG_NAMES.get(RegisterExt.full_register(r))
+				if name in REGS:
+					regs.add(REGS[name][0])
+			elif 1 << r in flag_names:
+				flags.add(flag_names[1 << r])
+
+		return regs, flags
+
+	live_regs, live_flags = set(range(16)), set(FLAGS)
+	res = [None] * len(insns)
+
+	for k in range(len(insns) - 1, -1, -1):
+		res[k] = (set(live_regs), set(live_flags))
+		rr, rf = convert(effects[k].reads)
+		wr, wf = convert(effects[k].writes)
+
+		if insns[k].flow_control != FlowControl.NEXT:
+			live_regs, live_flags = set(range(16)), set(FLAGS)
+		else:
+			live_regs = (live_regs - wr) | rr
+			live_flags = (live_flags - wf) | rf
+
+	return res
+
+
+def written_regs(ops: list[Op]) -> set[int]:
+	'''
+	Full registers (possibly) written by a sequence
+	'''
+	res = set()
+
+	for mn, operands in ops:
+		if mn in ('push', 'pop'):
+			res.add(RSP)
+		if mn == 'cdq':
+			res.add(2)
+		if mn == 'xchg':
+			res.update(REGS[o.name][0] for o in operands if isinstance(o, Reg))
+		elif mn != 'push' and operands and isinstance(operands[0], Reg):
+			res.add(REGS[operands[0].name][0])
+
+	return res
+
+
+def candidate_pool(window: list[Op], consts: set[int], bits: int) \
+		-> list[tuple[Op,bytes]]:
+	'''
+	The instructions candidate sequences are made of, with their encoding:
+	any supported operation on the registers of the window (except RSP) and
+	the given constants. Sorted by size.
+	'''
+	regs = set()
+	for op in window:
+		for o in op.operands:
+			if isinstance(o, Reg):
+				regs.add(REGS[o.name][0])
+			elif isinstance(o, Mem):
+				regs.update(REGS[n][0] for n in (o.base, o.index) if n)
+
+	if any(op.mnemonic == 'cdq' for op in window):
+		regs |= {0, 2}
+
+	regs.discard(RSP)
+	regs = sorted(r for r in regs if bits == 64 or r < 8)
+
+	views = {32: [GPR32[r] for r in regs],
+		8: [GPR8[r] for r in regs if bits == 64 or r < 4]}
+	if bits == 64:
+		views[64] = [GPR64[r] for r in regs]
+
+	stack = GPR64 if bits == 64 else GPR32
+	ops = []
+
+	for w, names in views.items():
+		for a in names:
+			ops += [Op(m, (Reg(a),)) for m in ('inc', 'dec', 'neg', 'not')]
+			ops += [Op('mov', (Reg(a), Imm(c))) for c in consts]
+			ops += [Op(m, (Reg(a), Imm(c))) for m in ALU_OPCODE for c in consts
+				if fits(c, 8) and m != 'xor']
+
+			if w == 32:
+				ops.append(Op('xor', (Reg(a), Reg(a))))
+				ops += [Op('movzx', (Reg(a), Reg(b))) for b in views[8]]
+			if w >= 32:
+				ops += [Op('lea', (Reg(a), Mem(b, None, 1, c, 0))) for b in views[bits]
+					for c in consts | {0} if fits(c, 8)]
+
+			for b in names:
+				if a != b:
+					ops += [Op(m, (Reg(a), Reg(b))) for m in ('mov',) + tuple(ALU_OPCODE)]
+					if a < b:
+						ops.append(Op('xchg', (Reg(a), Reg(b))))
+
+	ops += [Op('push', (Imm(c),)) for c in consts]
+	ops += [Op(m, (Reg(stack[r]),)) for r in regs for m in ('push', 'pop')]
+	if {0, 2} <= set(regs):
+		ops.append(Op('cdq', ()))
+
+	pool = [(op, encode(op, bits)) for op in ops]
+	return sorted(((op, code) for op, code in pool if code is not None),
+		key=lambda x: len(x[1]))
+
+
+def sequences(pool: list[tuple[Op,bytes]], n: int, budget: int):
+	'''
+	All sequences of n instructions from the pool (sorted by size) taking less
+	than budget bytes
+	'''
+	if n == 0:
+		yield ()
+		return
+
+	min_size = len(pool[0][1]) if pool else 0
+
+	for op, code in pool:
+		if len(code) + (n - 1) * min_size >= budget:
+			break
+		for rest in sequences(pool, n - 1, budget - len(code)):
+			yield ((op, code),) + rest
+
+
+def superopt_window(window: list[Op], size: int, bits: int, live_regs: set[int],
+		live_flags: set[str], max_len: int=2, tests: int=256, seed: int=5) \
+			-> list[tuple[list[Op],bytes,bool]]:
+	'''
+	Find the best sequence (shortest, then with fewest instructions) of up to
+	max_len instructions equivalent to the window, if better than it, and the
+	best one whose equivalence was proven, if different. Returns them best
+	first, as their ops, their encoding and whether the equivalence was proven.
+	'''
+	rng = Random(seed)
+	states = [(random_state(rng, bits), rng.getrandbits(64)) for _ in range(tests)]
+	expected = [run_concrete(window, s, bits, live_regs, live_flags) for s in states]
+
+	try:
+		sym_expected = run_symbolic(window, bits, live_regs, live_flags)
+		sym_initial = run_symbolic([], bits, live_regs, live_flags)
+	except Unknown:
+		sym_expected = None
+
+	# Constants: immediates of the window, constant results, and the usual ones
+	consts = {0, 1, -1}
+	for op in window:
+		consts.update(o.value for o in op.operands if isinstance(o, Imm))
+
+	if sym_expected is not None:
+		for terms, c, _ in sym_expected[0]:
+			if not terms:
+				consts.update((c, signed(c, 32), signed(c, 8)))
+
+	consts = {c for c in consts if fits(c, 32)}
+
+	# The candidate can only write the registers written by the window and
+	# dead ones, and must write those that the window actually changes
+	allowed = written_regs(window) | {RSP}
+	changed = set()
+	if sym_expected is not None:
+		changed = {i for i, a, b in zip(sorted(live_regs), sym_expected[0],
+			sym_initial[0]) if a != b}
+
+	pool = candidate_pool(window, consts, bits)
+	best = best_proven = None
+	key = lambda b: (len(b[1]), len(b[0]))
+
+	for n in range(1, max_len + 1):
+		# Shorter, or as short with fewer instructions, than the best proven
+		# one: a shorter unproven one does not make it useless
+		ref = best_proven if sym_expected is not None else best
+		ref_size, ref_len = key(ref) if ref else (size, len(window))
+		budget = ref_size + (n < ref_len)
+
+		for combo in sequences(pool, n, budget):
+			cand = [op for op, _ in combo]
+			written = written_regs(cand)
+
+			if not changed <= written or (written - allowed) & live_regs:
+				continue
+
+			if not all(same_outputs(exp, run_concrete(cand, s, bits, live_regs,
+					live_flags)) for s, exp in zip(states, expected)):
+				continue
+
+			proven = False
+			if sym_expected is not None:
+				try:
+					out = run_symbolic(cand, bits, live_regs, live_flags)
+					proven = same_outputs(sym_expected, out)
+				except Unknown:
+					pass
+
+			found = (cand, b''.join(c for _, c in combo), proven)
+			if best is None or (*key(found), not proven) < (*key(best), not best[2]):
+				best = found
+			if proven and (best_proven is None or key(found) < key(best_proven)):
+				best_proven = found
+
+	if best_proven is None or best_proven is best:
+		return [best] if best else []
+
+	return [best, best_proven]
+
+
+def superoptimize(insns: InsnListT, bits: int, max_window: int=3,
+		max_len: int=2, tests: int=256, verbose: bool=False) -> list[Replacement]:
+	'''
+	Look for better sequences for all the windows of up to max_window
+	consecutive supported instructions. No window can contain a branch target
+	other than its first instruction. Returns the replacements found, the ones
+	saving more bytes first. A window can have two: the best one, and the best
+	proven one if the best one was only tested.
+	'''
+	ops = [to_op(insn, bits) for insn in insns]
+	live = liveness(insns)
+	targets = {insn.near_branch_target for insn in insns
+		if insn.flow_control != FlowControl.NEXT}
+	res = []
+
+	for start in range(len(insns)):
+		for end in range(start + 1, min(len(insns), start + max_window) + 1):
+			window = ops[start:end]
+			if window[-1] is None or (end - start > 1 and insns[end - 1].ip in targets):
+				break
+
+			size = sum(map(len, insns[start:end]))
+			live_regs, live_flags = live[end - 1]
+			found = superopt_window(window, size, bits, live_regs, live_flags,
+				max_len, tests)
+
+			for cand, code, proven in found:
+				# Double check the encoding with the decoder
+				decoded = list(Decoder(bits, code, ip=insns[start].ip))
+				if len(decoded) != len(cand) or not all(same_op(a, to_op(b, bits), bits)
+						for a, b in zip(cand, decoded)):
+					sys.exit(f'Bad encoding for {cand}: {code.hex()}')
+
+				res.append(Replacement(start, end, cand, code, proven))
+
+				if verbose:
+					old = '; '.join(map(str, insns[start:end]))
+					new = '; '.join(' '.join(format_op(op).split()) for op in cand)
+					print(f'    {insns[start].ip:#06x}: {old} ({size} bytes) -> {new} '
+						f'({len(code)} bytes, {"proven" if proven else "tested only"})')
+
+	res.sort(key=lambda r: (len(r.code) - sum(map(len, insns[r.start:r.end])),
+		not r.proven))
+	return res
+
+
+def apply_replacements(insns: InsnListT, repls: list[Replacement], bits: int,
+		proven_only: bool=True) -> tuple[InsnListT,list[tuple[Replacement,InsnListT]]]:
+	'''
+	Apply the best non-overlapping replacements that save space. The new
+	instructions are decoded at the address of the ones they replace, while
+	the following ones keep theirs: addresses stay unique, but are not
+	contiguous anymore (see verify_order()). Returns
+	the new list of instructions and the applied replacements along with
+	their new instructions.
+	'''
+	taken = [False] * len(insns)
+	applied = []
+
+	for r in repls:
+		saved = sum(map(len, insns[r.start:r.end])) - len(r.code)
+		if saved <= 0 or (proven_only and not r.proven) or any(taken[r.start:r.end]):
+			continue
+
+		taken[r.start:r.end] = [True] * (r.end - r.start)
+		applied.append((r, list(Decoder(bits, r.code, ip=insns[r.start].ip))))
+
+	res = list(insns)
+	for r, new in sorted(applied, key=lambda x: x[0].start, reverse=True):
+		res[r.start:r.end] = new
+
+	return res, applied
+
+
+def main():
+	ap = ArgumentParser(description='Look for shorter equivalent sequences of '
+		'instructions in the code of a NASM source')
+	ap.add_argument('source', type=Path, nargs='?', default=ASM_DIR / ASM_SOURCE,
+		help=f'NASM source (default: {ASM_DIR / ASM_SOURCE})')
+	ap.add_argument('--entry', default='ENTRY', metavar='LABEL',
+		help='label of the code to optimize (default: ENTRY)')
+	ap.add_argument('--end', metavar='LABEL',
+		help='label of the end of the code to optimize (default: first RET)')
+	ap.add_argument('--window', type=int, default=3,
+		help='max instructions to replace at once (default: 3)')
+	ap.add_argument('--max-len', type=int, default=2,
+		help='max instructions of a replacement (default: 2)')
+	ap.add_argument('--tests', type=int, default=256,
+		help='random states to test candidates on (default: 256)')
+	args = ap.parse_args()
+
+	if not args.source.is_file():
+		sys.exit(f'{args.source} not found!')
+
+	data, labels = assemble(args.source)
+	_, bits = binary_layout(data)
+
+	for label in filter(None, (args.entry, args.end)):
+		if label not in labels:
+			sys.exit(f'Label {label} not found in {args.source}!')
+
+	insns = decode_code(data, bits, labels[args.entry],
+		labels[args.end] if args.end else None)
+	print(f'Parsed {len(insns)} instructions of {bits}-bit code')
+
+	repls = superoptimize(insns, bits, args.window, args.max_len, args.tests, True)
+	_, applied = apply_replacements(insns, repls, bits)
+	saved = sum(sum(map(len, insns[r.start:r.end])) - len(r.code) for r, _ in applied)
+
+	print(f'{len(repls)} replacements found, the best non-overlapping proven '
+		f'ones save {saved} bytes')
+
+
+if __name__ == '__main__':
+	main()
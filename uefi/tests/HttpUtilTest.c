@@ -0,0 +1,151 @@
+/** @file
+  Host tests for ../c/HttpUtil.c, see Makefile.
+
+  The TSC is simulated: it only moves forward in Stall(), at FAKE_TSC_HZ.
+
+  Every URL is copied to a heap buffer of its exact size, so that reading past
+  its terminator is caught by AddressSanitizer.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "HttpUtil.h"
+
+#define FAKE_TSC_HZ 2500000000ULL
+
+STATIC UINTN  mFailed;
+STATIC UINT64 mTsc;
+
+
+UINT64
+AsmReadTsc (
+  VOID
+  )
+{
+  return mTsc;
+}
+
+
+UINT64
+MultU64x32 (
+  IN UINT64 Multiplicand,
+  IN UINT32 Multiplier
+  )
+{
+  return Multiplicand * Multiplier;
+}
+
+
+STATIC
+EFI_STATUS
+FakeStall (
+  IN UINTN Microseconds
+  )
+{
+  mTsc += FAKE_TSC_HZ / 1000000 * Microseconds;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_BOOT_SERVICES mBootServices = { FakeStall };
+EFI_BOOT_SERVICES        *gBS          = &mBootServices;
+
+
+STATIC
+VOID
+CheckUrlHost (
+  IN CONST CHAR16 *Url,
+  IN UINTN        HostSize,
+  IN CONST CHAR8  *Expected  // NULL if Url must be rejected
+  )
+{
+  UINTN      Len = 0;
+  CHAR16     *Copy;
+  CHAR8      Host[256];
+  CHAR8      Printable[256];
+  EFI_STATUS Status;
+
+  while (Url[Len] != L'\0')
+    Len++;
+
+  for (UINTN i = 0; i <= Len && i < sizeof (Printable); i++)
+    Printable[i] = (CHAR8)(Url[i] > 0x7f ? '?' : Url[i]);
+  Printable[sizeof (Printable) - 1] = '\0';
+
+  Copy = malloc ((Len + 1) * sizeof (CHAR16));
+  memcpy (Copy, Url, (Len + 1) * sizeof (CHAR16));
+
+  Status = HttpUtilUrlHost (Copy, Host, HostSize);
+  free (Copy);
+
+  if (Expected == NULL && !EFI_ERROR (Status))
+    goto fail;
+  if (Expected != NULL && (EFI_ERROR (Status) || strcmp (Host, Expected) != 0))
+    goto fail;
+
+  return;
+
+fail:
+  printf ("FAIL: \"%s\" (HostSize %zu): expected %s%s%s, got %s%s%s\n",
+    Printable, HostSize,
+    Expected ? "\"" : "", Expected ? Expected : "error", Expected ? "\"" : "",
+    EFI_ERROR (Status) ? "" : "\"", EFI_ERROR (Status) ? "error" : Host, EFI_ERROR (Status) ? "" : "\"");
+  mFailed++;
+}
+
+
+int
+main (
+  VOID
+  )
+{
+  // Short hosts: the terminator right after "://" or close to it
+  CheckUrlHost (L"http://a", 256, "a");
+  CheckUrlHost (L"http://ab", 256, "ab");
+  CheckUrlHost (L"http://a/", 256, "a");
+  CheckUrlHost (L"http://ab/", 256, "ab");
+  CheckUrlHost (L"http://a.b/", 256, "a.b");
+
+  CheckUrlHost (L"https://binary.golf/5/5", 256, "binary.golf");
+  CheckUrlHost (L"http://127.0.0.1:8080/5/5", 256, "127.0.0.1:8080");
+  CheckUrlHost (L"http://h?q=1", 256, "h");
+  CheckUrlHost (L"http://h#x", 256, "h");
+
+  // Exactly fits, one too long
+  CheckUrlHost (L"http://abc/", 4, "abc");
+  CheckUrlHost (L"http://abcd/", 4, NULL);
+
+  // No scheme, no authority, not ASCII
+  CheckUrlHost (L"", 256, NULL);
+  CheckUrlHost (L":", 256, NULL);
+  CheckUrlHost (L"http:", 256, NULL);
+  CheckUrlHost (L"http:/", 256, NULL);
+  CheckUrlHost (L"http://", 256, NULL);
+  CheckUrlHost (L"http:///5/5", 256, NULL);
+  CheckUrlHost (L"binary.golf/5/5", 256, NULL);
+  CheckUrlHost (L"http://b\x00e9/", 256, NULL);
+
+  // Calibration must not depend on where the TSC starts
+  mTsc = 12345;
+  if (HttpUtilTscFrequency () != FAKE_TSC_HZ) {
+    printf ("FAIL: HttpUtilTscFrequency: expected %llu\n", FAKE_TSC_HZ);
+    mFailed++;
+  }
+
+  if (mFailed != 0) {
+    printf ("%zu failed\n", mFailed);
+    return 1;
+  }
+
+  printf ("HttpUtil: all passed\n");
+  return 0;
+}
@@ -0,0 +1,26 @@
+/** @file
+  Minimal stand-in for the EDK II BaseLib.h. The functions are defined by the
+  tests themselves, so that they can control what the TSC reads.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef BASE_LIB_H_
+#define BASE_LIB_H_
+
+#include <Uefi.h>
+
+UINT64
+AsmReadTsc (
+  VOID
+  );
+
+UINT64
+MultU64x32 (
+  IN UINT64 Multiplicand,
+  IN UINT32 Multiplier
+  );
+
+#endif // BASE_LIB_H_
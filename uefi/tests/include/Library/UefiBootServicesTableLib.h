@@ -0,0 +1,21 @@
+/** @file
+  Minimal stand-in for the EDK II UefiBootServicesTableLib.h, with only the
+  boot services used by the helpers under test. gBS is defined by the tests.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef UEFI_BOOT_SERVICES_TABLE_LIB_H_
+#define UEFI_BOOT_SERVICES_TABLE_LIB_H_
+
+#include <Uefi.h>
+
+typedef struct {
+  EFI_STATUS (*Stall) (IN UINTN Microseconds);
+} EFI_BOOT_SERVICES;
+
+extern EFI_BOOT_SERVICES *gBS;
+
+#endif // UEFI_BOOT_SERVICES_TABLE_LIB_H_
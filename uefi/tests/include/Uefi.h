@@ -0,0 +1,37 @@
+/** @file
+  Minimal stand-in for the EDK II Uefi.h, enough to build the shared
+  helpers in ../c on the host for testing, with -fshort-wchar like EDK II does.
+
+  Copyright (c) 2024, Marco Bonelli. All rights reserved.
+  SPDX-License-Identifier: MIT
+
+**/
+
+#ifndef UEFI_H_
+#define UEFI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IN
+#define OUT
+#define CONST  const
+#define STATIC static
+#define VOID   void
+
+typedef char           CHAR8;
+typedef unsigned short CHAR16;
+typedef unsigned char  BOOLEAN;
+typedef size_t         UINTN;
+typedef uint32_t       UINT32;
+typedef uint64_t       UINT64;
+typedef UINTN          EFI_STATUS;
+
+#define TRUE  ((BOOLEAN)1)
+#define FALSE ((BOOLEAN)0)
+
+#define EFI_SUCCESS           ((EFI_STATUS)0)
+#define EFI_INVALID_PARAMETER ((EFI_STATUS)(2 | ((UINTN)1 << (sizeof (UINTN) * 8 - 1))))
+#define EFI_ERROR(Status)     ((intptr_t)(Status) < 0)
+
+#endif // UEFI_H_
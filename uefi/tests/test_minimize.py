@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+#
+# Host tests for ../minimize.py and ../superopt.py, see Makefile.
+#
+
+import sys
+import unittest
+from pathlib import Path
+
+try:
+	from iced_x86 import Decoder
+except ImportError:
+	raise unittest.SkipTest('iced_x86 not installed')
+
+sys.path.insert(0, str(Path(__file__).resolve().parent.parent))
+
+from minimize import VerifyError, verify_order
+import superopt
+from superopt import Imm, Op, Reg, Replacement, Unknown, apply_replacements, \
+	superopt_window
+
+
+# Same shape as the start of BGGP5_Asm_v3.asm: set a counter, then loop back
+CODE = bytes.fromhex(
+	'31c9'   # 0x0: xor  ecx, ecx
+	'b105'   # 0x2: mov  cl, 5
+	'31d2'   # 0x4: xor  edx, edx
+	'01ca'   # 0x6: add  edx, ecx   ; .loop
+	'e2fc'   # 0x8: loop .loop
+	'89d0'   # 0xa: mov  eax, edx
+)
+
+# push 5; pop rcx: 3 bytes instead of 4
+SHORTER = Replacement(0, 2, [], bytes.fromhex('6a0559'), True)
+
+
+class TestVerifyOrder(unittest.TestCase):
+	def setUp(self):
+		self.insns = list(Decoder(64, CODE, ip=0))
+		self.new, applied = apply_replacements(self.insns, [SHORTER], 64)
+		self.assertEqual(len(applied), 1)
+		self.assertEqual(len(self.new), 6)
+
+	def test_original(self):
+		verify_order(self.insns, list(range(6)), 0)
+
+	def test_shorter_replacement_before_loop(self):
+		verify_order(self.new, list(range(6)), 0)
+
+	def test_shorter_replacement_reordered(self):
+		# XOR EDX,EDX does not depend on PUSH/POP
+		verify_order(self.new, [2, 0, 1, 3, 4, 5], 0)
+
+	def test_bad_order(self):
+		# Nothing can move into or out of the loop
+		with self.assertRaises(VerifyError):
+			verify_order(self.new, [0, 1, 3, 2, 4, 5], 0)
+
+
+class TestSuperoptWindow(unittest.TestCase):
+	MOV_EAX_0 = [Op('mov', (Reg('eax'), Imm(0)))]
+
+	def setUp(self):
+		self.run_symbolic = superopt.run_symbolic
+
+	def tearDown(self):
+		superopt.run_symbolic = self.run_symbolic
+
+	def test_proven_kept_when_shorter_unproven(self):
+		# Pretend that no single instruction can be proven equivalent: XOR
+		# EAX,EAX is then only tested, and a longer proven one must be kept
+		def run_symbolic(ops, *args):
+			if len(ops) == 1 and ops != self.MOV_EAX_0:
+				raise Unknown
+			return self.run_symbolic(ops, *args)
+
+		superopt.run_symbolic = run_symbolic
+		found = superopt_window(self.MOV_EAX_0, 5, 64, {0}, set())
+
+		self.assertEqual(len(found), 2)
+		self.assertEqual(found[0][1:], (bytes.fromhex('31c0'), False))
+		self.assertTrue(found[1][2])
+		self.assertLess(len(found[1][1]), 5)
+
+
+if __name__ == '__main__':
+	unittest.main()